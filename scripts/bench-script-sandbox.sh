@@ -0,0 +1,53 @@
+#!/bin/bash
+# Compare the throughput of the script sandboxes rpm-ostree can use
+# (RPMOSTREE_SCRIPT_SANDBOX=rofiles|overlay, see src/libpriv/rpmostree-scripts.c)
+# on a read-heavy command.  Must be run as root, on a scratch copy of a rootfs,
+# e.g. a checkout of a tree.
+#   bench-script-sandbox.sh ROOTFS [ITERATIONS] [COMMAND...]
+set -euo pipefail
+
+rootfs=$(realpath $1)
+shift
+iterations=${1:-5}
+shift || true
+if test $# -eq 0; then
+    set -- ldconfig -C /tmp/ld.so.cache
+fi
+
+tmpd=$(mktemp -d /tmp/bench-script-sandbox.XXXXXX)
+cleanup() {
+    umount ${tmpd}/mnt 2>/dev/null || fusermount -u ${tmpd}/mnt 2>/dev/null || true
+    rm -rf ${tmpd}
+    rm -rf ${rootfs}/.bench-overlay
+}
+trap cleanup EXIT
+mkdir ${tmpd}/mnt
+
+# Roughly what rpmostree_bwrap_new() does; see also bwrap-script-shell.sh
+BWRAP_ARGV="--dev /dev --proc /proc --dir /tmp --chdir / \
+     --unshare-pid --unshare-uts --unshare-ipc --unshare-cgroup-try --unshare-net"
+for src in lib{,32,64} bin sbin; do
+    if test -L ${rootfs}/$src; then
+        BWRAP_ARGV="$BWRAP_ARGV --symlink usr/$src /$src"
+    fi
+done
+BWRAP_ARGV="$BWRAP_ARGV --bind ${tmpd}/mnt /usr --ro-bind ${rootfs}/var /var --tmpfs /var/tmp"
+
+run() {
+    local start end
+    start=$(date +%s.%N)
+    for i in $(seq ${iterations}); do
+        (cd ${rootfs} && env PATH=/usr/sbin:/usr/bin bwrap $BWRAP_ARGV "$@" >/dev/null)
+    done
+    end=$(date +%s.%N)
+    echo "scale=3; ($end - $start) / ${iterations}" | bc
+}
+
+(cd ${rootfs} && rofiles-fuse ./usr ${tmpd}/mnt)
+echo "rofiles: $(run "$@")s per run"
+fusermount -u ${tmpd}/mnt
+
+mkdir -p ${rootfs}/.bench-overlay/{upper,work}
+mount -t overlay overlay -o lowerdir=${rootfs}/usr,upperdir=${rootfs}/.bench-overlay/upper,workdir=${rootfs}/.bench-overlay/work ${tmpd}/mnt
+echo "overlay: $(run "$@")s per run"
+umount ${tmpd}/mnt
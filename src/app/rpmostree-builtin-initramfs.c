@@ -33,12 +33,14 @@ static char *opt_osname;
 static gboolean opt_enable;
 static gboolean opt_disable;
 static char **opt_add_arg;
+static char **opt_etc_overlay;
 static gboolean opt_reboot;
 
 static GOptionEntry option_entries[] = {
   { "os", 0, 0, G_OPTION_ARG_STRING, &opt_osname, "Operate on provided OSNAME", "OSNAME" },
   { "enable", 0, 0, G_OPTION_ARG_NONE, &opt_enable, "Enable regenerating initramfs locally", NULL },
   { "arg", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_add_arg, "Append ARG to the dracut arguments", "ARG" },
+  { "etc-overlay", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_etc_overlay, "Instead of running dracut, add host FILE in /etc to the base initramfs", "FILE" },
   { "disable", 0, 0, G_OPTION_ARG_NONE, &opt_disable, "Disable regenerating initramfs locally", NULL },
   { "reboot", 'r', 0, G_OPTION_ARG_NONE, &opt_reboot, "Initiate a reboot after operation is complete", NULL },
   { NULL }
@@ -51,6 +53,8 @@ get_args_variant (void)
 
   g_variant_dict_init (&dict, NULL);
   g_variant_dict_insert (&dict, "reboot", "b", opt_reboot);
+  if (opt_etc_overlay)
+    g_variant_dict_insert (&dict, "etc-overlay", "^as", opt_etc_overlay);
 
   return g_variant_dict_end (&dict);
 }
@@ -102,6 +106,7 @@ rpmostree_builtin_initramfs (int             argc,
           g_autoptr(GVariant) child = g_variant_iter_next_value (&iter);
           g_autoptr(GVariantDict) dict = NULL;
           g_autofree char **initramfs_args = NULL;
+          g_autofree char **initramfs_etc = NULL;
           gboolean is_booted;
 
           if (child == NULL)
@@ -119,6 +124,7 @@ rpmostree_builtin_initramfs (int             argc,
           if (cur_regenerate)
             {
               g_variant_dict_lookup (dict, "initramfs-args", "^a&s", &initramfs_args);
+              g_variant_dict_lookup (dict, "initramfs-etc", "^a&s", &initramfs_etc);
             }
 
           g_print ("Initramfs regeneration: %s\n", cur_regenerate ? "enabled" : "disabled");
@@ -129,6 +135,13 @@ rpmostree_builtin_initramfs (int             argc,
                 g_print ("%s ", *iter);
               g_print ("\n");
             }
+          if (initramfs_etc)
+            {
+              g_print ("Initramfs /etc overlay: ");
+              for (char **iter = initramfs_etc; iter && *iter; iter++)
+                g_print ("%s ", *iter);
+              g_print ("\n");
+            }
         }
     }
   else if (opt_enable && opt_disable)
@@ -146,6 +159,12 @@ rpmostree_builtin_initramfs (int             argc,
                        "Cannot simultaenously specify --disable and --arg");
           return EXIT_FAILURE;
         }
+      if (opt_etc_overlay && (opt_disable || opt_add_arg))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "--etc-overlay may only be used with --enable, and not with --arg");
+          return EXIT_FAILURE;
+        }
       if (!opt_add_arg)
         opt_add_arg = empty_strv;
 
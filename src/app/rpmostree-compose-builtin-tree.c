@@ -57,6 +57,7 @@ static char *opt_touch_if_changed;
 static gboolean opt_dry_run;
 static gboolean opt_print_only;
 static char *opt_write_commitid_to;
+static int opt_commit_jobs;
 
 static GOptionEntry option_entries[] = {
   { "add-metadata-string", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_metadata_strings, "Append given key and value (in string format) to metadata", "KEY=VALUE" },
@@ -73,6 +74,7 @@ static GOptionEntry option_entries[] = {
   { "dry-run", 0, 0, G_OPTION_ARG_NONE, &opt_dry_run, "Just print the transaction and exit", NULL },
   { "print-only", 0, 0, G_OPTION_ARG_NONE, &opt_print_only, "Just expand any includes and print treefile", NULL },
   { "write-commitid-to", 0, 0, G_OPTION_ARG_STRING, &opt_write_commitid_to, "File to write the composed commitid to instead of updating the ref", "FILE" },
+  { "commit-jobs", 0, 0, G_OPTION_ARG_INT, &opt_commit_jobs, "Number of threads to use when committing the tree (default: number of processors)", "N" },
   { NULL }
 };
 
@@ -100,6 +102,7 @@ typedef struct {
   OstreeRepo *repo;
   char *ref;
   char *previous_checksum;
+  guint64 installed_size;
 
   GBytes *serialized_treefile;
 } RpmOstreeTreeComposeContext;
@@ -389,6 +392,14 @@ install_packages_in_root (RpmOstreeTreeComposeContext  *self,
 
   rpmostree_print_transaction (hifctx);
 
+  /* Used as the progress estimate when committing, so we don't have to
+   * walk the tree just to size it */
+  { g_autoptr(GPtrArray) pkgs = hy_goal_list_installs (dnf_context_get_goal (hifctx), NULL);
+    self->installed_size = 0;
+    for (guint i = 0; i < pkgs->len; i++)
+      self->installed_size += dnf_package_get_installsize (pkgs->pdata[i]);
+  }
+
   JsonArray *add_files = NULL;
   if (json_object_has_member (treedata, "add-files"))
     add_files = json_object_get_array_member (treedata, "add-files");
@@ -1043,6 +1054,8 @@ rpmostree_compose_builtin_tree (int             argc,
   }
 
   if (!rpmostree_commit (rootfs_fd, repo, self->ref, opt_write_commitid_to, metadata, gpgkey, selinux, NULL,
+                         opt_cachedir ? self->cachedir_dfd : -1,
+                         MAX (opt_commit_jobs, 0), self->installed_size,
                          &new_revision,
                          cancellable, error))
     goto out;
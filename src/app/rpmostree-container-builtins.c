@@ -42,7 +42,12 @@ static GOptionEntry init_option_entries[] = {
   { NULL }
 };
 
+static int opt_import_jobs;
+static gboolean opt_merged_checkout;
+
 static GOptionEntry assemble_option_entries[] = {
+  { "import-jobs", 0, 0, G_OPTION_ARG_INT, &opt_import_jobs, "Number of packages to import in parallel (default: number of processors)", "N" },
+  { "merged-checkout", 0, 0, G_OPTION_ARG_NONE, &opt_merged_checkout, "Check out all packages at once from a merged tree", NULL },
   { NULL }
 };
 
@@ -114,6 +119,11 @@ roc_context_prepare_for_root (ROContainerContext *rocctx,
   if (!rocctx->ctx)
     goto out;
 
+  if (opt_import_jobs > 0)
+    rpmostree_context_set_import_jobs (rocctx->ctx, opt_import_jobs);
+  if (opt_merged_checkout)
+    rpmostree_context_set_merged_checkout (rocctx->ctx, TRUE);
+
   if (!rpmostree_context_setup (rocctx->ctx, NULL, "/", treespec, cancellable, error))
     goto out;
 
@@ -300,12 +310,8 @@ rpmostree_container_builtin_assemble (int             argc,
 
   rpmostree_print_transaction (rpmostree_context_get_hif (rocctx->ctx));
 
-  /* --- Download as necessary --- */
-  if (!rpmostree_context_download (rocctx->ctx, cancellable, error))
-    goto out;
-
-  /* --- Import as necessary --- */
-  if (!rpmostree_context_import (rocctx->ctx, cancellable, error))
+  /* --- Download and import as necessary --- */
+  if (!rpmostree_context_download_and_import (rocctx->ctx, cancellable, error))
     goto out;
 
   { g_autofree char *tmprootfs = g_strdup ("tmp/rpmostree-commit-XXXXXX");
@@ -508,12 +514,8 @@ rpmostree_container_builtin_upgrade (int argc, char **argv,
       }
   }
 
-  /* --- Download as necessary --- */
-  if (!rpmostree_context_download (rocctx->ctx, cancellable, error))
-    goto out;
-
-  /* --- Import as necessary --- */
-  if (!rpmostree_context_import (rocctx->ctx, cancellable, error))
+  /* --- Download and import as necessary --- */
+  if (!rpmostree_context_download_and_import (rocctx->ctx, cancellable, error))
     goto out;
 
   { g_autofree char *tmprootfs = g_strdup ("tmp/rpmostree-commit-XXXXXX");
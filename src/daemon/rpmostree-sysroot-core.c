@@ -163,6 +163,11 @@ clean_pkgcache_orphans (OstreeSysroot            *sysroot,
   if (!rpmostree_get_pkgcache_repo (repo, &pkgcache_repo, cancellable, error))
     return FALSE;
 
+  g_autoptr(RpmOstreePkgCacheIndex) index =
+    rpmostree_pkgcache_index_new (pkgcache_repo, cancellable, error);
+  if (!index)
+    return FALSE;
+
   g_autoptr(GPtrArray) deployments = ostree_sysroot_get_deployments (sysroot);
   for (guint i = 0; i < deployments->len; i++)
     {
@@ -197,12 +202,11 @@ clean_pkgcache_orphans (OstreeSysroot            *sysroot,
       GHashTable *local_replace = rpmostree_origin_get_overrides_local_replace (origin);
       GLNX_HASH_TABLE_FOREACH (local_replace, const char*, nevra)
         {
-          g_autofree char *cachebranch = NULL;
-          if (!rpmostree_find_cache_branch_by_nevra (pkgcache_repo, nevra, &cachebranch,
-                                                     cancellable, error))
-            return FALSE;
+          const char *cachebranch = rpmostree_pkgcache_index_lookup_nevra (index, nevra);
+          if (!cachebranch)
+            return glnx_throw (error, "Failed to find cached pkg for %s", nevra);
 
-          g_hash_table_add (referenced_pkgs, g_steal_pointer (&cachebranch));
+          g_hash_table_add (referenced_pkgs, g_strdup (cachebranch));
         }
     }
 
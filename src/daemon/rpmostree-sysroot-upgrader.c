@@ -450,14 +450,15 @@ rpmostree_sysroot_upgrader_pull (RpmOstreeSysrootUpgrader  *self,
 }
 
 static gboolean
-checkout_base_tree (RpmOstreeSysrootUpgrader *self,
-                    GCancellable          *cancellable,
-                    GError               **error)
+checkout_tree (RpmOstreeSysrootUpgrader *self,
+               const char               *revision,
+               GCancellable             *cancellable,
+               GError                  **error)
 {
   g_assert_cmpint (self->tmprootfs_dfd, ==, -1);
 
   /* let's give the user some feedback so they don't think we're blocked */
-  rpmostree_output_task_begin ("Checking out tree %.7s", self->base_revision);
+  rpmostree_output_task_begin ("Checking out tree %.7s", revision);
 
   int repo_dfd = ostree_repo_get_dfd (self->repo); /* borrowed */
   /* Always delete this */
@@ -491,19 +492,13 @@ checkout_base_tree (RpmOstreeSysrootUpgrader *self,
     { .devino_to_csum_cache = self->devino_cache };
   if (!ostree_repo_checkout_at (self->repo, &checkout_options,
                                 repo_dfd, RPMOSTREE_TMP_ROOTFS_DIR,
-                                self->base_revision, cancellable, error))
+                                revision, cancellable, error))
     return FALSE;
 
   if (!glnx_opendirat (repo_dfd, RPMOSTREE_TMP_ROOTFS_DIR, FALSE,
                        &self->tmprootfs_dfd, error))
     return FALSE;
 
-  /* build a centralized rsack for it, since we need it in a few places */
-  self->rsack = rpmostree_get_refsack_for_root (self->tmprootfs_dfd, ".",
-                                                cancellable, error);
-  if (self->rsack == NULL)
-    return FALSE;
-
   rpmostree_output_task_end ("done");
 
   return TRUE;
@@ -514,15 +509,16 @@ checkout_base_tree (RpmOstreeSysrootUpgrader *self,
  * assembled commit metadata. Probably assemble_commit() should live somewhere
  * else, maybe directly in `container-builtins.c`. */
 static RpmOstreeTreespec *
-generate_treespec (RpmOstreeSysrootUpgrader *self)
+generate_treespec (RpmOstreeSysrootUpgrader *self,
+                   GPtrArray                *overlay_packages)
 {
   g_autoptr(GKeyFile) treespec = g_key_file_new ();
 
-  if (self->overlay_packages->len > 0)
+  if (overlay_packages->len > 0)
     {
       g_key_file_set_string_list (treespec, "tree", "packages",
-                                  (const char* const*)self->overlay_packages->pdata,
-                                  self->overlay_packages->len);
+                                  (const char* const*)overlay_packages->pdata,
+                                  overlay_packages->len);
     }
 
   GHashTable *local_packages = rpmostree_origin_get_local_packages (self->origin);
@@ -616,12 +612,16 @@ finalize_replacement_overrides (RpmOstreeSysrootUpgrader *self,
   g_autoptr(OstreeRepo) pkgcache_repo = NULL;
   if (!rpmostree_get_pkgcache_repo (self->repo, &pkgcache_repo, cancellable, error))
     return FALSE;
+  g_autoptr(RpmOstreePkgCacheIndex) index =
+    rpmostree_pkgcache_index_new (pkgcache_repo, cancellable, error);
+  if (!index)
+    return FALSE;
 
   GLNX_HASH_TABLE_FOREACH_KV (local_replacements, const char*, nevra, const char*, sha256)
     {
       /* use the pkgcache because there's no safe way to go from nevra --> pkgname */
       g_autofree char *pkgname = NULL;
-      if (!rpmostree_get_nevra_from_pkgcache (pkgcache_repo, nevra, &pkgname, NULL, NULL,
+      if (!rpmostree_get_nevra_from_pkgcache (index, nevra, &pkgname, NULL, NULL,
                                               NULL, NULL, cancellable, error))
         return FALSE;
 
@@ -691,6 +691,10 @@ finalize_overlays (RpmOstreeSysrootUpgrader *self,
       g_autoptr(OstreeRepo) pkgcache_repo = NULL;
       if (!rpmostree_get_pkgcache_repo (self->repo, &pkgcache_repo, cancellable, error))
         return FALSE;
+      g_autoptr(RpmOstreePkgCacheIndex) index =
+        rpmostree_pkgcache_index_new (pkgcache_repo, cancellable, error);
+      if (!index)
+        return FALSE;
 
       GLNX_HASH_TABLE_FOREACH_KV (local_pkgs, const char*, nevra, const char*, sha256)
         {
@@ -698,7 +702,7 @@ finalize_overlays (RpmOstreeSysrootUpgrader *self,
           g_autofree char *path =
             g_strdup_printf ("%s/%s.rpm", self->metatmpdir_path, nevra);
 
-          if (!rpmostree_pkgcache_find_pkg_header (pkgcache_repo, nevra, sha256,
+          if (!rpmostree_pkgcache_find_pkg_header (index, nevra, sha256,
                                                    &header, cancellable, error))
             return FALSE;
 
@@ -772,6 +776,22 @@ finalize_overlays (RpmOstreeSysrootUpgrader *self,
   return TRUE;
 }
 
+/* How @origin wants the initramfs generated, in the form recorded in client
+ * layer commits by rpmostree_context_set_initramfs_state().
+ */
+static GVariant *
+origin_initramfs_state (RpmOstreeOrigin *origin)
+{
+  static const char *const empty[] = { NULL };
+  const gboolean regenerate = rpmostree_origin_get_regenerate_initramfs (origin);
+  const char *const *args = regenerate ? rpmostree_origin_get_initramfs_args (origin) : NULL;
+  const char *const *etc_files = regenerate ? rpmostree_origin_get_initramfs_etc (origin) : NULL;
+
+  return g_variant_ref_sink (g_variant_new ("(b@as@as)", regenerate,
+                                            g_variant_new_strv (args ?: empty, -1),
+                                            g_variant_new_strv (etc_files ?: empty, -1)));
+}
+
 static gboolean
 prepare_context_for_assembly (RpmOstreeSysrootUpgrader *self,
                               RpmOstreeContext         *ctx,
@@ -808,50 +828,144 @@ prepare_context_for_assembly (RpmOstreeSysrootUpgrader *self,
     return FALSE;
 
   rpmostree_context_set_sepolicy (ctx, sepolicy);
+
+  g_autoptr(GVariant) initramfs_state = origin_initramfs_state (self->origin);
+  rpmostree_context_set_initramfs_state (ctx, initramfs_state);
   return TRUE;
 }
 
+/* Look for a layered commit among the deployments for this OS which was
+ * assembled from the same base and the same package state (as computed by
+ * rpmostree_context_get_state_sha512()), e.g. when redeploying after a rollback.
+ * The base is the commit's parent.  The scripts and initramfs settings must
+ * match as well; commits which predate recording those are never reused.
+ */
 static gboolean
-do_local_assembly (RpmOstreeSysrootUpgrader *self,
-                   GCancellable             *cancellable,
-                   GError                  **error)
+find_reusable_layered_commit (RpmOstreeSysrootUpgrader *self,
+                              const char               *state_checksum,
+                              gboolean                  noscripts,
+                              char                    **out_commit,
+                              GError                  **error)
+{
+  g_autoptr(GVariant) initramfs_state = origin_initramfs_state (self->origin);
+  g_autoptr(GPtrArray) deployments = ostree_sysroot_get_deployments (self->sysroot);
+  for (guint i = 0; i < deployments->len; i++)
+    {
+      OstreeDeployment *deployment = deployments->pdata[i];
+      const char *csum = ostree_deployment_get_csum (deployment);
+
+      if (!g_str_equal (ostree_deployment_get_osname (deployment), self->osname))
+        continue;
+
+      g_autoptr(GVariant) commit = NULL;
+      if (!ostree_repo_load_commit (self->repo, csum, &commit, NULL, error))
+        return FALSE;
+
+      g_autofree char *parent = ostree_commit_get_parent (commit);
+      if (!parent || !g_str_equal (parent, self->base_revision))
+        continue;
+
+      g_autoptr(GVariant) metadata = g_variant_get_child_value (commit, 0);
+      g_autoptr(GVariantDict) dict = g_variant_dict_new (metadata);
+      gboolean is_layered = FALSE;
+      gboolean commit_noscripts;
+      const char *commit_state = NULL;
+      g_variant_dict_lookup (dict, "rpmostree.clientlayer", "b", &is_layered);
+      g_variant_dict_lookup (dict, "rpmostree.state-sha512", "&s", &commit_state);
+      if (!is_layered || g_strcmp0 (commit_state, state_checksum) != 0)
+        continue;
+      if (!g_variant_dict_lookup (dict, "rpmostree.noscripts", "b", &commit_noscripts) ||
+          commit_noscripts != noscripts)
+        continue;
+      g_autoptr(GVariant) commit_initramfs =
+        g_variant_dict_lookup_value (dict, "rpmostree.initramfs", (GVariantType*)"(basas)");
+      if (!commit_initramfs || !g_variant_equal (commit_initramfs, initramfs_state))
+        continue;
+
+      *out_commit = g_strdup (csum);
+      return TRUE;
+    }
+
+  *out_commit = NULL;
+  return TRUE;
+}
+
+static gboolean
+assembly_has_packages (RpmOstreeSysrootUpgrader *self)
+{
+  return self->overlay_packages->len > 0 ||
+         g_hash_table_size (rpmostree_origin_get_local_packages (self->origin)) > 0 ||
+         self->override_remove_packages->len > 0 ||
+         self->override_replace_local_packages->len > 0;
+}
+
+/* Set up a context for the checked out tmprootfs and resolve the packages.
+ * Normally the tmprootfs is the base and we layer @overlay_packages on it; if
+ * @previous_layer is set, it's a checkout of that client layer instead, and
+ * @overlay_packages only has the ones to add on top.
+ */
+static RpmOstreeContext *
+prepare_assembly (RpmOstreeSysrootUpgrader *self,
+                  GPtrArray                *overlay_packages,
+                  const char               *previous_layer,
+                  GCancellable             *cancellable,
+                  GError                  **error)
 {
   g_autoptr(RpmOstreeContext) ctx = rpmostree_context_new_system (cancellable, error);
+  if (!ctx)
+    return NULL;
   g_autofree char *tmprootfs_abspath = glnx_fdrel_abspath (self->tmprootfs_dfd, ".");
 
   if (!prepare_context_for_assembly (self, ctx, tmprootfs_abspath, cancellable, error))
-    return FALSE;
-
-  GHashTable *local_pkgs = rpmostree_origin_get_local_packages (self->origin);
+    return NULL;
 
   /* NB: We're pretty much using the defaults for the other treespec values like
    * instlang and docs since it would be hard to expose the cli for them because
    * they wouldn't affect just the new pkgs, but even previously added ones. */
-  g_autoptr(RpmOstreeTreespec) treespec = generate_treespec (self);
+  g_autoptr(RpmOstreeTreespec) treespec = generate_treespec (self, overlay_packages);
   if (treespec == NULL)
-    return FALSE;
+    return NULL;
 
   if (!rpmostree_context_setup (ctx, tmprootfs_abspath, NULL, treespec, cancellable, error))
-    return FALSE;
+    return NULL;
 
   g_autoptr(OstreeRepo) pkgcache_repo = NULL;
   if (!rpmostree_get_pkgcache_repo (self->repo, &pkgcache_repo, cancellable, error))
-    return FALSE;
+    return NULL;
 
   rpmostree_context_set_repos (ctx, self->repo, pkgcache_repo);
 
-  const gboolean have_packages = (self->overlay_packages->len > 0 ||
-                                  g_hash_table_size (local_pkgs) > 0 ||
-                                  self->override_remove_packages->len > 0 ||
-                                  self->override_replace_local_packages->len > 0);
-  if (have_packages)
+  if (previous_layer)
+    {
+      /* Record everything we layer, not just what we're adding */
+      g_autoptr(GPtrArray) all_packages = g_ptr_array_new ();
+      for (guint i = 0; i < self->overlay_packages->len; i++)
+        g_ptr_array_add (all_packages, self->overlay_packages->pdata[i]);
+      g_ptr_array_sort (all_packages, rpmostree_ptrarray_sort_compare_strings);
+      g_ptr_array_add (all_packages, NULL);
+      rpmostree_context_set_previous_layer (ctx, previous_layer,
+                                            (const char *const*)all_packages->pdata);
+    }
+
+  if (assembly_has_packages (self))
     {
       if (!rpmostree_context_prepare (ctx, cancellable, error))
-        return FALSE;
+        return NULL;
     }
   else
     rpmostree_context_set_is_empty (ctx);
 
+  return g_steal_pointer (&ctx);
+}
+
+static gboolean
+do_local_assembly (RpmOstreeSysrootUpgrader *self,
+                   RpmOstreeContext         *ctx,
+                   GCancellable             *cancellable,
+                   GError                  **error)
+{
+  const gboolean have_packages = assembly_has_packages (self);
+
   if (self->flags & RPMOSTREE_SYSROOT_UPGRADER_FLAGS_DRY_RUN)
     {
       if (have_packages)
@@ -859,18 +973,36 @@ do_local_assembly (RpmOstreeSysrootUpgrader *self,
       return TRUE; /* Note early return */
     }
 
-  if (have_packages)
+  const gboolean noscripts =
+    (self->flags & RPMOSTREE_SYSROOT_UPGRADER_FLAGS_PKGOVERLAY_NOSCRIPTS) > 0;
+
+  /* If we already have a commit for exactly this, we can skip everything else.
+   * Not when regenerating the initramfs though, since that depends on more
+   * than the package state.
+   */
+  if (have_packages && !rpmostree_origin_get_regenerate_initramfs (self->origin))
     {
-      if (!rpmostree_context_download (ctx, cancellable, error))
+      g_autofree char *state = rpmostree_context_get_state_sha512 (ctx);
+      g_autofree char *existing = NULL;
+      if (!find_reusable_layered_commit (self, state, noscripts, &existing, error))
         return FALSE;
-      if (!rpmostree_context_import (ctx, cancellable, error))
+      if (existing)
+        {
+          g_print ("Reusing previously assembled commit %s\n", existing);
+          g_free (self->final_revision);
+          self->final_revision = g_steal_pointer (&existing);
+          return TRUE; /* Note early return */
+        }
+    }
+
+  if (have_packages)
+    {
+      if (!rpmostree_context_download_and_import (ctx, cancellable, error))
         return FALSE;
       if (!rpmostree_context_relabel (ctx, cancellable, error))
         return FALSE;
 
       g_clear_pointer (&self->final_revision, g_free);
-      gboolean noscripts =
-        (self->flags & RPMOSTREE_SYSROOT_UPGRADER_FLAGS_PKGOVERLAY_NOSCRIPTS) > 0;
 
       /* --- override/overlay and commit --- */
       if (!rpmostree_context_assemble_tmprootfs (ctx, self->tmprootfs_dfd,
@@ -904,17 +1036,75 @@ do_local_assembly (RpmOstreeSysrootUpgrader *self,
                      &kernel_path, &initramfs_path);
       g_assert (initramfs_path);
 
-      if (!rpmostree_run_dracut (self->tmprootfs_dfd, add_dracut_argv, kver,
-                                 initramfs_path, &initramfs_tmpf,
-                                 cancellable, error))
-        return FALSE;
+      const char *const* etc_files = rpmostree_origin_get_initramfs_etc (self->origin);
+      gboolean cached = FALSE;
+      if (etc_files && *etc_files)
+        {
+          if (!rpmostree_initramfs_overlay_etc (self->tmprootfs_dfd, initramfs_path,
+                                                etc_files, &initramfs_tmpf,
+                                                cancellable, error))
+            return FALSE;
+        }
+      else
+        {
+          /* Regenerating is slow, and the result only depends on the tree and
+           * the host config; reuse the last one if none of that changed.  We
+           * can't know everything in /etc that dracut reads though (see
+           * rpmostree_initramfs_cache_key()), so this is opt-in for now.
+           */
+          g_autofree char *cache_key = NULL;
+          if (g_strcmp0 (g_getenv ("RPMOSTREE_INITRAMFS_CACHE"), "1") == 0)
+            {
+              g_autofree char *state = rpmostree_context_get_state_sha512 (ctx);
+              cache_key = rpmostree_initramfs_cache_key (self->tmprootfs_dfd, kver,
+                                                         initramfs_path, add_dracut_argv,
+                                                         state, cancellable, error);
+              if (!cache_key)
+                return FALSE;
+
+              if (!rpmostree_initramfs_cache_lookup (self->repo, cache_key, self->tmprootfs_dfd,
+                                                     &cached, &initramfs_tmpf,
+                                                     cancellable, error))
+                return FALSE;
+            }
+
+          if (cached)
+            {
+              /* Same as rpmostree_run_dracut() does for the rebuild case */
+              (void) unlinkat (self->tmprootfs_dfd, initramfs_path, 0);
+            }
+          else
+            {
+              if (!rpmostree_run_dracut (self->tmprootfs_dfd, add_dracut_argv, kver,
+                                         initramfs_path, &initramfs_tmpf,
+                                         cancellable, error))
+                return FALSE;
+              /* The cache is only an optimization; don't fail the deployment
+               * over it, e.g. if the repo is short on space.
+               */
+              g_autoptr(GError) local_error = NULL;
+              if (cache_key &&
+                  !rpmostree_initramfs_cache_store (self->repo, cache_key, initramfs_tmpf.fd,
+                                                    cancellable, &local_error))
+                {
+                  if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                    {
+                      g_propagate_error (error, g_steal_pointer (&local_error));
+                      return FALSE;
+                    }
+                  g_print ("warning: Failed to cache initramfs: %s\n", local_error->message);
+                  sd_journal_print (LOG_WARNING, "Failed to cache initramfs: %s",
+                                    local_error->message);
+                }
+            }
+        }
 
       if (!rpmostree_finalize_kernel (self->tmprootfs_dfd, bootdir, kver, kernel_path,
                                       &initramfs_tmpf,
                                       cancellable, error))
         return FALSE;
 
-      rpmostree_output_task_end ("done");
+      rpmostree_output_task_end (cached ? "done (cached)" : "done");
     }
 
   if (!rpmostree_context_commit_tmprootfs (ctx, self->tmprootfs_dfd, self->devino_cache,
@@ -934,8 +1124,7 @@ requires_local_assembly (RpmOstreeSysrootUpgrader *self)
    * another optimization here for that case. This is a bit tricky: assuming we
    * came here from an 'rpm-ostree install', this might mean that we redeploy
    * the exact same base layer, with the only difference being the origin file.
-   * We could down the line experiment with optimizing this by just updating the
-   * merge deployment's origin.
+   * See also try_update_pending_origin().
    * https://github.com/projectatomic/rpm-ostree/issues/753
    */
 
@@ -946,13 +1135,143 @@ requires_local_assembly (RpmOstreeSysrootUpgrader *self)
          rpmostree_origin_get_regenerate_initramfs (self->origin);
 }
 
+/* Adding packages to an existing client layer doesn't require starting over
+ * from the base: we can check out the current layered commit and just add the
+ * new packages (and their scripts and rpmdb entries) on top.  Determine whether
+ * that's safe, and if so, return the layered commit and the packages to add.
+ * We require the same base, only additions of regular packages, and no base
+ * removals/replacements or local packages either before or after, since those
+ * can't be reasoned about additively.  Note that unlike a full assembly, this
+ * keeps the previously layered packages at their current versions, much like
+ * `dnf install` would.
+ */
+static gboolean
+find_incremental_layer (RpmOstreeSysrootUpgrader *self,
+                        char                    **out_previous_layer,
+                        GPtrArray               **out_new_packages,
+                        GError                  **error)
+{
+  *out_previous_layer = NULL;
+  *out_new_packages = NULL;
+
+  const char *env = g_getenv ("RPMOSTREE_INCREMENTAL_LAYERING");
+  if (g_strcmp0 (env, "0") == 0)
+    return TRUE;
+
+  if ((self->flags & RPMOSTREE_SYSROOT_UPGRADER_FLAGS_DRY_RUN) ||
+      rpmostree_origin_get_regenerate_initramfs (self->origin) ||
+      g_hash_table_size (rpmostree_origin_get_local_packages (self->origin)) > 0 ||
+      self->override_remove_packages->len > 0 ||
+      self->override_replace_local_packages->len > 0 ||
+      self->overlay_packages->len == 0)
+    return TRUE;
+
+  OstreeDeployment *previous = self->origin_merge_deployment;
+  const char *previous_csum = ostree_deployment_get_csum (previous);
+  g_autoptr(GVariant) commit = NULL;
+  if (!ostree_repo_load_commit (self->repo, previous_csum, &commit, NULL, error))
+    return FALSE;
+
+  g_autofree char *parent = ostree_commit_get_parent (commit);
+  if (!parent || !g_str_equal (parent, self->base_revision))
+    return TRUE;
+
+  g_autoptr(GVariant) metadata = g_variant_get_child_value (commit, 0);
+  g_autoptr(GVariantDict) dict = g_variant_dict_new (metadata);
+  gboolean is_layered = FALSE;
+  guint clientlayer_version = 0;
+  gboolean noscripts = FALSE;
+  g_variant_dict_lookup (dict, "rpmostree.clientlayer", "b", &is_layered);
+  g_variant_dict_lookup (dict, "rpmostree.clientlayer_version", "u", &clientlayer_version);
+  g_variant_dict_lookup (dict, "rpmostree.noscripts", "b", &noscripts);
+  if (!is_layered || clientlayer_version < 2 ||
+      noscripts != ((self->flags & RPMOSTREE_SYSROOT_UPGRADER_FLAGS_PKGOVERLAY_NOSCRIPTS) > 0))
+    return TRUE;
+
+  g_autoptr(GVariant) removed = NULL;
+  g_autoptr(GVariant) replaced = NULL;
+  removed = g_variant_dict_lookup_value (dict, "rpmostree.removed-base-packages",
+                                         G_VARIANT_TYPE ("av"));
+  replaced = g_variant_dict_lookup_value (dict, "rpmostree.replaced-base-packages",
+                                          G_VARIANT_TYPE ("a(vv)"));
+  if (!removed || g_variant_n_children (removed) > 0 ||
+      !replaced || g_variant_n_children (replaced) > 0)
+    return TRUE;
+
+  /* Local packages aren't recorded in the commit, so check its origin.  We
+   * also need the initramfs in it to be the base one, as it is for us
+   * (we don't get here when regenerating); otherwise it'd carry over.
+   */
+  g_autoptr(RpmOstreeOrigin) previous_origin =
+    rpmostree_origin_parse_deployment (previous, error);
+  if (!previous_origin)
+    return FALSE;
+  if (g_hash_table_size (rpmostree_origin_get_local_packages (previous_origin)) > 0)
+    return TRUE;
+  g_autoptr(GVariant) previous_initramfs = origin_initramfs_state (previous_origin);
+  g_autoptr(GVariant) initramfs_state = origin_initramfs_state (self->origin);
+  if (!g_variant_equal (previous_initramfs, initramfs_state))
+    return TRUE;
+  g_autoptr(GVariant) commit_initramfs =
+    g_variant_dict_lookup_value (dict, "rpmostree.initramfs", (GVariantType*)"(basas)");
+  if (commit_initramfs && !g_variant_equal (commit_initramfs, initramfs_state))
+    return TRUE;
+
+  g_autofree char **previous_packages = NULL;
+  if (!g_variant_dict_lookup (dict, "rpmostree.packages", "^a&s", &previous_packages))
+    return TRUE;
+
+  /* Everything previously layered must still be requested */
+  for (char **iter = previous_packages; iter && *iter; iter++)
+    {
+      if (!rpmostree_str_ptrarray_contains (self->overlay_packages, *iter))
+        return TRUE;
+    }
+
+  g_autoptr(GPtrArray) new_packages = g_ptr_array_new_with_free_func (g_free);
+  for (guint i = 0; i < self->overlay_packages->len; i++)
+    {
+      const char *pkg = self->overlay_packages->pdata[i];
+      if (!g_strv_contains ((const char *const*)previous_packages, pkg))
+        g_ptr_array_add (new_packages, g_strdup (pkg));
+    }
+  if (new_packages->len == 0)
+    return TRUE;
+
+  *out_previous_layer = g_strdup (previous_csum);
+  *out_new_packages = g_steal_pointer (&new_packages);
+  return TRUE;
+}
+
+/* Throw away the tmprootfs so we can check out something else */
+static gboolean
+reset_tmprootfs (RpmOstreeSysrootUpgrader *self,
+                 GError                  **error)
+{
+  if (self->tmprootfs_dfd != -1)
+    {
+      (void) close (self->tmprootfs_dfd);
+      self->tmprootfs_dfd = -1;
+    }
+  g_clear_pointer (&self->devino_cache, (GDestroyNotify)ostree_repo_devino_cache_unref);
+  return glnx_shutil_rm_rf_at (ostree_repo_get_dfd (self->repo), RPMOSTREE_TMP_ROOTFS_DIR,
+                               NULL, error);
+}
+
 /* Determines whether local assembly is required and does it if so. */
 static gboolean
 maybe_do_local_assembly (RpmOstreeSysrootUpgrader *self,
                          GCancellable             *cancellable,
                          GError                  **error)
 {
-  if (!checkout_base_tree (self, cancellable, error))
+  /* Build a centralized rsack for the base, since we need it in a few places.
+   * Only the rpmdb is needed for that; we don't want to pay for a full
+   * checkout if it turns out there's nothing to assemble, e.g. when all the
+   * requested packages are already in the base.
+   */
+  self->rsack = rpmostree_get_refsack_for_commit (self->repo, self->base_revision,
+                                                  cancellable, error);
+  if (self->rsack == NULL)
     return FALSE;
 
   if (!finalize_overrides (self, cancellable, error))
@@ -968,7 +1287,79 @@ maybe_do_local_assembly (RpmOstreeSysrootUpgrader *self,
       return TRUE;
     }
 
-  return do_local_assembly (self, cancellable, error);
+  g_autoptr(RpmOstreeContext) ctx = NULL;
+
+  g_autofree char *previous_layer = NULL;
+  g_autoptr(GPtrArray) new_packages = NULL;
+  if (!find_incremental_layer (self, &previous_layer, &new_packages, error))
+    return FALSE;
+  if (previous_layer)
+    {
+      if (!checkout_tree (self, previous_layer, cancellable, error))
+        return FALSE;
+
+      /* If e.g. a new package needs a newer version of something already
+       * layered, depsolving fails; go the regular route in that case.
+       */
+      g_autoptr(GError) local_error = NULL;
+      ctx = prepare_assembly (self, new_packages, previous_layer, cancellable, &local_error);
+      if (!ctx)
+        {
+          if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return FALSE;
+            }
+          g_print ("Can't add packages to the existing layer (%s); "
+                   "assembling from the base\n", local_error->message);
+          if (!reset_tmprootfs (self, error))
+            return FALSE;
+        }
+    }
+
+  if (!ctx)
+    {
+      if (!checkout_tree (self, self->base_revision, cancellable, error))
+        return FALSE;
+      ctx = prepare_assembly (self, self->overlay_packages, NULL, cancellable, error);
+      if (!ctx)
+        return FALSE;
+    }
+
+  return do_local_assembly (self, ctx, cancellable, error);
+}
+
+/* If we'd just be deploying the same tree as the pending deployment with a
+ * different origin (e.g. `rpm-ostree install` of packages already in the
+ * base), update the origin of the pending deployment in place rather than
+ * writing out a new deployment.  Note this means /etc changes made since the
+ * pending deployment was created aren't merged again, just as if it had been
+ * left alone.  We don't do this for the booted deployment, since origin changes
+ * there are expected to take effect on the next boot.
+ */
+static gboolean
+try_update_pending_origin (RpmOstreeSysrootUpgrader *self,
+                           const char               *target_revision,
+                           GKeyFile                 *origin,
+                           gboolean                 *out_updated,
+                           GCancellable             *cancellable,
+                           GError                  **error)
+{
+  *out_updated = FALSE;
+
+  g_autoptr(OstreeDeployment) pending = NULL;
+  rpmostree_syscore_query_deployments (self->sysroot, self->osname, &pending, NULL);
+  if (!pending || !g_str_equal (ostree_deployment_get_csum (pending), target_revision))
+    return TRUE;
+
+  rpmostree_output_task_begin ("Updating origin of pending deployment");
+  if (!ostree_sysroot_write_origin_file (self->sysroot, pending, origin,
+                                         cancellable, error))
+    return FALSE;
+  rpmostree_output_task_end ("done");
+
+  *out_updated = TRUE;
+  return TRUE;
 }
 
 /**
@@ -1008,6 +1399,15 @@ rpmostree_sysroot_upgrader_deploy (RpmOstreeSysrootUpgrader *self,
   g_assert (target_revision);
 
   origin = rpmostree_origin_dup_keyfile (self->origin);
+
+  { gboolean updated = FALSE;
+    if (!try_update_pending_origin (self, target_revision, origin, &updated,
+                                    cancellable, error))
+      return FALSE;
+    if (updated)
+      return TRUE; /* Note early return */
+  }
+
   if (!ostree_sysroot_deploy_tree (self->sysroot, self->osname,
                                    target_revision, origin,
                                    self->cfg_merge_deployment,
@@ -291,6 +291,10 @@ rpmostreed_deployment_generate_variant (OstreeSysroot *sysroot,
     if (args && *args)
       g_variant_dict_insert (&dict, "initramfs-args", "^as", args);
   }
+  { const char *const* etc_files = rpmostree_origin_get_initramfs_etc (origin);
+    if (etc_files && *etc_files)
+      g_variant_dict_insert (&dict, "initramfs-etc", "^as", etc_files);
+  }
 
   if (booted_id != NULL)
     g_variant_dict_insert (&dict, "booted", "b", g_strcmp0 (booted_id, id) == 0);
@@ -33,6 +33,7 @@
 #include "rpmostreed-os.h"
 #include "rpmostreed-utils.h"
 #include "rpmostree-util.h"
+#include "rpmostree-kernel.h"
 #include "rpmostreed-transaction.h"
 #include "rpmostreed-transaction-monitor.h"
 #include "rpmostreed-transaction-types.h"
@@ -1026,6 +1027,7 @@ os_handle_set_initramfs_state (RPMOSTreeOS *interface,
   g_autoptr(GVariantDict) dict = NULL;
   const char *osname;
   gboolean reboot = FALSE;
+  g_autofree char **etc_files = NULL;
   GError *local_error = NULL;
 
   transaction = merge_compatible_txn (self, invocation);
@@ -1043,12 +1045,34 @@ os_handle_set_initramfs_state (RPMOSTreeOS *interface,
 
   dict = g_variant_dict_new (arg_options);
   g_variant_dict_lookup (dict, "reboot", "b", &reboot);
+  g_variant_dict_lookup (dict, "etc-overlay", "^a&s", &etc_files);
+
+  if (etc_files && *etc_files)
+    {
+      if (!regenerate || (args && *args))
+        {
+          local_error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                                             "etc-overlay requires regenerate and no dracut args");
+          goto out;
+        }
+      for (char **iter = etc_files; *iter; iter++)
+        {
+          if (!rpmostree_initramfs_etc_path_is_valid (*iter))
+            {
+              local_error = g_error_new (G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                                         "Invalid etc-overlay path (must be a normalized path in /etc): %s",
+                                         *iter);
+              goto out;
+            }
+        }
+    }
 
   transaction = rpmostreed_transaction_new_initramfs_state (invocation,
                                                             ot_sysroot,
                                                             osname,
                                                             regenerate,
                                                             (char**)args,
+                                                            etc_files,
                                                             reboot,
                                                             cancellable,
                                                             &local_error);
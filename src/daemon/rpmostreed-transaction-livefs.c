@@ -195,7 +195,7 @@ copy_new_config_files (OstreeRepo          *repo,
 
   guint n_added = 0;
   /* Avoid checking out added subdirs recursively */
-  g_autoptr(GPtrArray) added_subdirs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(RpmOstreePathSet) added_subdirs = rpmostree_path_set_new ();
   for (guint i = 0; i < diff->added->len; i++)
     {
       GFile *added_f = diff->added->pdata[i];
@@ -213,10 +213,9 @@ copy_new_config_files (OstreeRepo          *repo,
        * both the diff and checkout are recursive, but we only need to checkout
        * the directory, which will get all children. To do better I'd say we
        * should add an option to ostree_repo_diff() to avoid recursing into
-       * changed subdirectories.  But at the scale we're dealing with here the
-       * constants for this O(N²) algorithm are tiny.
+       * changed subdirectories.
        */
-      if (rpmostree_str_has_prefix_in_ptrarray (sub_etc_relpath, added_subdirs))
+      if (rpmostree_path_set_has_parent (added_subdirs, sub_etc_relpath))
         continue;
 
       g_autoptr(GFileInfo) finfo = g_file_query_info (added_f, "standard::type",
@@ -225,12 +224,10 @@ copy_new_config_files (OstreeRepo          *repo,
       if (!finfo)
         return FALSE;
 
-      /* If this is a directory, add it to our "added subdirs" set. See above.  Add
-       * a trailing / to ensure we don't match other file prefixes.
-       */
+      /* If this is a directory, add it to our "added subdirs" set. See above. */
       const gboolean is_dir = g_file_info_get_file_type (finfo) == G_FILE_TYPE_DIRECTORY;
       if (is_dir)
-        g_ptr_array_add (added_subdirs, g_strconcat (sub_etc_relpath, "/", NULL));
+        rpmostree_path_set_add (added_subdirs, sub_etc_relpath);
 
       /* And now, to deal with ostree semantics around subpath checkouts,
        * we want '.' for files, otherwise get the real dir name.  See also
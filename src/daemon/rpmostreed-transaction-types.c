@@ -978,6 +978,7 @@ typedef struct {
   char *osname;
   gboolean regenerate;
   char **args;
+  char **etc_files;
   gboolean reboot;
 } InitramfsStateTransaction;
 
@@ -997,6 +998,7 @@ initramfs_state_transaction_finalize (GObject *object)
   self = (InitramfsStateTransaction *) object;
   g_free (self->osname);
   g_strfreev (self->args);
+  g_strfreev (self->etc_files);
 
   G_OBJECT_CLASS (initramfs_state_transaction_parent_class)->finalize (object);
 }
@@ -1032,7 +1034,8 @@ initramfs_state_transaction_execute (RpmostreedTransaction *transaction,
    */
   if (current_regenerate == self->regenerate
       && (current_initramfs_args == NULL || !*current_initramfs_args)
-      && (self->args == NULL || !*self->args))
+      && (self->args == NULL || !*self->args)
+      && (self->etc_files == NULL || !*self->etc_files))
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                    "initramfs regeneration state is already %s",
@@ -1040,7 +1043,8 @@ initramfs_state_transaction_execute (RpmostreedTransaction *transaction,
       return FALSE;
     }
 
-  rpmostree_origin_set_regenerate_initramfs (origin, self->regenerate, self->args);
+  rpmostree_origin_set_regenerate_initramfs (origin, self->regenerate, self->args,
+                                             self->etc_files);
   rpmostree_sysroot_upgrader_set_origin (upgrader, origin);
 
   if (!rpmostree_sysroot_upgrader_deploy (upgrader, cancellable, error))
@@ -1074,6 +1078,7 @@ rpmostreed_transaction_new_initramfs_state (GDBusMethodInvocation *invocation,
                                             const char *osname,
                                             gboolean regenerate,
                                             char **args,
+                                            char **etc_files,
                                             gboolean reboot,
                                             GCancellable *cancellable,
                                             GError **error)
@@ -1094,6 +1099,7 @@ rpmostreed_transaction_new_initramfs_state (GDBusMethodInvocation *invocation,
       self->osname = g_strdup (osname);
       self->regenerate = regenerate;
       self->args = g_strdupv (args);
+      self->etc_files = g_strdupv (etc_files);
       self->reboot = reboot;
     }
 
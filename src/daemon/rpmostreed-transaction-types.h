@@ -81,6 +81,7 @@ rpmostreed_transaction_new_initramfs_state       (GDBusMethodInvocation *invocat
                                                   const char            *osname,
                                                   gboolean               regenerate,
                                                   char                 **args,
+                                                  char                 **etc_files,
                                                   gboolean               reboot,
                                                   GCancellable          *cancellable,
                                                   GError               **error);
@@ -23,6 +23,8 @@
 
 #include <err.h>
 #include <stdio.h>
+#include <sys/mount.h>
+#include <sys/xattr.h>
 #include <systemd/sd-journal.h>
 
 void
@@ -47,6 +49,8 @@ struct RpmOstreeBwrap {
   GPtrArray *argv;
   const char *child_argv0;
   char *rofiles_mnt;
+  char *overlay_mnt;
+  char *overlay_dir; /* Relative to rootfs_fd; holds upper/ and work/ */
 
   GSpawnChildSetupFunc child_setup_func;
   gpointer child_setup_data;
@@ -98,8 +102,22 @@ rpmostree_bwrap_unref (RpmOstreeBwrap *bwrap)
         sd_journal_print (LOG_WARNING, "%s", tmp_error->message);
     }
 
+  if (bwrap->overlay_mnt)
+    {
+      /* Only reached if rpmostree_bwrap_finish() wasn't, i.e. we're
+       * discarding whatever the container did. */
+      if (umount2 (bwrap->overlay_mnt, MNT_DETACH) < 0)
+        sd_journal_print (LOG_WARNING, "umount(%s): %s", bwrap->overlay_mnt, g_strerror (errno));
+      else
+        (void) unlinkat (AT_FDCWD, bwrap->overlay_mnt, AT_REMOVEDIR);
+    }
+  if (bwrap->overlay_dir)
+    (void) glnx_shutil_rm_rf_at (bwrap->rootfs_fd, bwrap->overlay_dir, NULL, NULL);
+
   g_ptr_array_unref (bwrap->argv);
   g_free (bwrap->rofiles_mnt);
+  g_free (bwrap->overlay_mnt);
+  g_free (bwrap->overlay_dir);
   g_free (bwrap);
 }
 
@@ -177,6 +195,250 @@ setup_rofiles_usr (RpmOstreeBwrap *bwrap,
   return ret;
 }
 
+/* Like setup_rofiles_usr(), but rather than a FUSE filesystem which
+ * blocks in-place modification of hardlinked files, use a kernel overlay
+ * with a scratch upper dir; rpmostree_bwrap_finish() then merges the
+ * changes back by replacing files, which can never corrupt the repo.
+ * This avoids the cost of FUSE for scripts which read a lot (e.g. ldconfig),
+ * but requires privileges to mount.
+ */
+static gboolean
+setup_overlay_usr (RpmOstreeBwrap *bwrap,
+                   GError **error)
+{
+  /* The upper dir must be on the same filesystem as the rootfs so we
+   * can rename() out of it. */
+  bwrap->overlay_dir = g_strdup (".rpmostree-overlay.XXXXXX");
+  if (!glnx_mkdtempat (bwrap->rootfs_fd, bwrap->overlay_dir, 0700, error))
+    {
+      g_clear_pointer (&bwrap->overlay_dir, g_free);
+      return FALSE;
+    }
+  const char *upper = glnx_strjoina (bwrap->overlay_dir, "/upper");
+  const char *work = glnx_strjoina (bwrap->overlay_dir, "/work");
+  if (mkdirat (bwrap->rootfs_fd, upper, 0755) < 0 ||
+      mkdirat (bwrap->rootfs_fd, work, 0755) < 0)
+    return glnx_throw_errno_prefix (error, "mkdirat");
+
+  g_autofree char *mnt = g_strdup ("/tmp/rpmostree-overlay.XXXXXX");
+  if (!glnx_mkdtempat (AT_FDCWD, mnt, 0700, error))
+    return FALSE;
+
+  g_autofree char *lower_abspath = glnx_fdrel_abspath (bwrap->rootfs_fd, "usr");
+  g_autofree char *upper_abspath = glnx_fdrel_abspath (bwrap->rootfs_fd, upper);
+  g_autofree char *work_abspath = glnx_fdrel_abspath (bwrap->rootfs_fd, work);
+  /* Make sure every change in the upper dir is a plain file or directory
+   * that merge_overlay_upper() can apply; it refuses the rest. */
+  g_autofree char *opts =
+    g_strdup_printf ("lowerdir=%s,upperdir=%s,workdir=%s,redirect_dir=off,metacopy=off,index=off",
+                     lower_abspath, upper_abspath, work_abspath);
+  if (mount ("overlay", mnt, "overlay", 0, opts) < 0)
+    {
+      glnx_throw_errno_prefix (error, "mount(overlay)");
+      (void) unlinkat (AT_FDCWD, mnt, AT_REMOVEDIR);
+      return FALSE;
+    }
+  bwrap->overlay_mnt = g_steal_pointer (&mnt);
+
+  rpmostree_bwrap_append_bwrap_argv (bwrap, "--bind", bwrap->overlay_mnt, "/usr", NULL);
+  return TRUE;
+}
+
+static gboolean
+dir_is_opaque (int         dfd,
+               const char *name,
+               GError    **error)
+{
+  glnx_fd_close int fd = -1;
+  if (!glnx_opendirat (dfd, name, FALSE, &fd, error))
+    return FALSE;
+  char value;
+  if (fgetxattr (fd, "trusted.overlay.opaque", &value, 1) == 1 && value == 'y')
+    return TRUE;
+  return FALSE;
+}
+
+/* The kernel may annotate copied-up files with e.g. trusted.overlay.origin;
+ * those must not end up in the commit.  A redirect or metacopy means the
+ * upper entry doesn't stand on its own, which we can't merge.
+ */
+static gboolean
+strip_overlay_xattrs (int         dfd,
+                      const char *name,
+                      GError    **error)
+{
+  g_autofree char *path = glnx_fdrel_abspath (dfd, name);
+  ssize_t n = llistxattr (path, NULL, 0);
+  if (n < 0)
+    {
+      if (errno == ENOTSUP)
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "llistxattr(%s)", name);
+    }
+  if (n == 0)
+    return TRUE;
+
+  g_autofree char *names = g_malloc (n);
+  n = llistxattr (path, names, n);
+  if (n < 0)
+    return glnx_throw_errno_prefix (error, "llistxattr(%s)", name);
+
+  for (const char *p = names; p < names + n; p += strlen (p) + 1)
+    {
+      if (!g_str_has_prefix (p, "trusted.overlay."))
+        continue;
+      if (g_str_equal (p, "trusted.overlay.redirect") ||
+          g_str_equal (p, "trusted.overlay.metacopy"))
+        return glnx_throw (error, "Unsupported overlayfs %s on %s", p, name);
+      if (lremovexattr (path, p) < 0 && errno != ENODATA)
+        return glnx_throw_errno_prefix (error, "lremovexattr(%s)", name);
+    }
+
+  return TRUE;
+}
+
+/* Apply an overlayfs upper dir onto the lower one: whiteouts become
+ * deletions, opaque directories replace the original, and new or copied-up
+ * files are renamed into place.
+ */
+static gboolean
+merge_overlay_upper (int           upper_dfd,
+                     int           lower_dfd,
+                     GCancellable *cancellable,
+                     GError      **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (upper_dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+
+      const char *name = dent->d_name;
+      struct stat stbuf;
+      if (fstatat (dfd_iter.fd, name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+        return glnx_throw_errno_prefix (error, "fstatat(%s)", name);
+
+      struct stat lower_stbuf;
+      gboolean lower_exists = TRUE;
+      if (fstatat (lower_dfd, name, &lower_stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+        {
+          if (errno != ENOENT)
+            return glnx_throw_errno_prefix (error, "fstatat(%s)", name);
+          lower_exists = FALSE;
+        }
+
+      if (S_ISCHR (stbuf.st_mode) && stbuf.st_rdev == 0)
+        {
+          /* Whiteout */
+          if (!glnx_shutil_rm_rf_at (lower_dfd, name, cancellable, error))
+            return FALSE;
+        }
+      else if (S_ISDIR (stbuf.st_mode))
+        {
+          g_autoptr(GError) local_error = NULL;
+          const gboolean opaque = dir_is_opaque (dfd_iter.fd, name, &local_error);
+          if (local_error)
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return FALSE;
+            }
+          if (!strip_overlay_xattrs (dfd_iter.fd, name, error))
+            return FALSE;
+
+          if (lower_exists && (opaque || !S_ISDIR (lower_stbuf.st_mode)))
+            {
+              if (!glnx_shutil_rm_rf_at (lower_dfd, name, cancellable, error))
+                return FALSE;
+              lower_exists = FALSE;
+            }
+          if (!lower_exists && mkdirat (lower_dfd, name, 0700) < 0)
+            return glnx_throw_errno_prefix (error, "mkdirat(%s)", name);
+
+          glnx_fd_close int child_upper_dfd = -1;
+          glnx_fd_close int child_lower_dfd = -1;
+          if (!glnx_opendirat (dfd_iter.fd, name, FALSE, &child_upper_dfd, error) ||
+              !glnx_opendirat (lower_dfd, name, FALSE, &child_lower_dfd, error))
+            return FALSE;
+
+          /* Copied-up dirs carry the current metadata */
+          if (fchown (child_lower_dfd, stbuf.st_uid, stbuf.st_gid) < 0 ||
+              fchmod (child_lower_dfd, stbuf.st_mode & 07777) < 0)
+            return glnx_throw_errno_prefix (error, "Updating %s", name);
+
+          if (!merge_overlay_upper (child_upper_dfd, child_lower_dfd, cancellable, error))
+            return glnx_prefix_error (error, "%s", name);
+        }
+      else if (S_ISREG (stbuf.st_mode) || S_ISLNK (stbuf.st_mode))
+        {
+          if (lower_exists && S_ISDIR (lower_stbuf.st_mode))
+            {
+              if (!glnx_shutil_rm_rf_at (lower_dfd, name, cancellable, error))
+                return FALSE;
+            }
+          if (!strip_overlay_xattrs (dfd_iter.fd, name, error))
+            return FALSE;
+          /* Note this replaces rather than modifies, so files hardlinked into
+           * the repo are left alone. */
+          if (renameat (dfd_iter.fd, name, lower_dfd, name) < 0)
+            return glnx_throw_errno_prefix (error, "renameat(%s)", name);
+        }
+      else
+        return glnx_throw (error, "Unsupported file type created by script: %s", name);
+    }
+
+  return TRUE;
+}
+
+/* Apply the changes made by the container, for mutability modes which don't
+ * do so directly; currently that's only RPMOSTREE_BWRAP_MUTATE_OVERLAY.
+ * Must be called after the container has exited.
+ */
+gboolean
+rpmostree_bwrap_finish (RpmOstreeBwrap *bwrap,
+                        GCancellable   *cancellable,
+                        GError        **error)
+{
+  if (!bwrap->overlay_mnt)
+    return TRUE;
+
+  /* Changing the upper dir while mounted is undefined, so unmount first */
+  if (umount2 (bwrap->overlay_mnt, 0) < 0)
+    return glnx_throw_errno_prefix (error, "umount(%s)", bwrap->overlay_mnt);
+  (void) unlinkat (AT_FDCWD, bwrap->overlay_mnt, AT_REMOVEDIR);
+  g_clear_pointer (&bwrap->overlay_mnt, g_free);
+
+  const char *upper = glnx_strjoina (bwrap->overlay_dir, "/upper");
+  glnx_fd_close int upper_dfd = -1;
+  glnx_fd_close int lower_dfd = -1;
+  if (!glnx_opendirat (bwrap->rootfs_fd, upper, FALSE, &upper_dfd, error) ||
+      !glnx_opendirat (bwrap->rootfs_fd, "usr", FALSE, &lower_dfd, error))
+    return FALSE;
+
+  if (!merge_overlay_upper (upper_dfd, lower_dfd, cancellable, error))
+    return glnx_prefix_error (error, "Merging script changes into /usr");
+
+  if (!glnx_shutil_rm_rf_at (bwrap->rootfs_fd, bwrap->overlay_dir, cancellable, error))
+    return FALSE;
+  g_clear_pointer (&bwrap->overlay_dir, g_free);
+
+  return TRUE;
+}
+
+/* Where the rootfs' usr/ is for bwrap arguments: the overlay mount, if
+ * any, so that changes made through other binds are captured as well.
+ */
+const char *
+rpmostree_bwrap_get_usr_path (RpmOstreeBwrap *bwrap)
+{
+  return bwrap->overlay_mnt ?: "./usr";
+}
+
 /* nspawn by default doesn't give us CAP_NET_ADMIN; see
  * https://pagure.io/releng/issue/6602#comment-71214
  * https://pagure.io/koji/pull-request/344#comment-21060
@@ -262,6 +524,10 @@ rpmostree_bwrap_new (int rootfs_fd,
       if (!setup_rofiles_usr (ret, error))
         return NULL;
       break;
+    case RPMOSTREE_BWRAP_MUTATE_OVERLAY:
+      if (!setup_overlay_usr (ret, error))
+        return NULL;
+      break;
     case RPMOSTREE_BWRAP_MUTATE_FREELY:
       rpmostree_bwrap_append_bwrap_argv (ret, "--bind", "usr", "/usr", NULL);
       break;
@@ -299,46 +565,78 @@ rpmostree_bwrap_set_child_setup (RpmOstreeBwrap *bwrap,
   bwrap->child_setup_data = data;
 }
 
+/* This is similar to what systemd does, except:
+ *  - We drop /usr/local, since scripts shouldn't see it.
+ *  - We pull in the current process' LANG, since that's what people
+ *    have historically expected from RPM scripts.
+ */
+static char **
+bwrap_get_env (void)
+{
+  const char *current_lang = getenv ("LANG");
+  if (!current_lang)
+    current_lang = "C";
+
+  char **env = g_new0 (char*, 3);
+  env[0] = g_strdup ("PATH=/usr/sbin:/usr/bin");
+  env[1] = g_strconcat ("LANG=", current_lang, NULL);
+  return env;
+}
+
 gboolean
 rpmostree_bwrap_run (RpmOstreeBwrap *bwrap,
                      GError **error)
 {
   int estatus;
-  const char *current_lang = getenv ("LANG");
 
   g_assert (!bwrap->executed);
   bwrap->executed = TRUE;
 
-  if (!current_lang)
-    current_lang = "C";
+  g_auto(GStrv) bwrap_env = bwrap_get_env ();
 
-  {
-    const char *lang_var = glnx_strjoina ("LANG=", current_lang);
-    /* This is similar to what systemd does, except:
-     *  - We drop /usr/local, since scripts shouldn't see it.
-     *  - We pull in the current process' LANG, since that's what people
-     *    have historically expected from RPM scripts.
-     */
-    const char *bwrap_env[] = {"PATH=/usr/sbin:/usr/bin",
-                               lang_var,
-                               NULL};
-
-    /* Add the final NULL */
-    g_ptr_array_add (bwrap->argv, NULL);
-
-    if (!g_spawn_sync (NULL, (char**)bwrap->argv->pdata, (char**) bwrap_env, G_SPAWN_SEARCH_PATH,
-                       bwrap_child_setup, bwrap,
-                       NULL, NULL, &estatus, error))
-      {
-        g_prefix_error (error, "Executing bwrap(%s): ", bwrap->child_argv0);
-        return FALSE;
-      }
-    if (!g_spawn_check_exit_status (estatus, error))
-      {
-        g_prefix_error (error, "Executing bwrap(%s): ", bwrap->child_argv0);
-        return FALSE;
-      }
-  }
+  /* Add the final NULL */
+  g_ptr_array_add (bwrap->argv, NULL);
+
+  if (!g_spawn_sync (NULL, (char**)bwrap->argv->pdata, bwrap_env, G_SPAWN_SEARCH_PATH,
+                     bwrap_child_setup, bwrap,
+                     NULL, NULL, &estatus, error))
+    {
+      g_prefix_error (error, "Executing bwrap(%s): ", bwrap->child_argv0);
+      return FALSE;
+    }
+  if (!g_spawn_check_exit_status (estatus, error))
+    {
+      g_prefix_error (error, "Executing bwrap(%s): ", bwrap->child_argv0);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Like rpmostree_bwrap_run(), but don't wait for the container to exit.  The
+ * child isn't reaped; the caller must waitpid() on @out_child_pid, and keep
+ * @bwrap alive until then, since dropping the last ref unmounts rofiles.
+ */
+gboolean
+rpmostree_bwrap_spawn (RpmOstreeBwrap *bwrap,
+                       GPid           *out_child_pid,
+                       GError        **error)
+{
+  g_assert (!bwrap->executed);
+  bwrap->executed = TRUE;
+
+  g_auto(GStrv) bwrap_env = bwrap_get_env ();
+
+  /* Add the final NULL */
+  g_ptr_array_add (bwrap->argv, NULL);
+
+  if (!g_spawn_async (NULL, (char**)bwrap->argv->pdata, bwrap_env,
+                      G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+                      bwrap_child_setup, bwrap, out_child_pid, error))
+    {
+      g_prefix_error (error, "Executing bwrap(%s): ", bwrap->child_argv0);
+      return FALSE;
+    }
 
   return TRUE;
 }
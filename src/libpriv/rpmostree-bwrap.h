@@ -27,7 +27,8 @@
 typedef enum {
   RPMOSTREE_BWRAP_IMMUTABLE = 0,
   RPMOSTREE_BWRAP_MUTATE_ROFILES,
-  RPMOSTREE_BWRAP_MUTATE_FREELY
+  RPMOSTREE_BWRAP_MUTATE_FREELY,
+  RPMOSTREE_BWRAP_MUTATE_OVERLAY, /* Like ROFILES, but via overlayfs; needs privileges */
 } RpmOstreeBwrapMutability;
 
 typedef struct RpmOstreeBwrap RpmOstreeBwrap;
@@ -43,6 +44,8 @@ RpmOstreeBwrap *rpmostree_bwrap_new (int rootfs,
                                      GError **error,
                                      ...) G_GNUC_NULL_TERMINATED;
 
+const char *rpmostree_bwrap_get_usr_path (RpmOstreeBwrap *bwrap);
+
 void rpmostree_bwrap_append_bwrap_argv (RpmOstreeBwrap *bwrap, ...) G_GNUC_NULL_TERMINATED;
 void rpmostree_bwrap_append_child_argv (RpmOstreeBwrap *bwrap, ...) G_GNUC_NULL_TERMINATED;
 
@@ -52,4 +55,12 @@ void rpmostree_bwrap_set_child_setup (RpmOstreeBwrap *bwrap,
 
 gboolean rpmostree_bwrap_run (RpmOstreeBwrap *bwrap, GError **error);
 
+gboolean rpmostree_bwrap_spawn (RpmOstreeBwrap *bwrap,
+                                GPid           *out_child_pid,
+                                GError        **error);
+
+gboolean rpmostree_bwrap_finish (RpmOstreeBwrap *bwrap,
+                                 GCancellable   *cancellable,
+                                 GError        **error);
+
 gboolean rpmostree_bwrap_selftest (GError **error);
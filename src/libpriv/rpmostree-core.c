@@ -250,6 +250,25 @@ struct _RpmOstreeContext {
 
   char *tmpdir_path;
   int tmpdir_fd;
+
+  guint n_import_jobs;
+  gboolean merged_checkout;
+  gboolean noscripts; /* Whether the assembled rootfs skipped scripts */
+
+  /* Set when layering on top of a previous client layer rather than the base */
+  char *previous_layer;
+  char **layered_packages; /* All patterns layered, including previous ones */
+
+  GVariant *initramfs_state; /* (basas); see rpmostree_context_set_initramfs_state() */
+
+  RpmOstreePkgCacheIndex *pkgcache_index; /* built on demand */
+
+  GHashTable *metainfo_cache; /* metarpm relpath -> PackageMetainfo */
+  guint64 metainfo_cache_bytes;
+
+  /* path -> checksum for packages checked out in parallel; see
+   * checkout_packages_into_root() */
+  GHashTable *checkout_files;
 };
 
 G_DEFINE_TYPE (RpmOstreeContext, rpmostree_context, G_TYPE_OBJECT)
@@ -268,6 +287,9 @@ rpmostree_context_finalize (GObject *object)
   g_clear_object (&rctx->sepolicy);
 
   g_clear_pointer (&rctx->passwd_dir, g_free);
+  g_clear_pointer (&rctx->previous_layer, g_free);
+  g_clear_pointer (&rctx->layered_packages, g_strfreev);
+  g_clear_pointer (&rctx->initramfs_state, g_variant_unref);
 
   g_clear_pointer (&rctx->pkgs_to_download, g_ptr_array_unref);
   g_clear_pointer (&rctx->pkgs_to_import, g_ptr_array_unref);
@@ -276,6 +298,10 @@ rpmostree_context_finalize (GObject *object)
   g_clear_pointer (&rctx->pkgs_to_remove, g_hash_table_unref);
   g_clear_pointer (&rctx->pkgs_to_replace, g_hash_table_unref);
 
+  g_clear_pointer (&rctx->checkout_files, g_hash_table_unref);
+  g_clear_pointer (&rctx->pkgcache_index, rpmostree_pkgcache_index_free);
+  g_clear_pointer (&rctx->metainfo_cache, g_hash_table_unref);
+
   if (rctx->tmpdir_path)
     {
       (void) glnx_shutil_rm_rf_at (AT_FDCWD, rctx->tmpdir_path, NULL, NULL);
@@ -466,6 +492,36 @@ rpmostree_context_set_sepolicy (RpmOstreeContext *self,
   g_set_object (&self->sepolicy, sepolicy);
 }
 
+/* Use when the install root is a checkout of the client layer @commit rather
+ * than of its base, and the treespec only has the packages to add on top.
+ * @layered_packages is the full set of patterns the result layers, which is
+ * what we record in the commit.
+ */
+void
+rpmostree_context_set_previous_layer (RpmOstreeContext  *self,
+                                      const char        *commit,
+                                      const char *const *layered_packages)
+{
+  g_free (self->previous_layer);
+  self->previous_layer = g_strdup (commit);
+  g_strfreev (self->layered_packages);
+  self->layered_packages = g_strdupv ((char**)layered_packages);
+}
+
+/* Record how the initramfs of the client layer is generated, as @state of
+ * type (basas): whether it's regenerated, the dracut args, and the host /etc
+ * files added.  Like noscripts, this isn't part of the state checksum but
+ * matters when looking for a previous commit to reuse.
+ */
+void
+rpmostree_context_set_initramfs_state (RpmOstreeContext *self,
+                                       GVariant         *state)
+{
+  g_assert (g_variant_is_of_type (state, (GVariantType*)"(basas)"));
+  g_clear_pointer (&self->initramfs_state, g_variant_unref);
+  self->initramfs_state = g_variant_ref_sink (state);
+}
+
 void
 rpmostree_context_set_passwd_dir (RpmOstreeContext *self,
                                   const char *passwd_dir)
@@ -723,39 +779,24 @@ checkout_pkg_metadata (RpmOstreeContext *self,
                                         cancellable, error);
 }
 
+/* Extract the RPM header from pkgcache commit @pkg_commit (@nevra is for
+ * errors) */
 static gboolean
-get_header_variant (OstreeRepo       *repo,
-                    const char       *cachebranch,
+get_header_variant (GVariant         *pkg_commit,
+                    const char       *nevra,
                     GVariant        **out_header,
-                    GCancellable     *cancellable,
                     GError          **error)
 {
-  g_autofree char *cached_rev = NULL;
-  g_autoptr(GVariant) pkg_commit = NULL;
-  g_autoptr(GVariant) pkg_meta = NULL;
-  g_autoptr(GVariantDict) pkg_meta_dict = NULL;
-  g_autoptr(GVariant) header = NULL;
-
-  if (!ostree_repo_resolve_rev (repo, cachebranch, FALSE,
-                                &cached_rev, error))
-    return FALSE;
-
-  if (!ostree_repo_load_commit (repo, cached_rev, &pkg_commit, NULL, error))
-    return FALSE;
-
-  pkg_meta = g_variant_get_child_value (pkg_commit, 0);
-  pkg_meta_dict = g_variant_dict_new (pkg_meta);
-
-  header = _rpmostree_vardict_lookup_value_required (pkg_meta_dict,
-                                                     "rpmostree.metadata",
-                                                     (GVariantType*)"ay",
-                                                     error);
+  g_autoptr(GVariant) pkg_meta = g_variant_get_child_value (pkg_commit, 0);
+  g_autoptr(GVariantDict) pkg_meta_dict = g_variant_dict_new (pkg_meta);
+
+  g_autoptr(GVariant) header =
+    _rpmostree_vardict_lookup_value_required (pkg_meta_dict,
+                                              "rpmostree.metadata",
+                                              (GVariantType*)"ay",
+                                              error);
   if (!header)
-    {
-      g_autofree char *nevra = rpmostree_cache_branch_to_nevra (cachebranch);
-      g_prefix_error (error, "In commit %s of %s: ", cached_rev, nevra);
-      return FALSE;
-    }
+    return glnx_prefix_error (error, "In cached commit of %s", nevra);
 
   *out_header = g_steal_pointer (&header);
   return TRUE;
@@ -764,21 +805,140 @@ get_header_variant (OstreeRepo       *repo,
 static gboolean
 checkout_pkg_metadata_by_dnfpkg (RpmOstreeContext *self,
                                  DnfPackage       *pkg,
+                                 GVariant         *pkg_commit,
                                  GCancellable     *cancellable,
                                  GError          **error)
 {
   const char *nevra = dnf_package_get_nevra (pkg);
-  g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
-  OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
   g_autoptr(GVariant) header = NULL;
 
-  if (!get_header_variant (pkgcache_repo, cachebranch, &header,
-                           cancellable, error))
+  if (!get_header_variant (pkg_commit, nevra, &header, error))
     return FALSE;
 
   return checkout_pkg_metadata (self, nevra, header, cancellable, error);
 }
 
+/* An in-memory index of the pkgcache, so that looking up a package by NEVRA
+ * or cache branch doesn't mean listing (and converting) every ref each time.
+ * Commit metadata is loaded the first time it's asked for and then kept.
+ */
+typedef struct {
+  char *cachebranch;
+  char *commit;
+  GVariant *commit_v; /* loaded on demand */
+} PkgCacheEntry;
+
+struct RpmOstreePkgCacheIndex {
+  OstreeRepo *repo;
+  GHashTable *by_branch; /* cachebranch -> PkgCacheEntry */
+  GHashTable *by_nevra;  /* nevra -> PkgCacheEntry, borrowed */
+};
+
+static void
+pkgcache_entry_free (PkgCacheEntry *entry)
+{
+  g_free (entry->cachebranch);
+  g_free (entry->commit);
+  g_clear_pointer (&entry->commit_v, g_variant_unref);
+  g_free (entry);
+}
+
+RpmOstreePkgCacheIndex *
+rpmostree_pkgcache_index_new (OstreeRepo    *pkgcache,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  g_autoptr(GHashTable) refs = NULL;
+  if (!ostree_repo_list_refs_ext (pkgcache, "rpmostree/pkg", &refs,
+                                  OSTREE_REPO_LIST_REFS_EXT_NONE, cancellable,
+                                  error))
+    return NULL;
+
+  RpmOstreePkgCacheIndex *index = g_new0 (RpmOstreePkgCacheIndex, 1);
+  index->repo = g_object_ref (pkgcache);
+  index->by_branch = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                            (GDestroyNotify)pkgcache_entry_free);
+  index->by_nevra = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  GLNX_HASH_TABLE_FOREACH_KV (refs, const char*, ref, const char*, commit)
+    rpmostree_pkgcache_index_update (index, ref, commit);
+
+  return index;
+}
+
+void
+rpmostree_pkgcache_index_free (RpmOstreePkgCacheIndex *index)
+{
+  g_clear_object (&index->repo);
+  g_clear_pointer (&index->by_nevra, g_hash_table_unref);
+  g_clear_pointer (&index->by_branch, g_hash_table_unref);
+  g_free (index);
+}
+
+OstreeRepo *
+rpmostree_pkgcache_index_get_repo (RpmOstreePkgCacheIndex *index)
+{
+  return index->repo;
+}
+
+/* Record that @cachebranch now points to @commit (or was deleted, if %NULL),
+ * e.g. after an import or relabel. */
+void
+rpmostree_pkgcache_index_update (RpmOstreePkgCacheIndex *index,
+                                 const char             *cachebranch,
+                                 const char             *commit)
+{
+  g_autofree char *nevra = rpmostree_cache_branch_to_nevra (cachebranch);
+  g_hash_table_remove (index->by_nevra, nevra);
+  g_hash_table_remove (index->by_branch, cachebranch);
+  if (!commit)
+    return;
+
+  PkgCacheEntry *entry = g_new0 (PkgCacheEntry, 1);
+  entry->cachebranch = g_strdup (cachebranch);
+  entry->commit = g_strdup (commit);
+  g_hash_table_insert (index->by_branch, entry->cachebranch, entry);
+  g_hash_table_insert (index->by_nevra, g_steal_pointer (&nevra), entry);
+}
+
+/* Returns the cache branch for @nevra, or %NULL if it's not cached */
+const char *
+rpmostree_pkgcache_index_lookup_nevra (RpmOstreePkgCacheIndex *index,
+                                       const char             *nevra)
+{
+  PkgCacheEntry *entry = g_hash_table_lookup (index->by_nevra, nevra);
+  return entry ? entry->cachebranch : NULL;
+}
+
+/* Returns the commit @cachebranch points to, or %NULL if there isn't one */
+const char *
+rpmostree_pkgcache_index_lookup_branch (RpmOstreePkgCacheIndex *index,
+                                        const char             *cachebranch)
+{
+  PkgCacheEntry *entry = g_hash_table_lookup (index->by_branch, cachebranch);
+  return entry ? entry->commit : NULL;
+}
+
+/* Returns the (cached) commit object for @cachebranch; it must exist */
+GVariant *
+rpmostree_pkgcache_index_load_commit (RpmOstreePkgCacheIndex *index,
+                                      const char             *cachebranch,
+                                      GError                **error)
+{
+  PkgCacheEntry *entry = g_hash_table_lookup (index->by_branch, cachebranch);
+  if (!entry)
+    return glnx_null_throw (error, "No cached pkg for %s", cachebranch);
+
+  if (!entry->commit_v)
+    {
+      if (!ostree_repo_load_commit (index->repo, entry->commit, &entry->commit_v,
+                                    NULL, error))
+        return NULL;
+    }
+
+  return entry->commit_v;
+}
+
 gboolean
 rpmostree_find_cache_branch_by_nevra (OstreeRepo    *pkgcache,
                                       const char    *nevra,
@@ -788,52 +948,40 @@ rpmostree_find_cache_branch_by_nevra (OstreeRepo    *pkgcache,
 
 {
   /* there's no safe way to convert a nevra string to its cache branch, so let's
-   * just do a dumb lookup */
-
-  g_autoptr(GHashTable) refs = NULL;
-  if (!ostree_repo_list_refs_ext (pkgcache, "rpmostree/pkg", &refs,
-                                  OSTREE_REPO_LIST_REFS_EXT_NONE, cancellable,
-                                  error))
+   * just do a dumb lookup; use an RpmOstreePkgCacheIndex if doing this in a loop */
+  g_autoptr(RpmOstreePkgCacheIndex) index =
+    rpmostree_pkgcache_index_new (pkgcache, cancellable, error);
+  if (!index)
     return FALSE;
 
-  GLNX_HASH_TABLE_FOREACH (refs, const char*, ref)
-    {
-      g_autofree char *cache_nevra = rpmostree_cache_branch_to_nevra (ref);
-      if (g_str_equal (nevra, cache_nevra))
-        {
-          *out_cache_branch = g_strdup (ref);
-          return TRUE;
-        }
-    }
+  const char *cachebranch = rpmostree_pkgcache_index_lookup_nevra (index, nevra);
+  if (!cachebranch)
+    return glnx_throw (error, "Failed to find cached pkg for %s", nevra);
 
-  return glnx_throw (error, "Failed to find cached pkg for %s", nevra);
+  *out_cache_branch = g_strdup (cachebranch);
+  return TRUE;
 }
 
 gboolean
-rpmostree_pkgcache_find_pkg_header (OstreeRepo    *pkgcache,
+rpmostree_pkgcache_find_pkg_header (RpmOstreePkgCacheIndex *index,
                                     const char    *nevra,
                                     const char    *expected_sha256,
                                     GVariant     **out_header,
                                     GCancellable  *cancellable,
                                     GError       **error)
 {
-  g_autofree char *cache_branch = NULL;
-  if (!rpmostree_find_cache_branch_by_nevra (pkgcache, nevra, &cache_branch,
-                                             cancellable, error))
+  const char *cache_branch = rpmostree_pkgcache_index_lookup_nevra (index, nevra);
+  if (!cache_branch)
+    return glnx_throw (error, "Failed to find cached pkg for %s", nevra);
+
+  GVariant *commit = rpmostree_pkgcache_index_load_commit (index, cache_branch, error);
+  if (!commit)
     return FALSE;
 
   if (expected_sha256 != NULL)
     {
-      g_autofree char *commit_csum = NULL;
-      g_autoptr(GVariant) commit = NULL;
       g_autofree char *actual_sha256 = NULL;
 
-      if (!ostree_repo_resolve_rev (pkgcache, cache_branch, TRUE, &commit_csum, error))
-        return FALSE;
-
-      if (!ostree_repo_load_commit (pkgcache, commit_csum, &commit, NULL, error))
-        return FALSE;
-
       if (!get_commit_header_sha256 (commit, &actual_sha256, error))
         return FALSE;
 
@@ -841,7 +989,18 @@ rpmostree_pkgcache_find_pkg_header (OstreeRepo    *pkgcache,
         return glnx_throw (error, "Checksum mismatch for package %s", nevra);
     }
 
-  return get_header_variant (pkgcache, cache_branch, out_header, cancellable, error);
+  return get_header_variant (commit, nevra, out_header, error);
+}
+
+static RpmOstreePkgCacheIndex *
+get_pkgcache_index (RpmOstreeContext *self,
+                    GCancellable     *cancellable,
+                    GError          **error)
+{
+  if (!self->pkgcache_index)
+    self->pkgcache_index = rpmostree_pkgcache_index_new (get_pkgcache_repo (self),
+                                                         cancellable, error);
+  return self->pkgcache_index;
 }
 
 static gboolean
@@ -853,7 +1012,11 @@ checkout_pkg_metadata_by_nevra (RpmOstreeContext *self,
 {
   g_autoptr(GVariant) header = NULL;
 
-  if (!rpmostree_pkgcache_find_pkg_header (self->pkgcache_repo, nevra, sha256,
+  RpmOstreePkgCacheIndex *index = get_pkgcache_index (self, cancellable, error);
+  if (!index)
+    return FALSE;
+
+  if (!rpmostree_pkgcache_find_pkg_header (index, nevra, sha256,
                                            &header, cancellable, error))
     return FALSE;
 
@@ -864,7 +1027,7 @@ checkout_pkg_metadata_by_nevra (RpmOstreeContext *self,
 /* Fetches decomposed NEVRA information from pkgcache for a given nevra string. Requires the
  * package to have been unpacked with unpack_version 1.4+ */
 gboolean
-rpmostree_get_nevra_from_pkgcache (OstreeRepo  *repo,
+rpmostree_get_nevra_from_pkgcache (RpmOstreePkgCacheIndex *index,
                                    const char  *nevra,
                                    char       **out_name,
                                    guint64     *out_epoch,
@@ -874,16 +1037,12 @@ rpmostree_get_nevra_from_pkgcache (OstreeRepo  *repo,
                                    GCancellable *cancellable,
                                    GError  **error)
 {
-  g_autofree char *ref = NULL;
-  if (!rpmostree_find_cache_branch_by_nevra (repo, nevra, &ref, cancellable, error))
-    return FALSE;
-
-  g_autofree char *rev = NULL;
-  if (!ostree_repo_resolve_rev (repo, ref, FALSE, &rev, error))
-    return FALSE;
+  const char *ref = rpmostree_pkgcache_index_lookup_nevra (index, nevra);
+  if (!ref)
+    return glnx_throw (error, "Failed to find cached pkg for %s", nevra);
 
-  g_autoptr(GVariant) commit = NULL;
-  if (!ostree_repo_load_commit (repo, rev, &commit, NULL, error))
+  GVariant *commit = rpmostree_pkgcache_index_load_commit (index, ref, error);
+  if (!commit)
     return FALSE;
 
   g_autoptr(GVariant) meta = g_variant_get_child_value (commit, 0);
@@ -1049,20 +1208,14 @@ pkg_is_local (DnfPackage *pkg)
 }
 
 static gboolean
-commit_has_matching_sepolicy (OstreeRepo     *repo,
-                              const char     *head,
+commit_has_matching_sepolicy (GVariant       *commit,
                               OstreeSePolicy *sepolicy,
                               gboolean       *out_matches,
                               GError        **error)
 {
   const char *sepolicy_csum_wanted = ostree_sepolicy_get_csum (sepolicy);
-  g_autoptr(GVariant) commit = NULL;
   g_autofree char *sepolicy_csum = NULL;
 
-  if (!ostree_repo_load_commit (repo, head, &commit, NULL, error))
-    return FALSE;
-  g_assert (commit);
-
   if (!get_commit_sepolicy_csum (commit, &sepolicy_csum, error))
     return FALSE;
 
@@ -1072,18 +1225,11 @@ commit_has_matching_sepolicy (OstreeRepo     *repo,
 }
 
 static gboolean
-commit_has_matching_repodata_chksum_repr (OstreeRepo  *repo,
-                                          const char  *rev,
+commit_has_matching_repodata_chksum_repr (GVariant    *commit,
                                           const char  *expected,
                                           gboolean    *out_matches,
                                           GError     **error)
 {
-  g_autoptr(GVariant) commit = NULL;
-  if (!ostree_repo_load_commit (repo, rev, &commit, NULL, error))
-    return FALSE;
-
-  g_assert (commit);
-
   g_autofree char *actual = NULL;
   g_autoptr(GError) tmp_error = NULL;
   if (!get_commit_repodata_chksum_repr (commit, &actual, &tmp_error))
@@ -1119,7 +1265,7 @@ pkg_is_cached (DnfPackage *pkg)
 }
 
 static gboolean
-find_pkg_in_ostree (OstreeRepo     *repo,
+find_pkg_in_ostree (RpmOstreePkgCacheIndex *index,
                     DnfPackage     *pkg,
                     OstreeSePolicy *sepolicy,
                     gboolean       *out_in_ostree,
@@ -1128,20 +1274,20 @@ find_pkg_in_ostree (OstreeRepo     *repo,
 {
   gboolean in_ostree = FALSE;
   gboolean selinux_match = FALSE;
-  g_autofree char *cached_rev = NULL;
   g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
+  GVariant *commit = NULL;
 
   /* NB: we're not using a pkgcache yet in the compose path */
-  if (repo == NULL)
+  if (index == NULL)
     goto done; /* Note early happy return */
 
-  if (!ostree_repo_resolve_rev (repo, cachebranch, TRUE,
-                                &cached_rev, error))
-    return FALSE;
-
-  if (!cached_rev)
+  if (!rpmostree_pkgcache_index_lookup_branch (index, cachebranch))
     goto done; /* Note early happy return */
 
+  commit = rpmostree_pkgcache_index_load_commit (index, cachebranch, error);
+  if (!commit)
+    return FALSE;
+
   /* NB: we do an exception for LocalPackages here; we've already checked that
    * its cache is valid and matches what's in the origin. We never want to fetch
    * newer versions of LocalPackages from the repos. But we do want to check
@@ -1156,7 +1302,7 @@ find_pkg_in_ostree (OstreeRepo     *repo,
         return FALSE;
 
       gboolean same_pkg_chksum = FALSE;
-      if (!commit_has_matching_repodata_chksum_repr (repo, cached_rev,
+      if (!commit_has_matching_repodata_chksum_repr (commit,
                                                      expected_chksum_repr,
                                                      &same_pkg_chksum, error))
         return FALSE;
@@ -1168,7 +1314,7 @@ find_pkg_in_ostree (OstreeRepo     *repo,
   in_ostree = TRUE;
   if (sepolicy)
     {
-      if (!commit_has_matching_sepolicy (repo, cached_rev, sepolicy,
+      if (!commit_has_matching_sepolicy (commit, sepolicy,
                                          &selinux_match, error))
         return FALSE;
     }
@@ -1195,6 +1341,23 @@ sort_packages (RpmOstreeContext *self,
   self->pkgs_to_relabel = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
 
   GPtrArray *sources = dnf_context_get_repos (hifctx);
+  g_autoptr(GHashTable) sources_by_id = g_hash_table_new (g_str_hash, g_str_equal);
+  for (guint i = 0; i < sources->len; i++)
+    {
+      DnfRepo *src = sources->pdata[i];
+      g_hash_table_insert (sources_by_id, (char*)dnf_repo_get_id (src), src);
+    }
+
+  /* Classify everything against a single snapshot of the pkgcache refs; each
+   * commit's metadata is loaded at most once. */
+  RpmOstreePkgCacheIndex *index = NULL;
+  if (get_pkgcache_repo (self))
+    {
+      index = get_pkgcache_index (self, NULL, error);
+      if (!index)
+        return FALSE;
+    }
+
   g_autoptr(GPtrArray) packages = dnf_goal_get_packages (dnf_context_get_goal (hifctx),
                                                          DNF_PACKAGE_INFO_INSTALL, -1);
   for (guint i = 0; i < packages->len; i++)
@@ -1207,16 +1370,7 @@ sort_packages (RpmOstreeContext *self,
       /* make sure all the non-cached pkgs have their repos set */
       if (!is_locally_cached)
         {
-          DnfRepo *src = NULL;
-
-          /* Hackily look up the source...we need a hash table */
-          for (guint j = 0; j < sources->len && !src; j++)
-            {
-              DnfRepo *tmpsrc = sources->pdata[j];
-              if (g_strcmp0 (reponame, dnf_repo_get_id (tmpsrc)) == 0)
-                src = tmpsrc;
-            }
-
+          DnfRepo *src = g_hash_table_lookup (sources_by_id, reponame);
           g_assert (src);
           dnf_package_set_repo (pkg, src);
         }
@@ -1236,7 +1390,7 @@ sort_packages (RpmOstreeContext *self,
         gboolean selinux_match = FALSE;
         gboolean cached = pkg_is_cached (pkg);
 
-        if (!find_pkg_in_ostree (get_pkgcache_repo (self), pkg, self->sepolicy,
+        if (!find_pkg_in_ostree (index, pkg, self->sepolicy,
                                  &in_ostree, &selinux_match, error))
           return FALSE;
 
@@ -1611,6 +1765,12 @@ rpmostree_context_get_state_sha512 (RpmOstreeContext *self)
 
   if (!self->empty)
     rpmostree_dnf_add_checksum_goal (state_checksum, dnf_context_get_goal (self->hifctx));
+  /* The goal only covers what we're adding, so the result also depends on what
+   * was already there.
+   */
+  if (self->previous_layer)
+    g_checksum_update (state_checksum, (guint8*)self->previous_layer,
+                       strlen (self->previous_layer));
   return g_strdup (g_checksum_get_string (state_checksum));
 }
 
@@ -1641,70 +1801,124 @@ gather_source_to_packages (RpmOstreeContext *self)
   return g_steal_pointer (&source_to_packages);
 }
 
+static gboolean
+download_packages_from_repo (DnfRepo      *src,
+                             GPtrArray    *src_packages,
+                             const char   *progress_prefix,
+                             GCancellable *cancellable,
+                             GError      **error)
+{
+  glnx_unref_object DnfState *hifstate = dnf_state_new ();
+  guint progress_sigid = g_signal_connect (hifstate, "percentage-changed",
+                                           G_CALLBACK (on_hifstate_percentage_changed),
+                                           (gpointer) progress_prefix);
+
+  g_autofree char *target_dir =
+    g_build_filename (dnf_repo_get_location (src), "/packages/", NULL);
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, target_dir, 0755, cancellable, error))
+    return FALSE;
+
+  if (!dnf_repo_download_packages (src, src_packages, target_dir,
+                                   hifstate, error))
+    return FALSE;
+
+  g_signal_handler_disconnect (hifstate, progress_sigid);
+  rpmostree_output_percent_progress_end ();
+  return TRUE;
+}
+
+static void
+print_download_summary (RpmOstreeContext *self)
+{
+  const guint n = self->pkgs_to_download->len;
+  guint64 size =
+    dnf_package_array_get_download_size (self->pkgs_to_download);
+  g_autofree char *sizestr = g_format_size (size);
+  g_print ("Will download: %u package%s (%s)\n", n, _NS(n), sizestr);
+}
+
 gboolean
 rpmostree_context_download (RpmOstreeContext *self,
                             GCancellable     *cancellable,
                             GError          **error)
 {
-  int n = self->pkgs_to_download->len;
-
-  if (n > 0)
-    {
-      guint64 size =
-        dnf_package_array_get_download_size (self->pkgs_to_download);
-      g_autofree char *sizestr = g_format_size (size);
-      g_print ("Will download: %u package%s (%s)\n", n, _NS(n), sizestr);
-    }
-  else
+  if (self->pkgs_to_download->len == 0)
     return TRUE;
 
-  { guint progress_sigid;
-    g_autoptr(GHashTable) source_to_packages = gather_source_to_packages (self);
-    GLNX_HASH_TABLE_FOREACH_KV (source_to_packages, DnfRepo*, src, GPtrArray*, src_packages)
-      {
-        g_autofree char *target_dir = NULL;
-        glnx_unref_object DnfState *hifstate = dnf_state_new ();
-
-        g_autofree char *prefix
-          = g_strdup_printf ("  Downloading from %s:", dnf_repo_get_id (src));
-
-        progress_sigid = g_signal_connect (hifstate, "percentage-changed",
-                                           G_CALLBACK (on_hifstate_percentage_changed),
-                                           prefix);
-
-        target_dir = g_build_filename (dnf_repo_get_location (src), "/packages/", NULL);
-        if (!glnx_shutil_mkdir_p_at (AT_FDCWD, target_dir, 0755, cancellable, error))
-          return FALSE;
+  print_download_summary (self);
 
-        if (!dnf_repo_download_packages (src, src_packages, target_dir,
-                                         hifstate, error))
-          return FALSE;
+  g_autoptr(GHashTable) source_to_packages = gather_source_to_packages (self);
+  GLNX_HASH_TABLE_FOREACH_KV (source_to_packages, DnfRepo*, src, GPtrArray*, src_packages)
+    {
+      g_autofree char *prefix
+        = g_strdup_printf ("  Downloading from %s:", dnf_repo_get_id (src));
 
-        g_signal_handler_disconnect (hifstate, progress_sigid);
-        rpmostree_output_percent_progress_end ();
-      }
-  }
+      if (!download_packages_from_repo (src, src_packages, prefix,
+                                        cancellable, error))
+        return FALSE;
+    }
 
   return TRUE;
 }
 
-static gboolean
-import_one_package (RpmOstreeContext *self,
-                    DnfContext     *hifctx,
-                    DnfPackage     *pkg,
-                    OstreeSePolicy *sepolicy,
-                    GCancellable   *cancellable,
-                    GError        **error)
+/* One package being imported by the worker pool; the unpacker (and hence the
+ * header and fd) is created on the main thread, and dropped by the worker as
+ * soon as the import is done. */
+typedef struct {
+  const char *nevra;
+  char *pkg_path;
+  gboolean delete_after_import;
+  char *branch;
+  RpmOstreeUnpacker *unpacker;
+  char *commit;
+  gint64 elapsed_usec;
+} ImportJob;
+
+static void
+import_job_free (ImportJob *job)
 {
-  OstreeRepo *ostreerepo = get_pkgcache_repo (self);
-  g_autofree char *ostree_commit = NULL;
-  glnx_unref_object RpmOstreeUnpacker *unpacker = NULL;
-  g_autofree char *pkg_path;
-  DnfRepo *pkg_repo;
+  g_free (job->pkg_path);
+  g_free (job->branch);
+  g_clear_object (&job->unpacker);
+  g_free (job->commit);
+  g_free (job);
+}
 
-  int flags = 0;
+/* State shared between the queue and the workers */
+typedef struct {
+  OstreeRepo *repo;
+  OstreeSePolicy *sepolicy;
+  GCancellable *cancellable;
+  GMutex lock;
+  GCond cond;
+  guint n_done;
+  GError *error;
+} ImportPool;
+
+/* Feeds packages to a pool of workers writing into the (already open)
+ * transaction on the pkgcache repo.  Headers are only parsed a bit ahead of
+ * the workers, which bounds how many unpackers (and their fds) are open at
+ * once.
+ */
+typedef struct {
+  RpmOstreeContext *ctx;
+  GThreadPool *tpool;
+  ImportPool pool;
+  GPtrArray *jobs;
+  guint n_jobs;
+  guint max_pending;
+  guint n_queued;
+  guint n_reported;
+  DnfState *hifstate;
+} ImportQueue;
 
-  pkg_repo = dnf_package_get_repo (pkg);
+static gboolean
+prepare_import_job (RpmOstreeContext *self,
+                    DnfPackage       *pkg,
+                    ImportJob       **out_job,
+                    GError          **error)
+{
+  g_autofree char *pkg_path = NULL;
 
   if (pkg_is_local (pkg))
     pkg_path = g_strdup (dnf_package_get_filename (pkg));
@@ -1712,35 +1926,76 @@ import_one_package (RpmOstreeContext *self,
     {
       const char *pkg_location = dnf_package_get_location (pkg);
       pkg_path =
-        g_build_filename (dnf_repo_get_location (pkg_repo),
+        g_build_filename (dnf_repo_get_location (dnf_package_get_repo (pkg)),
                           "packages", glnx_basename (pkg_location), NULL);
     }
 
   /* Verify signatures if enabled */
-  if (!dnf_transaction_gpgcheck_package (dnf_context_get_transaction (hifctx), pkg, error))
+  if (!dnf_transaction_gpgcheck_package (dnf_context_get_transaction (self->hifctx), pkg, error))
     return FALSE;
 
-  flags = RPMOSTREE_UNPACKER_FLAGS_OSTREE_CONVENTION;
+  int flags = RPMOSTREE_UNPACKER_FLAGS_OSTREE_CONVENTION;
   if (self->unprivileged)
     flags |= RPMOSTREE_UNPACKER_FLAGS_UNPRIVILEGED;
 
   /* TODO - tweak the unpacker flags for containers */
-  unpacker = rpmostree_unpacker_new_at (AT_FDCWD, pkg_path, pkg, flags, error);
+  g_autoptr(RpmOstreeUnpacker) unpacker =
+    rpmostree_unpacker_new_at (AT_FDCWD, pkg_path, pkg, flags, error);
   if (!unpacker)
     return FALSE;
 
-  if (!rpmostree_unpacker_unpack_to_ostree (unpacker, ostreerepo, sepolicy,
-                                            &ostree_commit, cancellable, error))
-    return glnx_prefix_error (error, "Unpacking %s",
-                              dnf_package_get_nevra (pkg));
+  ImportJob *job = g_new0 (ImportJob, 1);
+  job->nevra = dnf_package_get_nevra (pkg);
+  job->pkg_path = g_steal_pointer (&pkg_path);
+  job->delete_after_import = !pkg_is_local (pkg);
+  job->branch = g_strdup (rpmostree_unpacker_get_ostree_branch (unpacker));
+  job->unpacker = g_steal_pointer (&unpacker);
+  *out_job = job;
+  return TRUE;
+}
+
+static gboolean
+import_one_job (ImportPool    *pool,
+                ImportJob     *job,
+                GError       **error)
+{
+  if (!rpmostree_unpacker_import_to_repo (job->unpacker, pool->repo,
+                                          pool->sepolicy, &job->commit,
+                                          pool->cancellable, error))
+    return glnx_prefix_error (error, "Unpacking %s", job->nevra);
+
+  /* The downloaded RPM is deleted in finish_import() once the transaction
+   * is committed; until then it's the only copy if we have to retry. */
+  return TRUE;
+}
+
+static void
+import_in_thread (gpointer data,
+                  gpointer user_data)
+{
+  ImportJob *job = data;
+  ImportPool *pool = user_data;
+  g_autoptr(GError) local_error = NULL;
+
+  g_mutex_lock (&pool->lock);
+  const gboolean skip = pool->error != NULL;
+  g_mutex_unlock (&pool->lock);
 
-  if (!pkg_is_local (pkg))
+  if (!skip)
     {
-      if (TEMP_FAILURE_RETRY (unlinkat (AT_FDCWD, pkg_path, 0)) < 0)
-        return glnx_throw_errno_prefix (error, "Deleting %s", pkg_path);
+      const gint64 start = g_get_monotonic_time ();
+      (void) import_one_job (pool, job, &local_error);
+      job->elapsed_usec = g_get_monotonic_time () - start;
     }
 
-  return TRUE;
+  g_clear_object (&job->unpacker);
+
+  g_mutex_lock (&pool->lock);
+  if (local_error && !pool->error)
+    pool->error = g_steal_pointer (&local_error);
+  pool->n_done++;
+  g_cond_signal (&pool->cond);
+  g_mutex_unlock (&pool->lock);
 }
 
 static inline void
@@ -1751,107 +2006,897 @@ dnf_state_assert_done (DnfState *hifstate)
   g_assert (r);
 }
 
-gboolean
-rpmostree_context_import (RpmOstreeContext *self,
-                          GCancellable     *cancellable,
-                          GError          **error)
+static void
+import_queue_init (ImportQueue      *q,
+                   RpmOstreeContext *self,
+                   OstreeRepo       *repo,
+                   guint             n_jobs,
+                   guint             max_pending,
+                   DnfState         *hifstate,
+                   GCancellable     *cancellable)
 {
-  DnfContext *hifctx = self->hifctx;
-  guint progress_sigid;
-  int n = self->pkgs_to_import->len;
+  q->ctx = self;
+  q->pool.repo = repo;
+  q->pool.sepolicy = self->sepolicy;
+  q->pool.cancellable = cancellable;
+  g_mutex_init (&q->pool.lock);
+  g_cond_init (&q->pool.cond);
+  q->jobs = g_ptr_array_new_with_free_func ((GDestroyNotify)import_job_free);
+  q->n_jobs = n_jobs;
+  q->max_pending = MAX (max_pending, 1);
+  q->hifstate = hifstate;
+  q->tpool = g_thread_pool_new (import_in_thread, &q->pool, n_jobs, FALSE, NULL);
+}
 
-  if (n == 0)
-    return TRUE;
+/* Block until at most @max_pending imports are outstanding.  Fails early
+ * if a worker did.
+ */
+static gboolean
+import_queue_wait (ImportQueue *q,
+                   guint        max_pending,
+                   GError     **error)
+{
+  g_mutex_lock (&q->pool.lock);
+  while (q->n_queued - q->pool.n_done > max_pending && q->pool.error == NULL)
+    g_cond_wait (&q->pool.cond, &q->pool.lock);
+  const guint n_done = q->pool.n_done;
+  const gboolean failed = q->pool.error != NULL;
+  if (failed)
+    g_propagate_error (error, g_error_copy (q->pool.error));
+  g_mutex_unlock (&q->pool.lock);
+
+  for (; q->n_reported < n_done; q->n_reported++)
+    {
+      if (q->hifstate)
+        dnf_state_assert_done (q->hifstate);
+    }
 
-  g_return_val_if_fail (get_pkgcache_repo (self) != NULL, FALSE);
+  return !failed;
+}
 
-  if (!dnf_transaction_import_keys (dnf_context_get_transaction (hifctx), error))
+static gboolean
+import_queue_push (ImportQueue *q,
+                   DnfPackage  *pkg,
+                   GError     **error)
+{
+  /* This is our backpressure */
+  if (!import_queue_wait (q, q->max_pending - 1, error))
     return FALSE;
 
-  {
-    glnx_unref_object DnfState *hifstate = dnf_state_new ();
-    dnf_state_set_number_steps (hifstate, self->pkgs_to_import->len);
-    progress_sigid = g_signal_connect (hifstate, "percentage-changed",
-                                       G_CALLBACK (on_hifstate_percentage_changed),
-                                       "Importing:");
-
-    for (guint i = 0; i < self->pkgs_to_import->len; i++)
-      {
-        DnfPackage *pkg = self->pkgs_to_import->pdata[i];
-        if (!import_one_package (self, hifctx, pkg,
-                                 self->sepolicy, cancellable, error))
-          return FALSE;
-        dnf_state_assert_done (hifstate);
-      }
-
-    g_signal_handler_disconnect (hifstate, progress_sigid);
-    rpmostree_output_percent_progress_end ();
-  }
-
-  sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
-                   SD_ID128_FORMAT_VAL(RPMOSTREE_MESSAGE_PKG_IMPORT),
-                   "MESSAGE=Imported %u pkg%s", n, _NS(n),
-                   "IMPORTED_N_PKGS=%u", n, NULL);
+  ImportJob *job = NULL;
+  if (!prepare_import_job (q->ctx, pkg, &job, error))
+    return FALSE;
 
+  g_ptr_array_add (q->jobs, job);
+  q->n_queued++;
+  g_thread_pool_push (q->tpool, job, NULL);
   return TRUE;
 }
 
+/* Wait for all queued imports and tear down the pool; always call this, even
+ * on error.  On success, returns the jobs in queue order.
+ */
 static gboolean
-checkout_package (OstreeRepo   *repo,
-                  DnfPackage   *pkg,
-                  int           dfd,
-                  const char   *path,
-                  OstreeRepoDevInoCache *devino_cache,
-                  const char   *pkg_commit,
-                  GCancellable *cancellable,
-                  GError      **error)
+import_queue_finish (ImportQueue *q,
+                     GPtrArray  **out_jobs,
+                     GError     **error)
 {
-  OstreeRepoCheckoutAtOptions opts = { OSTREE_REPO_CHECKOUT_MODE_USER,
-                                       OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES, };
-
-  /* We want the checkout to match the repo type so that we get hardlinks. */
-  if (ostree_repo_get_mode (repo) == OSTREE_REPO_MODE_BARE)
-    opts.mode = OSTREE_REPO_CHECKOUT_MODE_NONE;
+  g_thread_pool_free (g_steal_pointer (&q->tpool), FALSE, TRUE);
+  (void) import_queue_wait (q, 0, NULL);
 
-  opts.devino_to_csum_cache = devino_cache;
+  g_mutex_clear (&q->pool.lock);
+  g_cond_clear (&q->pool.cond);
 
-  /* Always want hardlinks */
-  opts.no_copy_fallback = TRUE;
+  g_autoptr(GPtrArray) jobs = g_steal_pointer (&q->jobs);
+  if (q->pool.error)
+    {
+      g_propagate_error (error, g_steal_pointer (&q->pool.error));
+      return FALSE;
+    }
 
-  if (!ostree_repo_checkout_at (repo, &opts, dfd, path,
-                                pkg_commit, cancellable, error))
-    return glnx_prefix_error (error, "Checking out %s",
-                              dnf_package_get_nevra (pkg));
+  if (out_jobs)
+    *out_jobs = g_steal_pointer (&jobs);
   return TRUE;
 }
 
-static gboolean
-checkout_package_into_root (RpmOstreeContext *self,
-                            DnfPackage   *pkg,
-                            int           dfd,
-                            const char   *path,
-                            OstreeRepoDevInoCache *devino_cache,
-                            const char   *pkg_commit,
+static int
+compare_import_job_elapsed (gconstpointer ap,
+                            gconstpointer bp)
+{
+  const ImportJob *a = *((const ImportJob *const*) ap);
+  const ImportJob *b = *((const ImportJob *const*) bp);
+  if (a->elapsed_usec == b->elapsed_usec)
+    return 0;
+  return a->elapsed_usec < b->elapsed_usec ? 1 : -1;
+}
+
+/* Set the number of packages imported concurrently; 0 means pick a default
+ * from $RPMOSTREE_IMPORT_JOBS or the number of processors. */
+void
+rpmostree_context_set_import_jobs (RpmOstreeContext *self,
+                                   guint             n_jobs)
+{
+  self->n_import_jobs = n_jobs;
+}
+
+/* Check out all layered packages at once from a merged tree, rather than
+ * one at a time; see checkout_merged_packages(). */
+void
+rpmostree_context_set_merged_checkout (RpmOstreeContext *self,
+                                       gboolean          merged_checkout)
+{
+  self->merged_checkout = merged_checkout;
+}
+
+static gboolean
+use_merged_checkout (RpmOstreeContext *self)
+{
+  if (self->merged_checkout)
+    return TRUE;
+
+  const char *env = g_getenv ("RPMOSTREE_MERGED_CHECKOUT");
+  return env && g_str_equal (env, "1");
+}
+
+static gboolean
+use_script_session (int rootfs_dfd)
+{
+  const char *env = g_getenv ("RPMOSTREE_SCRIPT_SESSION");
+  if (env && g_str_equal (env, "0"))
+    return FALSE;
+
+  return rpmostree_script_session_supported (rootfs_dfd);
+}
+
+static guint
+get_import_jobs (RpmOstreeContext *self)
+{
+  if (self->n_import_jobs > 0)
+    return self->n_import_jobs;
+
+  const char *jobs_env = g_getenv ("RPMOSTREE_IMPORT_JOBS");
+  if (jobs_env)
+    {
+      guint64 n = g_ascii_strtoull (jobs_env, NULL, 10);
+      if (n > 0)
+        return (guint) MIN (n, G_MAXINT);
+    }
+
+  /* We're mostly CPU bound decompressing and checksumming */
+  return g_get_num_processors ();
+}
+
+static gboolean
+begin_import (RpmOstreeContext *self,
+              OstreeRepo      **out_repo,
+              GCancellable     *cancellable,
+              GError          **error)
+{
+  OstreeRepo *repo = get_pkgcache_repo (self);
+  g_return_val_if_fail (repo != NULL, FALSE);
+
+  if (!dnf_transaction_import_keys (dnf_context_get_transaction (self->hifctx), error))
+    return FALSE;
+
+  /* All packages go into a single transaction; commits are still written
+   * with the RPM buildtime, so their checksums don't depend on ordering. */
+  if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
+    return FALSE;
+
+  *out_repo = repo;
+  return TRUE;
+}
+
+static gboolean
+finish_import (RpmOstreeContext *self,
+               OstreeRepo       *repo,
+               ImportQueue      *q,
+               gint64            start_time,
+               GCancellable     *cancellable,
+               GError          **error)
+{
+  const guint n_jobs = q->n_jobs;
+  g_autoptr(GPtrArray) jobs = NULL;
+  if (!import_queue_finish (q, &jobs, error))
+    {
+      (void) ostree_repo_abort_transaction (repo, cancellable, NULL);
+      return FALSE;
+    }
+
+  for (guint i = 0; i < jobs->len; i++)
+    {
+      ImportJob *job = jobs->pdata[i];
+      ostree_repo_transaction_set_ref (repo, NULL, job->branch, job->commit);
+    }
+
+  if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
+    {
+      (void) ostree_repo_abort_transaction (repo, cancellable, NULL);
+      return FALSE;
+    }
+
+  if (self->pkgcache_index)
+    {
+      for (guint i = 0; i < jobs->len; i++)
+        {
+          ImportJob *job = jobs->pdata[i];
+          rpmostree_pkgcache_index_update (self->pkgcache_index, job->branch, job->commit);
+        }
+    }
+
+  for (guint i = 0; i < jobs->len; i++)
+    {
+      ImportJob *job = jobs->pdata[i];
+      if (!job->delete_after_import)
+        continue;
+      if (TEMP_FAILURE_RETRY (unlinkat (AT_FDCWD, job->pkg_path, 0)) < 0)
+        return glnx_throw_errno_prefix (error, "Deleting %s", job->pkg_path);
+    }
+
+  const guint n = jobs->len;
+  const gint64 elapsed_usec = g_get_monotonic_time () - start_time;
+
+  g_ptr_array_sort (jobs, compare_import_job_elapsed);
+  g_autoptr(GString) slowest = g_string_new ("");
+  for (guint i = 0; i < MIN (jobs->len, 3); i++)
+    {
+      ImportJob *job = jobs->pdata[i];
+      g_string_append_printf (slowest, "%s%s (%.1fs)", i > 0 ? ", " : "",
+                              job->nevra, job->elapsed_usec / (double) G_USEC_PER_SEC);
+    }
+
+  rpmostree_output_task_begin ("Imported %u package%s using %u job%s",
+                               n, _NS(n), n_jobs, _NS(n_jobs));
+  rpmostree_output_task_end ("%.1fs; slowest: %s",
+                             elapsed_usec / (double) G_USEC_PER_SEC, slowest->str);
+
+  sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
+                   SD_ID128_FORMAT_VAL(RPMOSTREE_MESSAGE_PKG_IMPORT),
+                   "MESSAGE=Imported %u pkg%s", n, _NS(n),
+                   "IMPORTED_N_PKGS=%u", n,
+                   "IMPORT_JOBS=%u", n_jobs,
+                   "IMPORT_USEC=%" G_GINT64_FORMAT, elapsed_usec,
+                   NULL);
+
+  return TRUE;
+}
+
+gboolean
+rpmostree_context_import (RpmOstreeContext *self,
+                          GCancellable     *cancellable,
+                          GError          **error)
+{
+  const guint n = self->pkgs_to_import->len;
+
+  if (n == 0)
+    return TRUE;
+
+  OstreeRepo *repo = NULL;
+  if (!begin_import (self, &repo, cancellable, error))
+    return FALSE;
+
+  const guint n_jobs = MIN (get_import_jobs (self), n);
+  const gint64 start_time = g_get_monotonic_time ();
+
+  glnx_unref_object DnfState *hifstate = dnf_state_new ();
+  dnf_state_set_number_steps (hifstate, n);
+  guint progress_sigid = g_signal_connect (hifstate, "percentage-changed",
+                                           G_CALLBACK (on_hifstate_percentage_changed),
+                                           "Importing:");
+
+  ImportQueue q = { 0, };
+  import_queue_init (&q, self, repo, n_jobs, n_jobs * 2, hifstate, cancellable);
+
+  g_autoptr(GError) local_error = NULL;
+  for (guint i = 0; i < n && local_error == NULL; i++)
+    (void) import_queue_push (&q, self->pkgs_to_import->pdata[i], &local_error);
+  /* Make sure the progress bar finishes before we print anything else */
+  (void) import_queue_wait (&q, 0, NULL);
+
+  g_signal_handler_disconnect (hifstate, progress_sigid);
+  rpmostree_output_percent_progress_end ();
+
+  if (local_error)
+    {
+      (void) import_queue_finish (&q, NULL, NULL);
+      (void) ostree_repo_abort_transaction (repo, cancellable, NULL);
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  return finish_import (self, repo, &q, start_time, cancellable, error);
+}
+
+/* Like rpmostree_context_download() followed by rpmostree_context_import(),
+ * but packages are downloaded in batches and each batch is handed to the
+ * import workers as soon as it lands, so network and CPU work overlap.  The
+ * import queue is bounded, so downloading stalls if the workers fall behind,
+ * and only a few batches worth of RPMs are ever on disk at once.
+ */
+gboolean
+rpmostree_context_download_and_import (RpmOstreeContext *self,
+                                       GCancellable     *cancellable,
+                                       GError          **error)
+{
+  const guint n = self->pkgs_to_import->len;
+
+  if (n == 0)
+    return rpmostree_context_download (self, cancellable, error);
+
+  if (self->pkgs_to_download->len > 0)
+    print_download_summary (self);
+
+  OstreeRepo *repo = NULL;
+  if (!begin_import (self, &repo, cancellable, error))
+    return FALSE;
+
+  const guint n_jobs = MIN (get_import_jobs (self), n);
+  /* One batch is enough to keep every worker busy */
+  const guint batch_size = n_jobs * 2;
+  const gint64 start_time = g_get_monotonic_time ();
+
+  ImportQueue q = { 0, };
+  import_queue_init (&q, self, repo, n_jobs, batch_size * 2, NULL, cancellable);
+
+  g_autoptr(GHashTable) to_import = g_hash_table_new (NULL, NULL);
+  for (guint i = 0; i < n; i++)
+    g_hash_table_add (to_import, self->pkgs_to_import->pdata[i]);
+  g_autoptr(GHashTable) to_download = g_hash_table_new (NULL, NULL);
+  for (guint i = 0; i < self->pkgs_to_download->len; i++)
+    g_hash_table_add (to_download, self->pkgs_to_download->pdata[i]);
+
+  g_autoptr(GError) local_error = NULL;
+
+  /* Anything already on disk (e.g. local RPMs) can start right away */
+  for (guint i = 0; i < n && local_error == NULL; i++)
+    {
+      DnfPackage *pkg = self->pkgs_to_import->pdata[i];
+      if (!g_hash_table_contains (to_download, pkg))
+        (void) import_queue_push (&q, pkg, &local_error);
+    }
+
+  g_autoptr(GHashTable) source_to_packages = gather_source_to_packages (self);
+  GLNX_HASH_TABLE_FOREACH_KV (source_to_packages, DnfRepo*, src, GPtrArray*, src_packages)
+    {
+      const guint n_batches = (src_packages->len + batch_size - 1) / batch_size;
+
+      for (guint b = 0; b < n_batches && local_error == NULL; b++)
+        {
+          const guint start = b * batch_size;
+          const guint end = MIN (start + batch_size, src_packages->len);
+          g_autoptr(GPtrArray) batch = g_ptr_array_sized_new (end - start);
+          for (guint i = start; i < end; i++)
+            g_ptr_array_add (batch, src_packages->pdata[i]);
+
+          g_autofree char *prefix =
+            g_strdup_printf ("  Downloading from %s (%u/%u):",
+                             dnf_repo_get_id (src), b + 1, n_batches);
+          if (!download_packages_from_repo (src, batch, prefix, cancellable, &local_error))
+            break;
+
+          for (guint i = 0; i < batch->len && local_error == NULL; i++)
+            {
+              DnfPackage *pkg = batch->pdata[i];
+              if (g_hash_table_contains (to_import, pkg))
+                (void) import_queue_push (&q, pkg, &local_error);
+            }
+        }
+
+      if (local_error)
+        break;
+    }
+
+  if (local_error)
+    {
+      (void) import_queue_finish (&q, NULL, NULL);
+      (void) ostree_repo_abort_transaction (repo, cancellable, NULL);
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  return finish_import (self, repo, &q, start_time, cancellable, error);
+}
+
+static gboolean
+checkout_package (OstreeRepo   *repo,
+                  const char   *nevra,
+                  int           dfd,
+                  const char   *path,
+                  OstreeRepoDevInoCache *devino_cache,
+                  const char   *pkg_commit,
+                  GCancellable *cancellable,
+                  GError      **error)
+{
+  OstreeRepoCheckoutAtOptions opts = { OSTREE_REPO_CHECKOUT_MODE_USER,
+                                       OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES, };
+
+  /* We want the checkout to match the repo type so that we get hardlinks. */
+  if (ostree_repo_get_mode (repo) == OSTREE_REPO_MODE_BARE)
+    opts.mode = OSTREE_REPO_CHECKOUT_MODE_NONE;
+
+  opts.devino_to_csum_cache = devino_cache;
+
+  /* Always want hardlinks */
+  opts.no_copy_fallback = TRUE;
+
+  if (!ostree_repo_checkout_at (repo, &opts, dfd, path,
+                                pkg_commit, cancellable, error))
+    return glnx_prefix_error (error, "Checking out %s", nevra);
+  return TRUE;
+}
+
+/* If the pkgcache is a separate repo, make sure all the content for
+ * @pkg_commits is in the system repo, so that we can hardlink from it.
+ */
+static gboolean
+import_cached_content (RpmOstreeContext *self,
+                       GPtrArray        *pkg_commits,
+                       GCancellable     *cancellable,
+                       GError          **error)
+{
+  OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
+
+  if (pkgcache_repo == self->ostreerepo || pkg_commits->len == 0)
+    return TRUE;
+
+  if (!rpmostree_pull_content_only_batch (self->ostreerepo, pkgcache_repo, pkg_commits,
+                                          get_import_jobs (self), cancellable, error))
+    return glnx_prefix_error (error, "Linking cached content");
+
+  return TRUE;
+}
+
+static gboolean
+checkout_package_into_root (RpmOstreeContext *self,
+                            DnfPackage   *pkg,
+                            int           dfd,
+                            const char   *path,
+                            OstreeRepoDevInoCache *devino_cache,
+                            const char   *pkg_commit,
                             GCancellable *cancellable,
                             GError      **error)
 {
   OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
 
-  if (pkgcache_repo != self->ostreerepo)
+  /* The content itself was already brought over by import_cached_content() */
+  if (!checkout_package (pkgcache_repo, dnf_package_get_nevra (pkg), dfd, path,
+                         devino_cache, pkg_commit,
+                         cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* A package to check out, along with what it contains, so that packages
+ * which don't step on each other can be checked out at the same time.
+ */
+typedef struct {
+  DnfPackage *pkg;
+  const char *commit;
+  GHashTable *files; /* path -> checksum; anything that isn't a directory */
+  GHashTable *dirs;  /* path -> dirmeta checksum */
+  guint wave;
+} CheckoutJob;
+
+static void
+checkout_job_free (CheckoutJob *job)
+{
+  g_clear_pointer (&job->files, g_hash_table_unref);
+  g_clear_pointer (&job->dirs, g_hash_table_unref);
+  g_free (job);
+}
+
+static gboolean
+collect_dirtree_paths (OstreeRepo   *repo,
+                       const char   *contents_checksum,
+                       const char   *prefix,
+                       GHashTable   *files,
+                       GHashTable   *dirs,
+                       GError      **error)
+{
+  g_autoptr(GVariant) dirtree = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                 contents_checksum, &dirtree, error))
+    return FALSE;
+
+  g_autoptr(GVariant) files_v = g_variant_get_child_value (dirtree, 0);
+  const guint n_files = g_variant_n_children (files_v);
+  for (guint i = 0; i < n_files; i++)
     {
-      if (!rpmostree_pull_content_only (self->ostreerepo, pkgcache_repo, pkg_commit,
-                                        cancellable, error))
+      const char *name;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_variant_get_child (files_v, i, "(&s@ay)", &name, &csum_v);
+      g_hash_table_insert (files, g_build_filename (prefix, name, NULL),
+                           ostree_checksum_from_bytes_v (csum_v));
+    }
+
+  g_autoptr(GVariant) dirs_v = g_variant_get_child_value (dirtree, 1);
+  const guint n_dirs = g_variant_n_children (dirs_v);
+  for (guint i = 0; i < n_dirs; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) contents_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_variant_get_child (dirs_v, i, "(&s@ay@ay)", &name, &contents_csum_v, &meta_csum_v);
+      char *path = g_build_filename (prefix, name, NULL);
+      g_hash_table_insert (dirs, path, ostree_checksum_from_bytes_v (meta_csum_v));
+
+      g_autofree char *subdir_checksum = ostree_checksum_from_bytes_v (contents_csum_v);
+      if (!collect_dirtree_paths (repo, subdir_checksum, path, files, dirs, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static CheckoutJob *
+checkout_job_new (OstreeRepo *repo,
+                  DnfPackage *pkg,
+                  const char *commit,
+                  GError    **error)
+{
+  g_autoptr(GVariant) commit_v = NULL;
+  if (!ostree_repo_load_commit (repo, commit, &commit_v, NULL, error))
+    return NULL;
+
+  g_autoptr(GVariant) tree_csum_v = NULL;
+  g_variant_get_child (commit_v, 6, "@ay", &tree_csum_v);
+  g_autofree char *tree_csum = ostree_checksum_from_bytes_v (tree_csum_v);
+
+  CheckoutJob *job = g_new0 (CheckoutJob, 1);
+  job->pkg = pkg;
+  job->commit = commit;
+  job->files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  job->dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  if (!collect_dirtree_paths (repo, tree_csum, "", job->files, job->dirs, error))
+    {
+      checkout_job_free (job);
+      return glnx_prefix_error_null (error, "Reading %s", dnf_package_get_nevra (pkg));
+    }
+  return job;
+}
+
+typedef struct {
+  gint file_wave; /* last wave with a non-directory here, or -1 */
+  gint dir_wave;  /* last wave with a directory here, or -1 */
+  const char *dirmeta; /* dirmeta of the first package with a directory here */
+} CheckoutPathWaves;
+
+/* Assign each of @jobs (in rpm order) to a wave.  A package has to come
+ * after any earlier one which has a file at one of its paths (so the
+ * last one still wins with OVERWRITE_UNION_FILES), or a directory where it
+ * has a file and vice versa.  Union checkout leaves an existing directory
+ * alone, so the first package to create a directory decides its metadata;
+ * a package with a different dirmeta for it has to come after every
+ * earlier one which has it too.  Everything else can go in parallel.
+ * Returns the number of waves.
+ */
+static guint
+schedule_checkout_jobs (GPtrArray *jobs)
+{
+  g_autoptr(GHashTable) paths =
+    g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+  guint n_waves = 0;
+
+  for (guint i = 0; i < jobs->len; i++)
+    {
+      CheckoutJob *job = jobs->pdata[i];
+      gint wave = 0;
+
+      GLNX_HASH_TABLE_FOREACH (job->files, const char*, path)
         {
-          g_prefix_error (error, "Linking cached content for %s: ", dnf_package_get_nevra (pkg));
-          return FALSE;
+          CheckoutPathWaves *waves = g_hash_table_lookup (paths, path);
+          if (waves)
+            wave = MAX (wave, MAX (waves->file_wave, waves->dir_wave) + 1);
+        }
+      GLNX_HASH_TABLE_FOREACH_KV (job->dirs, const char*, path, const char*, dirmeta)
+        {
+          CheckoutPathWaves *waves = g_hash_table_lookup (paths, path);
+          if (!waves)
+            continue;
+          wave = MAX (wave, waves->file_wave + 1);
+          if (waves->dirmeta && !g_str_equal (waves->dirmeta, dirmeta))
+            wave = MAX (wave, waves->dir_wave + 1);
+        }
+
+      job->wave = wave;
+      n_waves = MAX (n_waves, (guint)wave + 1);
+
+      GLNX_HASH_TABLE_FOREACH (job->files, const char*, path)
+        {
+          CheckoutPathWaves *waves = g_hash_table_lookup (paths, path);
+          if (!waves)
+            {
+              waves = g_new0 (CheckoutPathWaves, 1);
+              waves->file_wave = waves->dir_wave = -1;
+              g_hash_table_insert (paths, (char*)path, waves);
+            }
+          waves->file_wave = MAX (waves->file_wave, wave);
+        }
+      GLNX_HASH_TABLE_FOREACH_KV (job->dirs, const char*, path, const char*, dirmeta)
+        {
+          CheckoutPathWaves *waves = g_hash_table_lookup (paths, path);
+          if (!waves)
+            {
+              waves = g_new0 (CheckoutPathWaves, 1);
+              waves->file_wave = waves->dir_wave = -1;
+              g_hash_table_insert (paths, (char*)path, waves);
+            }
+          if (!waves->dirmeta)
+            waves->dirmeta = dirmeta;
+          waves->dir_wave = MAX (waves->dir_wave, wave);
         }
     }
 
-  if (!checkout_package (pkgcache_repo, pkg, dfd, path,
-                         devino_cache, pkg_commit,
-                         cancellable, error))
+  return n_waves;
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  int dfd;
+  GCancellable *cancellable;
+  GMutex lock;
+  GCond cond;
+  guint n_done;
+  GError *error;
+} CheckoutPool;
+
+static void
+checkout_in_thread (gpointer data,
+                    gpointer user_data)
+{
+  CheckoutJob *job = data;
+  CheckoutPool *pool = user_data;
+  g_autoptr(GError) local_error = NULL;
+
+  g_mutex_lock (&pool->lock);
+  const gboolean skip = pool->error != NULL;
+  g_mutex_unlock (&pool->lock);
+
+  /* The devino cache isn't thread-safe; see checkout_packages_into_root() */
+  if (!skip)
+    (void) checkout_package (pool->repo, dnf_package_get_nevra (job->pkg),
+                             pool->dfd, ".", NULL, job->commit,
+                             pool->cancellable, &local_error);
+
+  g_mutex_lock (&pool->lock);
+  if (local_error && !pool->error)
+    pool->error = g_steal_pointer (&local_error);
+  pool->n_done++;
+  g_cond_signal (&pool->cond);
+  g_mutex_unlock (&pool->lock);
+}
+
+/* Merge the tree @contents_checksum into @dir the way checking it out over
+ * it with OVERWRITE_UNION_FILES would: files replace what's there, and
+ * directories keep the metadata of whoever created them first.
+ */
+static gboolean
+merge_dirtree (OstreeRepo        *repo,
+               OstreeMutableTree *dir,
+               const char        *contents_checksum,
+               GError           **error)
+{
+  g_autoptr(GVariant) dirtree = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE,
+                                 contents_checksum, &dirtree, error))
     return FALSE;
 
+  g_autoptr(GVariant) files_v = g_variant_get_child_value (dirtree, 0);
+  const guint n_files = g_variant_n_children (files_v);
+  for (guint i = 0; i < n_files; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_variant_get_child (files_v, i, "(&s@ay)", &name, &csum_v);
+      char checksum[OSTREE_SHA256_STRING_LEN+1];
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (csum_v), checksum);
+      if (!ostree_mutable_tree_replace_file (dir, name, checksum, error))
+        return FALSE;
+    }
+
+  g_autoptr(GVariant) dirs_v = g_variant_get_child_value (dirtree, 1);
+  const guint n_dirs = g_variant_n_children (dirs_v);
+  for (guint i = 0; i < n_dirs; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) contents_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_variant_get_child (dirs_v, i, "(&s@ay@ay)", &name, &contents_csum_v, &meta_csum_v);
+
+      g_autoptr(OstreeMutableTree) subdir = NULL;
+      if (!ostree_mutable_tree_ensure_dir (dir, name, &subdir, error))
+        return FALSE;
+      if (!ostree_mutable_tree_get_metadata_checksum (subdir))
+        {
+          g_autofree char *meta_checksum = ostree_checksum_from_bytes_v (meta_csum_v);
+          ostree_mutable_tree_set_metadata_checksum (subdir, meta_checksum);
+        }
+
+      g_autofree char *subdir_checksum = ostree_checksum_from_bytes_v (contents_csum_v);
+      if (!merge_dirtree (repo, subdir, subdir_checksum, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Merge all of @pkgs (in rpm order) into a single synthetic commit in the
+ * pkgcache repo, and check that out once.  Compared to checking out each
+ * package, this avoids recreating shared directories like usr/lib64 and
+ * looking up their dirmeta over and over again.  The commit is deleted again
+ * once checked out; any dirtrees only it used go with the next pkgcache
+ * prune.
+ */
+static gboolean
+checkout_merged_packages (RpmOstreeContext *self,
+                          GPtrArray        *pkgs,
+                          GHashTable       *pkg_to_ostree_commit,
+                          int               dfd,
+                          OstreeRepoDevInoCache *devino_cache,
+                          GCancellable     *cancellable,
+                          GError          **error)
+{
+  OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
+  g_autoptr(OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+
+  for (guint i = 0; i < pkgs->len; i++)
+    {
+      DnfPackage *pkg = pkgs->pdata[i];
+      const char *commit = g_hash_table_lookup (pkg_to_ostree_commit, pkg);
+      g_autoptr(GVariant) commit_v = NULL;
+      if (!ostree_repo_load_commit (pkgcache_repo, commit, &commit_v, NULL, error))
+        return FALSE;
+
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_variant_get_child (commit_v, 6, "@ay", &tree_csum_v);
+      g_variant_get_child (commit_v, 7, "@ay", &meta_csum_v);
+      if (!ostree_mutable_tree_get_metadata_checksum (mtree))
+        {
+          g_autofree char *meta_checksum = ostree_checksum_from_bytes_v (meta_csum_v);
+          ostree_mutable_tree_set_metadata_checksum (mtree, meta_checksum);
+        }
+
+      g_autofree char *tree_csum = ostree_checksum_from_bytes_v (tree_csum_v);
+      if (!merge_dirtree (pkgcache_repo, mtree, tree_csum, error))
+        return glnx_prefix_error (error, "Merging %s", dnf_package_get_nevra (pkg));
+    }
+
+  if (!ostree_repo_prepare_transaction (pkgcache_repo, NULL, cancellable, error))
+    return FALSE;
+
+  g_autoptr(GFile) root = NULL;
+  g_autofree char *merged_commit = NULL;
+  if (!ostree_repo_write_mtree (pkgcache_repo, mtree, &root, cancellable, error) ||
+      !ostree_repo_write_commit (pkgcache_repo, NULL, "", "", NULL,
+                                 OSTREE_REPO_FILE (root), &merged_commit,
+                                 cancellable, error) ||
+      !ostree_repo_commit_transaction (pkgcache_repo, NULL, cancellable, error))
+    {
+      (void) ostree_repo_abort_transaction (pkgcache_repo, cancellable, NULL);
+      return glnx_prefix_error (error, "Writing merged tree");
+    }
+
+  g_autofree char *desc = g_strdup_printf ("%u packages", pkgs->len);
+  const gboolean checked_out =
+    checkout_package (pkgcache_repo, desc, dfd, ".", devino_cache,
+                      merged_commit, cancellable, error);
+
+  /* Nothing references it, so don't let these pile up in the cache */
+  g_autoptr(GError) local_error = NULL;
+  if (!ostree_repo_delete_object (pkgcache_repo, OSTREE_OBJECT_TYPE_COMMIT,
+                                  merged_commit, cancellable, &local_error) && checked_out)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return glnx_prefix_error (error, "Deleting merged commit");
+    }
+
+  return checked_out;
+}
+
+/* Check out @pkgs (in rpm order) into @dfd, running packages which don't
+ * overlap concurrently.  Packages that have to be checked out alone use
+ * @devino_cache as usual; it's not safe to share between threads, so for the
+ * others we remember what we checked out in self->checkout_files, and the
+ * commit uses that instead.
+ */
+static gboolean
+checkout_packages_into_root (RpmOstreeContext *self,
+                             GPtrArray        *pkgs,
+                             GHashTable       *pkg_to_ostree_commit,
+                             int               dfd,
+                             OstreeRepoDevInoCache *devino_cache,
+                             GCancellable     *cancellable,
+                             GError          **error)
+{
+  OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
+  const guint n_jobs = MIN (get_import_jobs (self), pkgs->len);
+
+  if (use_merged_checkout (self) && pkgs->len > 1)
+    return checkout_merged_packages (self, pkgs, pkg_to_ostree_commit, dfd,
+                                     devino_cache, cancellable, error);
+
+  if (n_jobs <= 1)
+    {
+      for (guint i = 0; i < pkgs->len; i++)
+        {
+          DnfPackage *pkg = pkgs->pdata[i];
+          if (!checkout_package_into_root (self, pkg, dfd, ".", devino_cache,
+                                           g_hash_table_lookup (pkg_to_ostree_commit, pkg),
+                                           cancellable, error))
+            return FALSE;
+        }
+      return TRUE;
+    }
+
+  g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func ((GDestroyNotify)checkout_job_free);
+  for (guint i = 0; i < pkgs->len; i++)
+    {
+      DnfPackage *pkg = pkgs->pdata[i];
+      CheckoutJob *job = checkout_job_new (pkgcache_repo, pkg,
+                                           g_hash_table_lookup (pkg_to_ostree_commit, pkg),
+                                           error);
+      if (!job)
+        return FALSE;
+      g_ptr_array_add (jobs, job);
+    }
+
+  const guint n_waves = schedule_checkout_jobs (jobs);
+
+  CheckoutPool pool = { pkgcache_repo, dfd, cancellable, };
+  g_mutex_init (&pool.lock);
+  g_cond_init (&pool.cond);
+  GThreadPool *tpool = g_thread_pool_new (checkout_in_thread, &pool, n_jobs,
+                                          FALSE, NULL);
+
+  guint n_pushed = 0;
+  for (guint wave = 0; wave < n_waves && !pool.error; wave++)
+    {
+      g_autoptr(GPtrArray) wave_jobs = g_ptr_array_new ();
+      for (guint i = 0; i < jobs->len; i++)
+        {
+          CheckoutJob *job = jobs->pdata[i];
+          if (job->wave == wave)
+            g_ptr_array_add (wave_jobs, job);
+        }
+
+      if (wave_jobs->len == 1)
+        {
+          CheckoutJob *job = wave_jobs->pdata[0];
+          if (!checkout_package (pkgcache_repo, dnf_package_get_nevra (job->pkg), dfd, ".",
+                                 devino_cache, job->commit, cancellable, &pool.error))
+            break;
+          continue;
+        }
+
+      if (!self->checkout_files)
+        self->checkout_files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      for (guint i = 0; i < wave_jobs->len; i++)
+        {
+          CheckoutJob *job = wave_jobs->pdata[i];
+          GLNX_HASH_TABLE_FOREACH_KV (job->files, const char*, path, const char*, checksum)
+            g_hash_table_replace (self->checkout_files, g_strdup (path), g_strdup (checksum));
+          g_thread_pool_push (tpool, job, NULL);
+        }
+      n_pushed += wave_jobs->len;
+
+      g_mutex_lock (&pool.lock);
+      while (pool.n_done < n_pushed)
+        g_cond_wait (&pool.cond, &pool.lock);
+      g_mutex_unlock (&pool.lock);
+    }
+
+  g_thread_pool_free (tpool, FALSE, TRUE);
+  g_mutex_clear (&pool.lock);
+  g_cond_clear (&pool.cond);
+
+  if (pool.error)
+    {
+      g_propagate_error (error, pool.error);
+      return FALSE;
+    }
+
   return TRUE;
 }
 
@@ -1879,6 +2924,57 @@ get_rpmdb_pkg_header (rpmts rpmdb_ts,
   return headerLink (hdr);
 }
 
+/* Delete @fn, listed with @mode in a package being removed, from @rootfs_dfd
+ * unless it's under a directory already in @deleted_dirs; the per-file half of
+ * delete_package_from_root().  Non-static for tests.
+ */
+gboolean
+rpmostree_delete_package_path (int               rootfs_dfd,
+                               RpmOstreePathSet *deleted_dirs,
+                               const char       *fn,
+                               guint             mode,
+                               GCancellable     *cancellable,
+                               GError          **error)
+{
+  /* see also apply_rpmfi_override_one() for a commented version of this */
+  if (!(S_ISREG (mode) ||
+        S_ISLNK (mode) ||
+        S_ISDIR (mode)))
+    return TRUE;
+
+  g_assert (fn != NULL);
+  fn += strspn (fn, "/");
+  g_assert (fn[0]);
+
+  g_autofree char *fn_owned = NULL;
+  if (g_str_has_prefix (fn, "etc/"))
+    fn = fn_owned = g_strconcat ("usr/", fn, NULL);
+
+  /* for now, we only remove files from /usr */
+  if (!g_str_has_prefix (fn, "usr/"))
+    return TRUE;
+
+  /* avoiding the stat syscall is worth a bit of userspace computation */
+  if (rpmostree_path_set_has_parent (deleted_dirs, fn))
+    return TRUE;
+
+  struct stat stbuf;
+  if (fstatat (rootfs_dfd, fn, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+      if (errno == ENOENT)
+        return TRUE; /* a job well done */
+      return glnx_throw_errno_prefix (error, "fstatat(%s)", fn);
+    }
+
+  if (!glnx_shutil_rm_rf_at (rootfs_dfd, fn, cancellable, error))
+    return FALSE;
+
+  if (S_ISDIR (mode))
+    rpmostree_path_set_add (deleted_dirs, fn);
+
+  return TRUE;
+}
+
 static gboolean
 delete_package_from_root (RpmOstreeContext *self,
                           rpmte         pkg,
@@ -1893,49 +2989,13 @@ delete_package_from_root (RpmOstreeContext *self,
   rpmfi fi = rpmteFI (pkg); /* rpmfi owned by rpmte */
 #endif
 
-  g_autoptr(GPtrArray) deleted_dirs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(RpmOstreePathSet) deleted_dirs = rpmostree_path_set_new ();
 
-  int i;
-  while ((i = rpmfiNext (fi)) >= 0)
+  while (rpmfiNext (fi) >= 0)
     {
-      /* see also apply_rpmfi_overrides() for a commented version of the loop */
-      const char *fn = rpmfiFN (fi);
-      rpm_mode_t mode = rpmfiFMode (fi);
-
-      if (!(S_ISREG (mode) ||
-            S_ISLNK (mode) ||
-            S_ISDIR (mode)))
-        continue;
-
-      g_assert (fn != NULL);
-      fn += strspn (fn, "/");
-      g_assert (fn[0]);
-
-      g_autofree char *fn_owned = NULL;
-      if (g_str_has_prefix (fn, "etc/"))
-        fn = fn_owned = g_strconcat ("usr/", fn, NULL);
-
-      /* for now, we only remove files from /usr */
-      if (!g_str_has_prefix (fn, "usr/"))
-        continue;
-
-      /* avoiding the stat syscall is worth a bit of userspace computation */
-      if (rpmostree_str_has_prefix_in_ptrarray (fn, deleted_dirs))
-        continue;
-
-      struct stat stbuf;
-      if (fstatat (rootfs_dfd, fn, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
-        {
-          if (errno == ENOENT)
-            continue; /* a job well done */
-          return glnx_throw_errno_prefix (error, "fstatat(%s)", fn);
-        }
-
-      if (!glnx_shutil_rm_rf_at (rootfs_dfd, fn, cancellable, error))
+      if (!rpmostree_delete_package_path (rootfs_dfd, deleted_dirs, rpmfiFN (fi),
+                                          rpmfiFMode (fi), cancellable, error))
         return FALSE;
-
-      if (S_ISDIR (mode))
-        g_ptr_array_add (deleted_dirs, g_strconcat (fn, "/", NULL));
     }
 
   return TRUE;
@@ -2065,212 +3125,378 @@ set_selinux_label (GVariant   *xattrs,
   return g_variant_ref_sink (g_variant_builder_end (&builder));
 }
 
+static GVariant *
+empty_xattrs (void)
+{
+  return g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE ("(ayay)"), NULL, 0));
+}
+
+/* If the label of the file object @checksum at @path is out of date, write a
+ * copy of it with the new label and return its checksum; otherwise, set
+ * @out_new_checksum to %NULL.
+ */
 static gboolean
-relabel_dir_recurse_at (OstreeRepo        *repo,
-                        int                dfd,
-                        const char        *path,
-                        const char        *prefix,
-                        OstreeSePolicy    *sepolicy,
-                        guint             *inout_n_changed,
-                        GCancellable      *cancellable,
-                        GError           **error)
+relabel_file_object (OstreeRepo     *repo,
+                     const char     *checksum,
+                     const char     *path,
+                     OstreeSePolicy *sepolicy,
+                     char          **out_new_checksum,
+                     GCancellable   *cancellable,
+                     GError        **error)
 {
-  g_auto(GLnxDirFdIterator) dfd_iter = { FALSE, };
-  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfd_iter, error))
+  g_autoptr(GFileInfo) finfo = NULL;
+  g_autoptr(GVariant) xattrs = NULL;
+  if (!ostree_repo_load_file (repo, checksum, NULL, &finfo, &xattrs,
+                              cancellable, error))
+    return FALSE;
+  if (!xattrs)
+    xattrs = empty_xattrs ();
+
+  const guint32 mode = g_file_info_get_attribute_uint32 (finfo, "unix::mode");
+  g_autofree char *new_label = NULL;
+  /* may be NULL */
+  if (!rpmostree_sepolicy_get_label_locked (sepolicy, path, mode, &new_label,
+                                            cancellable, error))
     return FALSE;
 
-  while (TRUE)
+  if (g_strcmp0 (get_selinux_label (xattrs), new_label) == 0)
     {
-      struct dirent *dent = NULL;
-      g_autofree char *fullpath = NULL;
+      *out_new_checksum = NULL;
+      return TRUE;
+    }
 
-      const char *cur_label = NULL;
-      g_autofree char *new_label = NULL;
-      g_autoptr(GVariant) cur_xattrs = NULL;
-      g_autoptr(GVariant) new_xattrs = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  if (!ostree_repo_load_file (repo, checksum, &input, NULL, NULL,
+                              cancellable, error))
+    return FALSE;
 
-      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent,
-                                                       cancellable, error))
-        return FALSE;
-      if (dent == NULL)
-        break;
+  g_autoptr(GVariant) new_xattrs = set_selinux_label (xattrs, new_label);
+  g_autoptr(GInputStream) content = NULL;
+  guint64 content_len;
+  if (!ostree_raw_file_to_content_stream (input, finfo, new_xattrs, &content,
+                                          &content_len, cancellable, error))
+    return FALSE;
 
-      if (dent->d_type != DT_DIR &&
-          dent->d_type != DT_REG &&
-          dent->d_type != DT_LNK)
-        continue;
+  g_autofree guchar *csum_raw = NULL;
+  if (!ostree_repo_write_content (repo, NULL, content, content_len, &csum_raw,
+                                  cancellable, error))
+    return FALSE;
 
-      if (!glnx_dfd_name_get_all_xattrs (dfd_iter.fd, dent->d_name, &cur_xattrs,
-                                         cancellable, error))
-        return FALSE;
+  *out_new_checksum = ostree_checksum_from_bytes (csum_raw);
+  return TRUE;
+}
 
-      /* may return NULL */
-      cur_label = get_selinux_label (cur_xattrs);
+/* Same as relabel_file_object(), but for a dirmeta object. */
+static gboolean
+relabel_dirmeta (OstreeRepo     *repo,
+                 const char     *checksum,
+                 const char     *path,
+                 OstreeSePolicy *sepolicy,
+                 char          **out_new_checksum,
+                 GCancellable   *cancellable,
+                 GError        **error)
+{
+  g_autoptr(GVariant) dirmeta = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_META, checksum,
+                                 &dirmeta, error))
+    return FALSE;
 
-      /* build the new full path to use for label lookup (we can't just use
-       * glnx_fdrel_abspath() since that will just give a new /proc/self/fd/$fd
-       * on each recursion) */
-      fullpath = g_build_filename (prefix, dent->d_name, NULL);
+  guint32 uid, gid, mode;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_variant_get (dirmeta, "(uuu@a(ayay))", &uid, &gid, &mode, &xattrs);
 
-      {
-        struct stat stbuf;
+  g_autofree char *new_label = NULL;
+  /* may be NULL */
+  if (!rpmostree_sepolicy_get_label_locked (sepolicy, path, GUINT32_FROM_BE (mode),
+                                            &new_label, cancellable, error))
+    return FALSE;
 
-        if (fstatat (dfd_iter.fd, dent->d_name, &stbuf,
-                     AT_SYMLINK_NOFOLLOW) != 0)
-          return glnx_throw_errno_prefix (error, "fstatat");
+  if (g_strcmp0 (get_selinux_label (xattrs), new_label) == 0)
+    {
+      *out_new_checksum = NULL;
+      return TRUE;
+    }
 
-        /* may be NULL */
-        if (!ostree_sepolicy_get_label (sepolicy, fullpath, stbuf.st_mode,
-                                        &new_label, cancellable, error))
-          return FALSE;
-      }
+  /* uid, gid and mode are already in the on-disk (big-endian) form */
+  g_autoptr(GVariant) new_xattrs = set_selinux_label (xattrs, new_label);
+  g_autoptr(GVariant) new_dirmeta =
+    g_variant_ref_sink (g_variant_new ("(uuu@a(ayay))", uid, gid, mode, new_xattrs));
 
-      if (g_strcmp0 (cur_label, new_label) != 0)
-        {
-          if (dent->d_type != DT_DIR)
-            if (!break_single_hardlink_at (dfd_iter.fd, dent->d_name,
-                                           cancellable, error))
-              return FALSE;
+  g_autofree guchar *csum_raw = NULL;
+  if (!ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL,
+                                   new_dirmeta, &csum_raw, cancellable, error))
+    return FALSE;
 
-          new_xattrs = set_selinux_label (cur_xattrs, new_label);
+  *out_new_checksum = ostree_checksum_from_bytes (csum_raw);
+  return TRUE;
+}
 
-          if (!glnx_dfd_name_set_all_xattrs (dfd_iter.fd, dent->d_name,
-                                             new_xattrs, cancellable, error))
-            return FALSE;
+/* Walk the dirtree @checksum (at @path) without checking anything out,
+ * rewriting only the objects whose label changed.  If anything beneath it
+ * changed, a new dirtree is written and returned in @out_new_checksum;
+ * otherwise that's set to %NULL and the existing tree can be reused as is.
+ */
+static gboolean
+relabel_dirtree (OstreeRepo     *repo,
+                 const char     *checksum,
+                 const char     *path,
+                 OstreeSePolicy *sepolicy,
+                 guint          *inout_n_changed,
+                 char          **out_new_checksum,
+                 GCancellable   *cancellable,
+                 GError        **error)
+{
+  g_autoptr(GVariant) dirtree = NULL;
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, checksum,
+                                 &dirtree, error))
+    return FALSE;
+
+  g_autoptr(GVariant) files = g_variant_get_child_value (dirtree, 0);
+  g_autoptr(GVariant) dirs = g_variant_get_child_value (dirtree, 1);
+  gboolean changed = FALSE;
 
+  g_auto(GVariantBuilder) files_builder;
+  g_variant_builder_init (&files_builder, G_VARIANT_TYPE ("a(say)"));
+  const guint n_files = g_variant_n_children (files);
+  for (guint i = 0; i < n_files; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+
+      char csum[OSTREE_SHA256_STRING_LEN+1];
+      ostree_checksum_inplace_from_bytes (ostree_checksum_bytes_peek (csum_v), csum);
+      g_autofree char *fullpath = g_build_filename (path, name, NULL);
+
+      g_autofree char *new_csum = NULL;
+      if (!relabel_file_object (repo, csum, fullpath, sepolicy, &new_csum,
+                                cancellable, error))
+        return FALSE;
+
+      if (new_csum)
+        {
+          changed = TRUE;
           (*inout_n_changed)++;
+          g_variant_builder_add (&files_builder, "(s@ay)", name,
+                                 ostree_checksum_to_bytes_v (new_csum));
         }
+      else
+        g_variant_builder_add (&files_builder, "(s@ay)", name, csum_v);
+    }
 
-      if (dent->d_type == DT_DIR)
-        if (!relabel_dir_recurse_at (repo, dfd_iter.fd, dent->d_name, fullpath,
-                                     sepolicy, inout_n_changed, cancellable, error))
-          return FALSE;
+  g_auto(GVariantBuilder) dirs_builder;
+  g_variant_builder_init (&dirs_builder, G_VARIANT_TYPE ("a(sayay)"));
+  const guint n_dirs = g_variant_n_children (dirs);
+  for (guint i = 0; i < n_dirs; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &tree_csum_v, &meta_csum_v);
+
+      g_autofree char *tree_csum = ostree_checksum_from_bytes_v (tree_csum_v);
+      g_autofree char *meta_csum = ostree_checksum_from_bytes_v (meta_csum_v);
+      g_autofree char *fullpath = g_build_filename (path, name, NULL);
+
+      g_autofree char *new_meta_csum = NULL;
+      if (!relabel_dirmeta (repo, meta_csum, fullpath, sepolicy, &new_meta_csum,
+                            cancellable, error))
+        return FALSE;
+      if (new_meta_csum)
+        (*inout_n_changed)++;
+
+      g_autofree char *new_tree_csum = NULL;
+      if (!relabel_dirtree (repo, tree_csum, fullpath, sepolicy, inout_n_changed,
+                            &new_tree_csum, cancellable, error))
+        return FALSE;
+
+      if (new_meta_csum || new_tree_csum)
+        changed = TRUE;
+
+      g_variant_builder_add (&dirs_builder, "(s@ay@ay)", name,
+                             new_tree_csum ? ostree_checksum_to_bytes_v (new_tree_csum)
+                                           : tree_csum_v,
+                             new_meta_csum ? ostree_checksum_to_bytes_v (new_meta_csum)
+                                           : meta_csum_v);
     }
 
-  return TRUE;
-}
+  if (!changed)
+    {
+      *out_new_checksum = NULL;
+      return TRUE;
+    }
 
-static gboolean
-relabel_rootfs (OstreeRepo        *repo,
-                int                dfd,
-                OstreeSePolicy    *sepolicy,
-                guint             *inout_n_changed,
-                GCancellable      *cancellable,
-                GError           **error)
-{
-  /* NB: this does mean that / itself will not be labeled properly, but that
-   * doesn't matter since it will always exist during overlay */
-  return relabel_dir_recurse_at (repo, dfd, ".", "/", sepolicy,
-                                 inout_n_changed, cancellable, error);
+  g_autoptr(GVariant) new_dirtree =
+    g_variant_ref_sink (g_variant_new ("(@a(say)@a(sayay))",
+                                       g_variant_builder_end (&files_builder),
+                                       g_variant_builder_end (&dirs_builder)));
+  g_autofree guchar *csum_raw = NULL;
+  if (!ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_TREE, NULL,
+                                   new_dirtree, &csum_raw, cancellable, error))
+    return FALSE;
+
+  *out_new_checksum = ostree_checksum_from_bytes (csum_raw);
+  return TRUE;
 }
 
+/* Write a relabeled copy of the package on @cachebranch into the current
+ * transaction; the caller is responsible for updating the ref.  This may be
+ * called from multiple threads for different packages.
+ *
+ * Since only xattrs can change, we don't check anything out: we walk the
+ * cached commit's dirtree and only write new objects where the label actually
+ * differs, reusing everything else.
+ */
 static gboolean
 relabel_one_package (OstreeRepo     *repo,
-                     DnfPackage     *pkg,
+                     const char     *cachebranch,
                      OstreeSePolicy *sepolicy,
                      guint          *inout_n_changed,
+                     char          **out_commit,
                      GCancellable   *cancellable,
                      GError        **error)
 {
-  gboolean ret = FALSE;
-
-  g_autofree char *tmprootfs = g_strdup ("tmp/rpmostree-relabel-XXXXXX");
-  glnx_fd_close int tmprootfs_dfd = -1;
-  g_autoptr(OstreeRepoDevInoCache) cache = NULL;
-  g_autoptr(OstreeRepoCommitModifier) modifier = NULL;
-  g_autoptr(GFile) root = NULL;
   g_autofree char *commit_csum = NULL;
-  g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
-
   if (!ostree_repo_resolve_rev (repo, cachebranch, FALSE,
                                 &commit_csum, error))
-    goto out;
-
-  /* create a tmprootfs in ostree tmp dir */
-  {
-    int repo_dfd = ostree_repo_get_dfd (repo); /* borrowed */
-
-    if (!glnx_mkdtempat (repo_dfd, tmprootfs, 00755, error))
-      goto out;
-
-    if (!glnx_opendirat (repo_dfd, tmprootfs, FALSE, &tmprootfs_dfd, error))
-      goto out;
-  }
-
-  /* checkout the pkg and relabel, breaking hardlinks */
-
-  cache = ostree_repo_devino_cache_new ();
+    return FALSE;
 
-  if (!checkout_package (repo, pkg, tmprootfs_dfd, ".", cache,
-                         commit_csum, cancellable, error))
-    goto out;
+  g_autoptr(GVariant) commit_var = NULL;
+  if (!ostree_repo_load_commit (repo, commit_csum, &commit_var, NULL, error))
+    return FALSE;
 
-  /* This is where the magic happens. We traverse the tree and relabel stuff,
-   * making sure to break hardlinks if needed. */
-  if (!relabel_rootfs (repo, tmprootfs_dfd, sepolicy, inout_n_changed, cancellable, error))
-    goto out;
+  g_autoptr(GVariant) root_tree_v = g_variant_get_child_value (commit_var, 6);
+  g_autoptr(GVariant) root_meta_v = g_variant_get_child_value (commit_var, 7);
+  g_autofree char *root_tree = ostree_checksum_from_bytes_v (root_tree_v);
+  g_autofree char *root_meta = ostree_checksum_from_bytes_v (root_meta_v);
 
-  if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
-    goto out;
+  /* NB: this does mean that / itself will not be labeled properly, but that
+   * doesn't matter since it will always exist during overlay */
+  g_autofree char *new_root_tree = NULL;
+  if (!relabel_dirtree (repo, root_tree, "/", sepolicy, inout_n_changed,
+                        &new_root_tree, cancellable, error))
+    return FALSE;
 
-  /* write to the tree */
+  g_autoptr(GFile) root = NULL;
   {
     glnx_unref_object OstreeMutableTree *mtree = ostree_mutable_tree_new ();
+    ostree_mutable_tree_set_contents_checksum (mtree, new_root_tree ?: root_tree);
+    ostree_mutable_tree_set_metadata_checksum (mtree, root_meta);
+    if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
+      return FALSE;
+  }
 
-    modifier =
-      ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_NONE,
-                                       NULL, NULL, NULL);
+  /* let's just copy the metadata from the previous commit and only change the
+   * rpmostree.sepolicy value */
+  g_autoptr(GVariant) meta = g_variant_get_child_value (commit_var, 0);
+  g_autoptr(GVariantDict) meta_dict = g_variant_dict_new (meta);
+  g_variant_dict_insert (meta_dict, "rpmostree.sepolicy", "s",
+                         ostree_sepolicy_get_csum (sepolicy));
 
-    ostree_repo_commit_modifier_set_devino_cache (modifier, cache);
+  if (!ostree_repo_write_commit (repo, NULL, "", "",
+                                 g_variant_dict_end (meta_dict),
+                                 OSTREE_REPO_FILE (root), out_commit,
+                                 cancellable, error))
+    return FALSE;
 
-    if (!ostree_repo_write_dfd_to_mtree (repo, tmprootfs_dfd, ".", mtree,
-                                         modifier, cancellable, error))
-      goto out;
+  return TRUE;
+}
 
-    if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
-      goto out;
+typedef struct {
+  const char *nevra;
+  char *cachebranch;
+  char *commit;
+  guint n_changed;
+} RelabelJob;
 
-  }
+static void
+relabel_job_free (RelabelJob *job)
+{
+  g_free (job->cachebranch);
+  g_free (job->commit);
+  g_free (job);
+}
 
-  /* build metadata and commit */
-  {
-    g_autoptr(GVariant) commit_var = NULL;
-    g_autoptr(GVariantDict) meta_dict = NULL;
+typedef struct {
+  OstreeRepo *repo;
+  OstreeSePolicy *sepolicy;
+  GCancellable *cancellable;
+  GMutex lock;
+  GCond cond;
+  guint n_done;
+  GError *error;
+} RelabelPool;
 
-    if (!ostree_repo_load_commit (repo, commit_csum, &commit_var, NULL, error))
-      goto out;
+static void
+relabel_in_thread (gpointer data,
+                   gpointer user_data)
+{
+  RelabelJob *job = data;
+  RelabelPool *pool = user_data;
+  g_autoptr(GError) local_error = NULL;
 
-    /* let's just copy the metadata from the previous commit and only change the
-     * rpmostree.sepolicy value */
-    {
-      g_autoptr(GVariant) meta = g_variant_get_child_value (commit_var, 0);
-      meta_dict = g_variant_dict_new (meta);
+  g_mutex_lock (&pool->lock);
+  const gboolean skip = pool->error != NULL;
+  g_mutex_unlock (&pool->lock);
 
-      g_variant_dict_insert (meta_dict, "rpmostree.sepolicy", "s",
-                             ostree_sepolicy_get_csum (sepolicy));
+  if (!skip)
+    {
+      if (!relabel_one_package (pool->repo, job->cachebranch,
+                                pool->sepolicy, &job->n_changed, &job->commit,
+                                pool->cancellable, &local_error))
+        g_prefix_error (&local_error, "Relabeling %s: ", job->nevra);
     }
 
-    {
-      g_autofree char *new_commit_csum = NULL;
-      if (!ostree_repo_write_commit (repo, NULL, "", "",
-                                     g_variant_dict_end (meta_dict),
-                                     OSTREE_REPO_FILE (root), &new_commit_csum,
-                                     cancellable, error))
-        goto out;
+  g_mutex_lock (&pool->lock);
+  if (local_error && !pool->error)
+    pool->error = g_steal_pointer (&local_error);
+  pool->n_done++;
+  g_cond_signal (&pool->cond);
+  g_mutex_unlock (&pool->lock);
+}
 
-      ostree_repo_transaction_set_ref (repo, NULL, cachebranch,
-                                       new_commit_csum);
+/* Relabel all of @jobs into the open transaction on @repo, using up to
+ * @n_jobs threads.
+ */
+static gboolean
+relabel_in_pool (OstreeRepo     *repo,
+                 OstreeSePolicy *sepolicy,
+                 GPtrArray      *jobs,
+                 guint           n_jobs,
+                 DnfState       *hifstate,
+                 GCancellable   *cancellable,
+                 GError        **error)
+{
+  RelabelPool pool = { repo, sepolicy, cancellable, };
+  g_mutex_init (&pool.lock);
+  g_cond_init (&pool.cond);
+
+  GThreadPool *tpool = g_thread_pool_new (relabel_in_thread, &pool, n_jobs,
+                                          FALSE, NULL);
+  for (guint i = 0; i < jobs->len; i++)
+    g_thread_pool_push (tpool, jobs->pdata[i], NULL);
+
+  guint n_reported = 0;
+  g_mutex_lock (&pool.lock);
+  while (pool.n_done < jobs->len)
+    {
+      g_cond_wait (&pool.cond, &pool.lock);
+      for (; n_reported < pool.n_done; n_reported++)
+        dnf_state_assert_done (hifstate);
     }
-  }
+  g_mutex_unlock (&pool.lock);
 
-  if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
-    goto out;
+  g_thread_pool_free (tpool, FALSE, TRUE);
+  g_mutex_clear (&pool.lock);
+  g_cond_clear (&pool.cond);
 
-  ret = TRUE;
-out:
-  if (tmprootfs_dfd != -1)
-    glnx_shutil_rm_rf_at (tmprootfs_dfd, ".", cancellable, NULL);
-  return ret;
+  if (pool.error)
+    {
+      g_propagate_error (error, pool.error);
+      return FALSE;
+    }
+
+  return TRUE;
 }
 
 gboolean
@@ -2289,6 +3515,21 @@ rpmostree_context_relabel (RpmOstreeContext *self,
 
   g_return_val_if_fail (ostreerepo != NULL, FALSE);
 
+  /* Relabeling is the same sort of work as importing, so share the knob */
+  const guint n_jobs = MIN (get_import_jobs (self), (guint)n);
+  const gint64 start_time = g_get_monotonic_time ();
+
+  g_autoptr(GPtrArray) jobs =
+    g_ptr_array_new_with_free_func ((GDestroyNotify)relabel_job_free);
+  for (guint i = 0; i < self->pkgs_to_relabel->len; i++)
+    {
+      DnfPackage *pkg = self->pkgs_to_relabel->pdata[i];
+      RelabelJob *job = g_new0 (RelabelJob, 1);
+      job->nevra = dnf_package_get_nevra (pkg);
+      job->cachebranch = rpmostree_get_cache_branch_pkg (pkg);
+      g_ptr_array_add (jobs, job);
+    }
+
   glnx_unref_object DnfState *hifstate = dnf_state_new ();
   g_autofree char *prefix = g_strdup_printf ("Relabeling %d package%s:", n, _NS(n));
 
@@ -2297,31 +3538,60 @@ rpmostree_context_relabel (RpmOstreeContext *self,
                                      G_CALLBACK (on_hifstate_percentage_changed),
                                      prefix);
 
+  if (!ostree_repo_prepare_transaction (ostreerepo, NULL, cancellable, error))
+    return FALSE;
+
+  if (!relabel_in_pool (ostreerepo, self->sepolicy, jobs, n_jobs, hifstate,
+                        cancellable, error))
+    {
+      (void) ostree_repo_abort_transaction (ostreerepo, cancellable, NULL);
+      return FALSE;
+    }
+
   guint n_changed_files = 0;
   guint n_changed_pkgs = 0;
   const guint n_to_relabel = self->pkgs_to_relabel->len;
-  for (guint i = 0; i < n_to_relabel; i++)
+  for (guint i = 0; i < jobs->len; i++)
     {
-        DnfPackage *pkg = self->pkgs_to_relabel->pdata[i];
-        guint pkg_n_changed = 0;
-        if (!relabel_one_package (ostreerepo, pkg, self->sepolicy,
-                                  &pkg_n_changed, cancellable, error))
-          return FALSE;
-        if (pkg_n_changed > 0)
-          {
-            n_changed_files += pkg_n_changed;
-            n_changed_pkgs++;
-          }
-        dnf_state_assert_done (hifstate);
+      RelabelJob *job = jobs->pdata[i];
+      ostree_repo_transaction_set_ref (ostreerepo, NULL, job->cachebranch,
+                                       job->commit);
+      if (job->n_changed > 0)
+        {
+          n_changed_files += job->n_changed;
+          n_changed_pkgs++;
+        }
+    }
+
+  if (!ostree_repo_commit_transaction (ostreerepo, NULL, cancellable, error))
+    {
+      (void) ostree_repo_abort_transaction (ostreerepo, cancellable, NULL);
+      return FALSE;
+    }
+
+  if (self->pkgcache_index)
+    {
+      for (guint i = 0; i < jobs->len; i++)
+        {
+          RelabelJob *job = jobs->pdata[i];
+          rpmostree_pkgcache_index_update (self->pkgcache_index, job->cachebranch,
+                                           job->commit);
+        }
     }
 
   g_signal_handler_disconnect (hifstate, progress_sigid);
   rpmostree_output_percent_progress_end ();
 
+  const gint64 elapsed_usec = g_get_monotonic_time () - start_time;
+
   sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL(RPMOSTREE_MESSAGE_SELINUX_RELABEL),
-                   "MESSAGE=Relabeled %u/%u pkgs, %u files changed", n_changed_pkgs, n_to_relabel, n_changed_files,
+                   "MESSAGE=Relabeled %u/%u pkgs, %u files changed in %.1fs",
+                   n_changed_pkgs, n_to_relabel, n_changed_files,
+                   elapsed_usec / (double) G_USEC_PER_SEC,
                    "RELABELED_PKGS=%u/%u", n_changed_pkgs, n_to_relabel,
                    "RELABELED_N_CHANGED_FILES=%u", n_changed_files,
+                   "RELABEL_JOBS=%u", n_jobs,
+                   "RELABEL_USEC=%" G_GINT64_FORMAT, elapsed_usec,
                    NULL);
 
   return TRUE;
@@ -2368,6 +3638,34 @@ ts_callback (const void * h,
   return NULL;
 }
 
+/* Don't keep more than this many bytes of headers around in the context */
+#define RPMOSTREE_METAINFO_CACHE_MAX_BYTES (256 * 1024 * 1024)
+
+typedef struct {
+  Header hdr;
+} PackageMetainfo;
+
+static void
+package_metainfo_free (PackageMetainfo *info)
+{
+  headerFree (info->hdr);
+  g_free (info);
+}
+
+/* An rpmfi carries its iteration state, so every caller gets its own;
+ * building one from an already parsed header is cheap.
+ */
+static rpmfi
+package_metainfo_get_fi (PackageMetainfo *info)
+{
+  return rpmfiNew (NULL, info->hdr, RPMTAG_BASENAMES,
+                   (RPMFI_NOHEADER | RPMFI_FLAGS_INSTALL));
+}
+
+/* The same headers are needed several times during assembly (ordering,
+ * scripts, rpmfi overrides, and the rpmdb), so keep them parsed in
+ * self->metainfo_cache rather than re-reading them from tmpdir each time.
+ */
 static gboolean
 get_package_metainfo (RpmOstreeContext *self,
                       const char *path,
@@ -2375,12 +3673,47 @@ get_package_metainfo (RpmOstreeContext *self,
                       rpmfi *out_fi,
                       GError **error)
 {
-  glnx_fd_close int metadata_fd = -1;
-  if ((metadata_fd = openat (self->tmpdir_fd, path, O_RDONLY | O_CLOEXEC)) < 0)
-    return glnx_throw_errno_prefix (error, "open(%s)", path);
+  PackageMetainfo *info =
+    self->metainfo_cache ? g_hash_table_lookup (self->metainfo_cache, path) : NULL;
+
+  if (!info)
+    {
+      glnx_fd_close int metadata_fd = -1;
+      if ((metadata_fd = openat (self->tmpdir_fd, path, O_RDONLY | O_CLOEXEC)) < 0)
+        return glnx_throw_errno_prefix (error, "open(%s)", path);
+
+      g_auto(Header) hdr = NULL;
+      if (!rpmostree_unpacker_read_metainfo (metadata_fd, &hdr, NULL, NULL, error))
+        return FALSE;
+
+      info = g_new0 (PackageMetainfo, 1);
+      info->hdr = g_steal_pointer (&hdr);
+
+      const guint64 size = headerSizeof (info->hdr, HEADER_MAGIC_NO);
+      if (self->metainfo_cache_bytes + size > RPMOSTREE_METAINFO_CACHE_MAX_BYTES)
+        {
+          /* Over budget; hand this one out uncached */
+          if (out_header)
+            *out_header = headerLink (info->hdr);
+          if (out_fi)
+            *out_fi = package_metainfo_get_fi (info);
+          package_metainfo_free (info);
+          return TRUE;
+        }
 
-  return rpmostree_unpacker_read_metainfo (metadata_fd, out_header, NULL,
-                                           out_fi, error);
+      if (!self->metainfo_cache)
+        self->metainfo_cache =
+          g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                 (GDestroyNotify)package_metainfo_free);
+      g_hash_table_insert (self->metainfo_cache, g_strdup (path), info);
+      self->metainfo_cache_bytes += size;
+    }
+
+  if (out_header)
+    *out_header = headerLink (info->hdr);
+  if (out_fi)
+    *out_fi = package_metainfo_get_fi (info);
+  return TRUE;
 }
 
 static gboolean
@@ -2433,6 +3766,9 @@ rpmts_add_erase (RpmOstreeContext *self,
 static gboolean
 run_posttrans_sync (RpmOstreeContext *self,
                     int rootfs_dfd,
+                    RpmOstreeScriptSession *session,
+                    GPtrArray *script_stats,
+                    GPtrArray *deferred_triggers,
                     DnfPackage *pkg,
                     GCancellable *cancellable,
                     GError    **error)
@@ -2443,8 +3779,8 @@ run_posttrans_sync (RpmOstreeContext *self,
   if (!get_package_metainfo (self, path, &hdr, NULL, error))
     return FALSE;
 
-  if (!rpmostree_posttrans_run_sync (pkg, hdr, rootfs_dfd,
-                                     cancellable, error))
+  if (!rpmostree_posttrans_run_sync (pkg, hdr, rootfs_dfd, session, script_stats,
+                                     deferred_triggers, cancellable, error))
     return FALSE;
 
   return TRUE;
@@ -2453,6 +3789,8 @@ run_posttrans_sync (RpmOstreeContext *self,
 static gboolean
 run_pre_sync (RpmOstreeContext *self,
               int rootfs_dfd,
+              RpmOstreeScriptSession *session,
+              GPtrArray *script_stats,
               DnfPackage *pkg,
               GCancellable *cancellable,
               GError    **error)
@@ -2463,168 +3801,220 @@ run_pre_sync (RpmOstreeContext *self,
   if (!get_package_metainfo (self, path, &hdr, NULL, error))
     return FALSE;
 
-  if (!rpmostree_pre_run_sync (pkg, hdr, rootfs_dfd, cancellable, error))
+  if (!rpmostree_pre_run_sync (pkg, hdr, rootfs_dfd, session, script_stats,
+                               cancellable, error))
     return FALSE;
 
   return TRUE;
 }
 
 static gboolean
-apply_rpmfi_overrides (RpmOstreeContext *self,
-                       int            tmprootfs_dfd,
-                       DnfPackage    *pkg,
-                       GHashTable    *passwdents,
-                       GHashTable    *groupents,
-                       GCancellable  *cancellable,
-                       GError       **error)
+apply_rpmfi_override_one (int            tmprootfs_dfd,
+                          DnfPackage    *pkg,
+                          const char    *fn,
+                          const char    *user,
+                          const char    *group,
+                          const char    *fcaps,
+                          rpm_mode_t     mode,
+                          rpmfileAttrs   fattrs,
+                          GHashTable    *passwdents,
+                          GHashTable    *groupents,
+                          gboolean      *emitted_nonusr_warning,
+                          GCancellable  *cancellable,
+                          GError       **error)
 {
-  int i;
-  g_auto(rpmfi) fi = NULL;
-  gboolean emitted_nonusr_warning = FALSE;
-  g_autofree char *path = get_package_relpath (pkg);
+  g_autofree char *modified_fn = NULL;  /* May be used to override fn */
+  const gboolean is_ghost = fattrs & RPMFILE_GHOST;
+  struct stat stbuf;
+  uid_t uid = 0;
+  gid_t gid = 0;
 
-  if (!get_package_metainfo (self, path, NULL, &fi, error))
-    return FALSE;
+  /* In theory, RPMs could contain block devices or FIFOs; we would normally
+   * have rejected that at the import time, but let's also be sure here.
+   */
+  if (!(S_ISREG (mode) ||
+        S_ISLNK (mode) ||
+        S_ISDIR (mode)))
+    return TRUE;
+
+  g_assert (fn != NULL);
+  fn += strspn (fn, "/");
+  g_assert (fn[0]);
 
-  while ((i = rpmfiNext (fi)) >= 0)
+  /* /run and /var paths have already been translated to tmpfiles during
+   * unpacking */
+  if (g_str_has_prefix (fn, "run/") ||
+      g_str_has_prefix (fn, "var/"))
+    return TRUE;
+  else if (g_str_has_prefix (fn, "etc/"))
     {
-      const char *fn = rpmfiFN (fi);
-      g_autofree char *modified_fn = NULL;  /* May be used to override fn */
-      const char *user = rpmfiFUser (fi) ?: "root";
-      const char *group = rpmfiFGroup (fi) ?: "root";
-      const char *fcaps = rpmfiFCaps (fi) ?: '\0';
-      rpm_mode_t mode = rpmfiFMode (fi);
-      rpmfileAttrs fattrs = rpmfiFFlags (fi);
-      const gboolean is_ghost = fattrs & RPMFILE_GHOST;
-      struct stat stbuf;
-      uid_t uid = 0;
-      gid_t gid = 0;
+      /* The tree uses usr/etc */
+      fn = modified_fn = g_strconcat ("usr/", fn, NULL);
+    }
+  else if (!g_str_has_prefix (fn, "usr/"))
+    {
+      /* TODO: query whether Fedora has anything in this category we care about */
+      if (!*emitted_nonusr_warning)
+        {
+          sd_journal_print (LOG_WARNING, "Ignoring rpm mode for non-/usr content: %s", fn);
+          *emitted_nonusr_warning = TRUE;
+        }
+      return TRUE;
+    }
 
-      if (g_str_equal (user, "root") &&
-          g_str_equal (group, "root"))
-        continue;
+  if (fstatat (tmprootfs_dfd, fn, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+      /* In the ghost case, we expect it to not exist. */
+      if (errno == ENOENT && is_ghost)
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "fstatat(%s)", fn);
+    }
 
-      /* In theory, RPMs could contain block devices or FIFOs; we would normally
-       * have rejected that at the import time, but let's also be sure here.
-       */
-      if (!(S_ISREG (mode) ||
-            S_ISLNK (mode) ||
-            S_ISDIR (mode)))
-        continue;
+  if ((S_IFMT & stbuf.st_mode) != (S_IFMT & mode))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Inconsistent file type between RPM and checkout "
+                   "for file '%s' in package '%s'", fn,
+                   dnf_package_get_name (pkg));
+      return FALSE;
+    }
 
-      g_assert (fn != NULL);
-      fn += strspn (fn, "/");
-      g_assert (fn[0]);
+  if (!S_ISDIR (stbuf.st_mode))
+    {
+      if (!break_single_hardlink_at (tmprootfs_dfd, fn, cancellable, error))
+        return FALSE;
+    }
 
-      /* /run and /var paths have already been translated to tmpfiles during
-       * unpacking */
-      if (g_str_has_prefix (fn, "run/") ||
-          g_str_has_prefix (fn, "var/"))
-        continue;
-      else if (g_str_has_prefix (fn, "etc/"))
-        {
-          /* The tree uses usr/etc */
-          fn = modified_fn = g_strconcat ("usr/", fn, NULL);
-        }
-      else if (!g_str_has_prefix (fn, "usr/"))
-        {
-          /* TODO: query whether Fedora has anything in this category we care about */
-          if (!emitted_nonusr_warning)
-            {
-              sd_journal_print (LOG_WARNING, "Ignoring rpm mode for non-/usr content: %s", fn);
-              emitted_nonusr_warning = TRUE;
-            }
-          continue;
-        }
+  if ((!g_str_equal (user, "root") && !passwdents) ||
+      (!g_str_equal (group, "root") && !groupents))
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Missing passwd/group files for chown");
+      return FALSE;
+    }
 
-      if (fstatat (tmprootfs_dfd, fn, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
-        {
-          /* Not early loop skip; in the ghost case, we expect it to not
-           * exist.
-           */
-          if (errno == ENOENT && is_ghost)
-            continue;
-          return glnx_throw_errno_prefix (error, "fstatat(%s)", fn);
-        }
+  if (!g_str_equal (user, "root"))
+    {
+      struct conv_passwd_ent *passwdent =
+        g_hash_table_lookup (passwdents, user);
 
-      if ((S_IFMT & stbuf.st_mode) != (S_IFMT & mode))
+      if (!passwdent)
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                       "Inconsistent file type between RPM and checkout "
-                       "for file '%s' in package '%s'", fn,
-                       dnf_package_get_name (pkg));
+                       "Could not find user '%s' in passwd file", user);
           return FALSE;
         }
 
-      if (!S_ISDIR (stbuf.st_mode))
-        {
-          if (!break_single_hardlink_at (tmprootfs_dfd, fn, cancellable, error))
-            return FALSE;
-        }
+      uid = passwdent->uid;
+    }
+
+  if (!g_str_equal (group, "root"))
+    {
+      struct conv_group_ent *groupent =
+        g_hash_table_lookup (groupents, group);
 
-      if ((!g_str_equal (user, "root") && !passwdents) ||
-          (!g_str_equal (group, "root") && !groupents))
+      if (!groupent)
         {
-          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                               "Missing passwd/group files for chown");
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Could not find group '%s' in group file",
+                       group);
           return FALSE;
         }
 
-      if (!g_str_equal (user, "root"))
-        {
-          struct conv_passwd_ent *passwdent =
-            g_hash_table_lookup (passwdents, user);
+      gid = groupent->gid;
+    }
 
-          if (!passwdent)
-            {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           "Could not find user '%s' in passwd file", user);
-              return FALSE;
-            }
+  if (fchownat (tmprootfs_dfd, fn, uid, gid, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+      glnx_set_prefix_error_from_errno (error, "fchownat: %s", fn);
+      return FALSE;
+    }
 
-          uid = passwdent->uid;
-        }
+  /* the chown clears away file caps, so reapply it here */
+  if (fcaps[0] != '\0')
+    {
+      g_autoptr(GVariant) xattrs = rpmostree_fcap_to_xattr_variant (fcaps);
+      if (!glnx_dfd_name_set_all_xattrs (tmprootfs_dfd, fn, xattrs,
+                                         cancellable, error))
+        return FALSE;
+    }
 
-      if (!g_str_equal (group, "root"))
+  /* also reapply chmod since e.g. at least the setuid gets taken off */
+  if (S_ISREG (stbuf.st_mode))
+    {
+      if (fchmodat (tmprootfs_dfd, fn, stbuf.st_mode, 0) != 0)
         {
-          struct conv_group_ent *groupent =
-            g_hash_table_lookup (groupents, group);
+          glnx_set_prefix_error_from_errno (error, "fchmodat: %s", fn);
+          return FALSE;
+        }
+    }
 
-          if (!groupent)
-            {
-              g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                           "Could not find group '%s' in group file",
-                           group);
-              return FALSE;
-            }
+  return TRUE;
+}
 
-          gid = groupent->gid;
-        }
+static gboolean
+apply_rpmfi_overrides (RpmOstreeContext *self,
+                       int            tmprootfs_dfd,
+                       DnfPackage    *pkg,
+                       GHashTable    *passwdents,
+                       GHashTable    *groupents,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  gboolean emitted_nonusr_warning = FALSE;
 
-      if (fchownat (tmprootfs_dfd, fn, uid, gid, AT_SYMLINK_NOFOLLOW) != 0)
-        {
-          glnx_set_prefix_error_from_errno (error, "fchownat: %s", fn);
-          return FALSE;
-        }
+  /* Newer pkgcache commits list just the files we need to look at */
+  g_autoptr(GVariant) manifest = NULL;
+  {
+    RpmOstreePkgCacheIndex *index = get_pkgcache_index (self, cancellable, error);
+    if (!index)
+      return FALSE;
+    g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
+    GVariant *commit = rpmostree_pkgcache_index_load_commit (index, cachebranch, error);
+    if (!commit)
+      return FALSE;
+    g_autoptr(GVariant) commit_meta = g_variant_get_child_value (commit, 0);
+    g_autoptr(GVariantDict) commit_meta_dict = g_variant_dict_new (commit_meta);
+    manifest = g_variant_dict_lookup_value (commit_meta_dict, "rpmostree.rpmfi_overrides",
+                                            (GVariantType*)"a(ssssuu)");
+  }
 
-      /* the chown clears away file caps, so reapply it here */
-      if (fcaps[0] != '\0')
+  if (manifest)
+    {
+      GVariantIter iter;
+      const char *fn, *user, *group, *fcaps;
+      guint32 mode, fattrs;
+      g_variant_iter_init (&iter, manifest);
+      while (g_variant_iter_next (&iter, "(&s&s&s&suu)", &fn, &user, &group, &fcaps,
+                                  &mode, &fattrs))
         {
-          g_autoptr(GVariant) xattrs = rpmostree_fcap_to_xattr_variant (fcaps);
-          if (!glnx_dfd_name_set_all_xattrs (tmprootfs_dfd, fn, xattrs,
-                                             cancellable, error))
+          if (!apply_rpmfi_override_one (tmprootfs_dfd, pkg, fn, user, group, fcaps,
+                                         mode, fattrs, passwdents, groupents,
+                                         &emitted_nonusr_warning, cancellable, error))
             return FALSE;
         }
+      return TRUE;
+    }
 
-      /* also reapply chmod since e.g. at least the setuid gets taken off */
-      if (S_ISREG (stbuf.st_mode))
-        {
-          if (fchmodat (tmprootfs_dfd, fn, stbuf.st_mode, 0) != 0)
-            {
-              glnx_set_prefix_error_from_errno (error, "fchmodat: %s", fn);
-              return FALSE;
-            }
-        }
+  g_auto(rpmfi) fi = NULL;
+  g_autofree char *path = get_package_relpath (pkg);
+  if (!get_package_metainfo (self, path, NULL, &fi, error))
+    return FALSE;
+
+  while (rpmfiNext (fi) >= 0)
+    {
+      const char *user = rpmfiFUser (fi) ?: "root";
+      const char *group = rpmfiFGroup (fi) ?: "root";
+
+      if (g_str_equal (user, "root") &&
+          g_str_equal (group, "root"))
+        continue;
+
+      if (!apply_rpmfi_override_one (tmprootfs_dfd, pkg, rpmfiFN (fi), user, group,
+                                     rpmfiFCaps (fi) ?: "", rpmfiFMode (fi),
+                                     rpmfiFFlags (fi), passwdents, groupents,
+                                     &emitted_nonusr_warning, cancellable, error))
+        return FALSE;
     }
 
   return TRUE;
@@ -2655,19 +4045,20 @@ add_install (RpmOstreeContext *self,
              GCancellable     *cancellable,
              GError          **error)
 {
-  OstreeRepo *pkgcache_repo = get_pkgcache_repo (self);
   g_autofree char *cachebranch = rpmostree_get_cache_branch_pkg (pkg);
-  g_autofree char *cached_rev = NULL;
   gboolean sepolicy_matches;
 
-  if (!ostree_repo_resolve_rev (pkgcache_repo, cachebranch, FALSE,
-                                &cached_rev, error))
+  RpmOstreePkgCacheIndex *index = get_pkgcache_index (self, cancellable, error);
+  if (!index)
+    return FALSE;
+  GVariant *commit = rpmostree_pkgcache_index_load_commit (index, cachebranch, error);
+  if (!commit)
     return FALSE;
+  const char *cached_rev = rpmostree_pkgcache_index_lookup_branch (index, cachebranch);
 
   if (self->sepolicy)
     {
-      if (!commit_has_matching_sepolicy (pkgcache_repo, cached_rev,
-                                         self->sepolicy, &sepolicy_matches,
+      if (!commit_has_matching_sepolicy (commit, self->sepolicy, &sepolicy_matches,
                                          error))
         return FALSE;
 
@@ -2675,7 +4066,7 @@ add_install (RpmOstreeContext *self,
       g_assert (sepolicy_matches);
     }
 
-  if (!checkout_pkg_metadata_by_dnfpkg (self, pkg, cancellable, error))
+  if (!checkout_pkg_metadata_by_dnfpkg (self, pkg, commit, cancellable, error))
     return FALSE;
 
   if (!rpmts_add_install (self, ts, pkg, is_upgrade, noscripts,
@@ -2683,10 +4074,48 @@ add_install (RpmOstreeContext *self,
     return FALSE;
 
   g_hash_table_insert (pkg_to_ostree_commit, g_object_ref (pkg),
-                                             g_steal_pointer (&cached_rev));
+                                             g_strdup (cached_rev));
   return TRUE;
 }
 
+static int
+compare_script_stats_wall (gconstpointer ap,
+                           gconstpointer bp)
+{
+  const RpmOstreeScriptStats *a = *((const RpmOstreeScriptStats *const*) ap);
+  const RpmOstreeScriptStats *b = *((const RpmOstreeScriptStats *const*) bp);
+  if (a->wall_usec == b->wall_usec)
+    return 0;
+  return a->wall_usec < b->wall_usec ? 1 : -1;
+}
+
+/* Summarize where the time went, to help decide e.g. which packages
+ * would be better off in the base image; per-script details are in
+ * the journal.
+ */
+static void
+print_script_stats (GPtrArray *script_stats)
+{
+  guint64 total_usec = 0;
+  for (guint i = 0; i < script_stats->len; i++)
+    total_usec += ((RpmOstreeScriptStats*)script_stats->pdata[i])->wall_usec;
+
+  g_ptr_array_sort (script_stats, compare_script_stats_wall);
+  g_autoptr(GString) slowest = g_string_new ("");
+  for (guint i = 0; i < MIN (script_stats->len, 5); i++)
+    {
+      RpmOstreeScriptStats *stats = script_stats->pdata[i];
+      g_string_append_printf (slowest, "%s%s %s (%.1fs)", i > 0 ? ", " : "",
+                              stats->pkgname, stats->scriptdesc,
+                              stats->wall_usec / (double) G_USEC_PER_SEC);
+    }
+
+  const guint n = script_stats->len;
+  rpmostree_output_task_begin ("Ran %u script%s", n, _NS(n));
+  rpmostree_output_task_end ("%.1fs; slowest: %s",
+                             total_usec / (double) G_USEC_PER_SEC, slowest->str);
+}
+
 gboolean
 rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
                                       int                    tmprootfs_dfd,
@@ -2700,6 +4129,10 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
   g_autoptr(GHashTable) pkg_to_ostree_commit =
     g_hash_table_new_full (NULL, NULL, (GDestroyNotify)g_object_unref, (GDestroyNotify)g_free);
   DnfPackage *filesystem_package = NULL;   /* It's special... */
+  g_autoptr(GPtrArray) script_stats =
+    g_ptr_array_new_with_free_func ((GDestroyNotify)rpmostree_script_stats_free);
+
+  self->noscripts = noscripts;
 
   g_auto(rpmts) ordering_ts = rpmtsCreate ();
   rpmtsSetRootDir (ordering_ts, dnf_context_get_install_root (hifctx));
@@ -2787,6 +4220,20 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
   guint n_rpmts_elements = (guint)rpmtsNElements (ordering_ts);
   g_assert (n_rpmts_elements > 0);
 
+  {
+    g_autoptr(GPtrArray) pkg_commits = g_ptr_array_new ();
+    for (guint i = 0; i < n_rpmts_elements; i++)
+      {
+        rpmte te = rpmtsElement (ordering_ts, i);
+        if (rpmteType (te) != TR_ADDED)
+          continue;
+        DnfPackage *pkg = (void*)rpmteKey (te);
+        g_ptr_array_add (pkg_commits, g_hash_table_lookup (pkg_to_ostree_commit, pkg));
+      }
+    if (!import_cached_content (self, pkg_commits, cancellable, error))
+      return FALSE;
+  }
+
   /* Okay so what's going on in Fedora with incestuous relationship
    * between the `filesystem`, `setup`, `libgcc` RPMs is actively
    * ridiculous.  If we unpack libgcc first it writes to /lib64 which
@@ -2828,24 +4275,29 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
         return FALSE;
     }
 
-  for (guint i = 0; i < n_rpmts_elements; i++)
-    {
-      rpmte te = rpmtsElement (ordering_ts, i);
-      rpmElementType type = rpmteType (te);
+  {
+    g_autoptr(GPtrArray) pkgs = g_ptr_array_new ();
+    for (guint i = 0; i < n_rpmts_elements; i++)
+      {
+        rpmte te = rpmtsElement (ordering_ts, i);
+        rpmElementType type = rpmteType (te);
 
-      if (type == TR_REMOVED)
-        continue;
-      g_assert (type == TR_ADDED);
+        if (type == TR_REMOVED)
+          continue;
+        g_assert (type == TR_ADDED);
 
-      DnfPackage *pkg = (void*)rpmteKey (te);
-      if (pkg == filesystem_package)
-        continue;
+        DnfPackage *pkg = (void*)rpmteKey (te);
+        if (pkg == filesystem_package)
+          continue;
 
-      if (!checkout_package_into_root (self, pkg, tmprootfs_dfd, ".", devino_cache,
-                                       g_hash_table_lookup (pkg_to_ostree_commit, pkg),
-                                       cancellable, error))
-        return FALSE;
-    }
+        g_ptr_array_add (pkgs, pkg);
+      }
+
+    if (!checkout_packages_into_root (self, pkgs, pkg_to_ostree_commit,
+                                      tmprootfs_dfd, devino_cache,
+                                      cancellable, error))
+      return FALSE;
+  }
 
   rpmostree_output_task_end ("done");
 
@@ -2894,6 +4346,20 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
             return glnx_throw_errno_prefix (error, "symlinkat(usr/bin/systemctl)");
         }
 
+      /* Run all the scripts in a single container rather than setting one up
+       * per script; see rpmostree-scripts.c.
+       */
+      g_autoptr(RpmOstreeScriptSession) session = NULL;
+      /* Commands like ldconfig which many %posts run; see rpmostree-scripts.c */
+      g_autoptr(GPtrArray) deferred_triggers =
+        g_ptr_array_new_with_free_func ((GDestroyNotify)rpmostree_deferred_trigger_free);
+      if (use_script_session (tmprootfs_dfd))
+        {
+          session = rpmostree_script_session_new (tmprootfs_dfd, error);
+          if (!session)
+            return FALSE;
+        }
+
       /* We're technically deviating from RPM here by running all the %pre's
        * beforehand, rather than each package's %pre & %post in order. Though I
        * highly doubt this should cause any issues. The advantage of doing it
@@ -2909,7 +4375,8 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
           DnfPackage *pkg = (void*)rpmteKey (te);
           g_assert (pkg);
 
-          if (!run_pre_sync (self, tmprootfs_dfd, pkg, cancellable, error))
+          if (!run_pre_sync (self, tmprootfs_dfd, session, script_stats, pkg,
+                             cancellable, error))
             return FALSE;
         }
 
@@ -2962,8 +4429,21 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
             return glnx_prefix_error (error, "While applying overrides for pkg %s: ",
                                       dnf_package_get_name (pkg));
 
-          if (!run_posttrans_sync (self, tmprootfs_dfd, pkg, cancellable, error))
+          if (!run_posttrans_sync (self, tmprootfs_dfd, session, script_stats,
+                                   deferred_triggers, pkg, cancellable, error))
+            return FALSE;
+        }
+
+      if (!rpmostree_script_run_deferred_triggers (deferred_triggers, tmprootfs_dfd,
+                                                   session, script_stats,
+                                                   cancellable, error))
+        return FALSE;
+
+      if (session)
+        {
+          if (!rpmostree_script_session_finish (session, error))
             return FALSE;
+          g_clear_pointer (&session, rpmostree_script_session_free);
         }
 
       if (have_systemctl)
@@ -3060,6 +4540,88 @@ rpmostree_context_assemble_tmprootfs (RpmOstreeContext      *self,
 
   rpmostree_output_task_end ("done");
 
+  if (script_stats->len > 0)
+    print_script_stats (script_stats);
+
+  /* We're done with the headers */
+  if (self->metainfo_cache)
+    {
+      g_autofree char *size = g_format_size (self->metainfo_cache_bytes);
+      g_debug ("Cached %u package headers (%s)",
+               g_hash_table_size (self->metainfo_cache), size);
+      g_clear_pointer (&self->metainfo_cache, g_hash_table_unref);
+      self->metainfo_cache_bytes = 0;
+    }
+
+  return TRUE;
+}
+
+typedef struct {
+  GHashTable *checkout_files;
+  int rootfs_dfd;
+  int repo_dfd;
+  GHashTable *hits; /* path -> checksum */
+} CheckoutFilesFilterData;
+
+/* Stand-in for the devino cache for packages checked out in parallel: if a
+ * file is still a hardlink to the object we checked out there, we already
+ * know its checksum.
+ */
+static OstreeRepoCommitFilterResult
+checkout_files_filter_cb (OstreeRepo         *repo,
+                          const char         *path,
+                          GFileInfo          *file_info,
+                          gpointer            user_data)
+{
+  CheckoutFilesFilterData *data = user_data;
+
+  if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_REGULAR)
+    return OSTREE_REPO_COMMIT_FILTER_ALLOW;
+
+  if (path[0] == '/')
+    path++;
+  const char *checksum = g_hash_table_lookup (data->checkout_files, path);
+  if (!checksum)
+    return OSTREE_REPO_COMMIT_FILTER_ALLOW;
+
+  struct stat stbuf;
+  struct stat objbuf;
+  g_autofree char *objpath =
+    g_strdup_printf ("objects/%.2s/%s.file", checksum, checksum + 2);
+  if (fstatat (data->rootfs_dfd, path, &stbuf, AT_SYMLINK_NOFOLLOW) < 0 ||
+      fstatat (data->repo_dfd, objpath, &objbuf, AT_SYMLINK_NOFOLLOW) < 0)
+    return OSTREE_REPO_COMMIT_FILTER_ALLOW;
+  if (stbuf.st_dev != objbuf.st_dev || stbuf.st_ino != objbuf.st_ino)
+    return OSTREE_REPO_COMMIT_FILTER_ALLOW;
+
+  g_hash_table_insert (data->hits, g_strdup (path), g_strdup (checksum));
+  return OSTREE_REPO_COMMIT_FILTER_SKIP;
+}
+
+/* Add back the files skipped by checkout_files_filter_cb() */
+static gboolean
+add_checkout_files_to_mtree (OstreeMutableTree *mtree,
+                             GHashTable        *hits,
+                             GError           **error)
+{
+  GLNX_HASH_TABLE_FOREACH_KV (hits, const char*, path, const char*, checksum)
+    {
+      g_auto(GStrv) components = g_strsplit (path, "/", -1);
+      const guint n_components = g_strv_length (components);
+      g_autoptr(OstreeMutableTree) dir = g_object_ref (mtree);
+      for (guint i = 0; i < n_components - 1; i++)
+        {
+          g_autoptr(OstreeMutableTree) subdir = NULL;
+          if (!ostree_mutable_tree_ensure_dir (dir, components[i], &subdir, error))
+            return FALSE;
+          g_clear_object (&dir);
+          dir = g_steal_pointer (&subdir);
+        }
+      if (!ostree_mutable_tree_replace_file (dir, components[n_components-1],
+                                             checksum, error))
+        return FALSE;
+    }
+
   return TRUE;
 }
 
@@ -3110,11 +4672,18 @@ rpmostree_context_commit_tmprootfs (RpmOstreeContext      *self,
                                g_variant_new_boolean (TRUE));
 
         /* embed packages (really, "patterns") layered */
-        g_autoptr(GVariant) pkgs =
-          g_variant_dict_lookup_value (self->spec->dict, "packages", G_VARIANT_TYPE ("as"));
+        g_autoptr(GVariant) pkgs = NULL;
+        if (self->layered_packages)
+          pkgs = g_variant_ref_sink (g_variant_new_strv ((const char *const*)self->layered_packages, -1));
+        else
+          pkgs = g_variant_dict_lookup_value (self->spec->dict, "packages", G_VARIANT_TYPE ("as"));
         g_assert (pkgs);
         g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.packages", pkgs);
 
+        if (self->previous_layer)
+          g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.previous-layer",
+                                 g_variant_new_string (self->previous_layer));
+
         /* embed packages removed */
         /* we have to embed both the pkgname and the full nevra to make it easier to match
          * them up with origin directives. the full nevra is used for status -v */
@@ -3141,6 +4710,15 @@ rpmostree_context_commit_tmprootfs (RpmOstreeContext      *self,
         g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.replaced-base-packages",
                                g_variant_builder_end (&replaced_base_pkgs));
 
+        /* The state checksum doesn't cover these, but they matter when
+         * looking for a previous commit of the same state to reuse.
+         */
+        g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.noscripts",
+                               g_variant_new_boolean (self->noscripts));
+        if (self->initramfs_state)
+          g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.initramfs",
+                                 self->initramfs_state);
+
         /* be nice to our future selves */
         g_variant_builder_add (&metadata_builder, "{sv}",
                                "rpmostree.clientlayer_version",
@@ -3168,9 +4746,15 @@ rpmostree_context_commit_tmprootfs (RpmOstreeContext      *self,
                            "rpmostree.state-sha512",
                            g_variant_new_string (state_checksum));
 
+    g_autoptr(GHashTable) checkout_hits =
+      g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    CheckoutFilesFilterData filter_data = { self->checkout_files, tmprootfs_dfd,
+                                            ostree_repo_get_dfd (get_pkgcache_repo (self)),
+                                            checkout_hits };
     commit_modifier =
       ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_NONE,
-                                       NULL, NULL, NULL);
+                                       self->checkout_files ? checkout_files_filter_cb : NULL,
+                                       &filter_data, NULL);
 
     ostree_repo_commit_modifier_set_devino_cache (commit_modifier, devino_cache);
 
@@ -3181,6 +4765,9 @@ rpmostree_context_commit_tmprootfs (RpmOstreeContext      *self,
                                          cancellable, error))
       return FALSE;
 
+    if (!add_checkout_files_to_mtree (mtree, checkout_hits, error))
+      return FALSE;
+
     if (!ostree_repo_write_mtree (self->ostreerepo, mtree, &root, cancellable, error))
       return FALSE;
 
@@ -25,6 +25,7 @@
 #include <ostree.h>
 
 #include "libglnx.h"
+#include "rpmostree-util.h"
 
 #define RPMOSTREE_CORE_CACHEDIR "/var/cache/rpm-ostree/"
 
@@ -72,6 +73,11 @@ void rpmostree_context_set_sepolicy (RpmOstreeContext *self,
                                      OstreeSePolicy   *sepolicy);
 void rpmostree_context_set_passwd_dir (RpmOstreeContext *self,
                                        const char *passwd_dir);
+void rpmostree_context_set_previous_layer (RpmOstreeContext  *self,
+                                           const char        *commit,
+                                           const char *const *layered_packages);
+void rpmostree_context_set_initramfs_state (RpmOstreeContext *self,
+                                            GVariant         *state);
 
 void rpmostree_dnf_add_checksum_goal (GChecksum *checksum, HyGoal goal);
 char *rpmostree_context_get_state_sha512 (RpmOstreeContext *self);
@@ -79,6 +85,39 @@ char *rpmostree_context_get_state_sha512 (RpmOstreeContext *self);
 char *rpmostree_get_cache_branch_header (Header hdr);
 char *rpmostree_get_cache_branch_pkg (DnfPackage *pkg);
 
+typedef struct RpmOstreePkgCacheIndex RpmOstreePkgCacheIndex;
+
+RpmOstreePkgCacheIndex *
+rpmostree_pkgcache_index_new (OstreeRepo    *pkgcache,
+                              GCancellable  *cancellable,
+                              GError       **error);
+
+void
+rpmostree_pkgcache_index_free (RpmOstreePkgCacheIndex *index);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RpmOstreePkgCacheIndex, rpmostree_pkgcache_index_free)
+
+OstreeRepo *
+rpmostree_pkgcache_index_get_repo (RpmOstreePkgCacheIndex *index);
+
+void
+rpmostree_pkgcache_index_update (RpmOstreePkgCacheIndex *index,
+                                 const char             *cachebranch,
+                                 const char             *commit);
+
+const char *
+rpmostree_pkgcache_index_lookup_nevra (RpmOstreePkgCacheIndex *index,
+                                       const char             *nevra);
+
+const char *
+rpmostree_pkgcache_index_lookup_branch (RpmOstreePkgCacheIndex *index,
+                                        const char             *cachebranch);
+
+GVariant *
+rpmostree_pkgcache_index_load_commit (RpmOstreePkgCacheIndex *index,
+                                      const char             *cachebranch,
+                                      GError                **error);
+
 gboolean
 rpmostree_find_cache_branch_by_nevra (OstreeRepo    *pkgcache,
                                       const char    *nevra,
@@ -87,7 +126,7 @@ rpmostree_find_cache_branch_by_nevra (OstreeRepo    *pkgcache,
                                       GError       **error);
 
 gboolean
-rpmostree_pkgcache_find_pkg_header (OstreeRepo    *pkgcache,
+rpmostree_pkgcache_find_pkg_header (RpmOstreePkgCacheIndex *index,
                                     const char    *nevra,
                                     const char    *expected_sha256,
                                     GVariant     **out_header,
@@ -95,7 +134,7 @@ rpmostree_pkgcache_find_pkg_header (OstreeRepo    *pkgcache,
                                     GError       **error);
 
 gboolean
-rpmostree_get_nevra_from_pkgcache (OstreeRepo   *repo,
+rpmostree_get_nevra_from_pkgcache (RpmOstreePkgCacheIndex *index,
                                    const char   *nevra,
                                    char        **out_name,
                                    guint64      *out_epoch,
@@ -118,10 +157,20 @@ gboolean rpmostree_context_download (RpmOstreeContext *self,
                                      GCancellable     *cancellable,
                                      GError           **error);
 
+void rpmostree_context_set_import_jobs (RpmOstreeContext *self,
+                                        guint             n_jobs);
+
+void rpmostree_context_set_merged_checkout (RpmOstreeContext *self,
+                                            gboolean          merged_checkout);
+
 gboolean rpmostree_context_import (RpmOstreeContext *self,
                                    GCancellable     *cancellable,
                                    GError          **error);
 
+gboolean rpmostree_context_download_and_import (RpmOstreeContext *self,
+                                                GCancellable     *cancellable,
+                                                GError          **error);
+
 gboolean rpmostree_context_relabel (RpmOstreeContext *self,
                                     GCancellable     *cancellable,
                                     GError          **error);
@@ -157,3 +206,10 @@ gboolean rpmostree_context_assemble_commit (RpmOstreeContext      *self,
                                             char                 **out_commit,
                                             GCancellable          *cancellable,
                                             GError               **error);
+
+gboolean rpmostree_delete_package_path (int               rootfs_dfd,
+                                        RpmOstreePathSet *deleted_dirs,
+                                        const char       *fn,
+                                        guint             mode,
+                                        GCancellable     *cancellable,
+                                        GError          **error);
@@ -266,6 +266,26 @@ rpmostree_finalize_kernel (int rootfs_dfd,
   return TRUE;
 }
 
+/* Whether @argv already picks an initramfs compressor */
+static gboolean
+dracut_argv_has_compression (const char *const *argv)
+{
+  static const char *const compress_opts[] = {
+    "--gzip", "--bzip2", "--lzma", "--xz", "--lzo", "--lz4", "--zstd", "--no-compress",
+  };
+  for (const char *const *iter = argv; iter && *iter; iter++)
+    {
+      if (g_str_has_prefix (*iter, "--compress"))
+        return TRUE;
+      for (guint i = 0; i < G_N_ELEMENTS (compress_opts); i++)
+        {
+          if (strcmp (*iter, compress_opts[i]) == 0)
+            return TRUE;
+        }
+    }
+  return FALSE;
+}
+
 static void
 dracut_child_setup (gpointer data)
 {
@@ -286,39 +306,46 @@ rpmostree_run_dracut (int     rootfs_dfd,
                       GError **error)
 {
   gboolean ret = FALSE;
-  /* Shell wrapper around dracut to write to the O_TMPFILE fd;
-   * at some point in the future we should add --fd X instead of -f
-   * to dracut.
+  /* Shell wrapper around dracut to write to the O_TMPFILE fd; dracut copies
+   * its image to the output path, so we point that at the fd directly rather
+   * than going through another temporary file.  At some point in the future
+   * we should add --fd X instead of -f to dracut.
    */
   static const char rpmostree_dracut_wrapper_path[] = "usr/bin/rpmostree-dracut-wrapper";
   /* This also hardcodes a few arguments */
   static const char rpmostree_dracut_wrapper[] =
     "#!/usr/bin/bash\n"
     "set -euo pipefail\n"
-    "extra_argv=; if (dracut --help; true) | grep -q -e --reproducible; then extra_argv=\"--reproducible --gzip\"; fi\n"
-    "dracut $extra_argv -v --add ostree --tmpdir=/tmp -f /tmp/initramfs.img \"$@\"\n"
-    "cat /tmp/initramfs.img >/proc/self/fd/3\n";
+    "extra_argv=; if (dracut --help; true) | grep -q -e --reproducible; then extra_argv=\"--reproducible\"; fi\n"
+    "exec dracut $extra_argv -v --add ostree --tmpdir=/tmp -f /proc/self/fd/3 \"$@\"\n";
   g_autoptr(RpmOstreeBwrap) bwrap = NULL;
-  g_autoptr(GPtrArray) rebuild_argv = NULL;
+  g_autoptr(GPtrArray) full_argv = g_ptr_array_new ();
   g_auto(GLnxTmpfile) tmpf = { 0, };
 
   g_assert (argv != NULL || rebuild_from_initramfs != NULL);
 
+  /* Default to gzip, which dracut runs multithreaded via pigz if it's in the
+   * tree; the compressor can be overridden via the treefile or origin
+   * initramfs-args, e.g. --zstd or --xz (both of which dracut also runs with
+   * -T0).
+   */
+  if (!dracut_argv_has_compression (argv))
+    g_ptr_array_add (full_argv, "--gzip");
+
   if (rebuild_from_initramfs)
     {
-      rebuild_argv = g_ptr_array_new ();
-      g_ptr_array_add (rebuild_argv, "--rebuild");
-      g_ptr_array_add (rebuild_argv, (char*)rebuild_from_initramfs);
-
-      /* In this case, any args specified in argv are *additional*
-       * to the rebuild from the base.
-       */
-      for (char **iter = (char**)argv; iter && *iter; iter++)
-        g_ptr_array_add (rebuild_argv, *iter);
-      g_ptr_array_add (rebuild_argv, NULL);
-      argv = (const char *const*)rebuild_argv->pdata;
+      g_ptr_array_add (full_argv, "--rebuild");
+      g_ptr_array_add (full_argv, (char*)rebuild_from_initramfs);
     }
 
+  /* In the rebuild case, any args specified in argv are *additional* to the
+   * rebuild from the base.
+   */
+  for (char **iter = (char**)argv; iter && *iter; iter++)
+    g_ptr_array_add (full_argv, *iter);
+  g_ptr_array_add (full_argv, NULL);
+  argv = (const char *const*)full_argv->pdata;
+
   /* First tempfile is just our shell script */
   if (!glnx_open_tmpfile_linkable_at (rootfs_dfd, "usr/bin",
                                       O_RDWR | O_CLOEXEC,
@@ -379,3 +406,475 @@ rpmostree_run_dracut (int     rootfs_dfd,
   (void) unlinkat (rootfs_dfd, rpmostree_dracut_wrapper_path, 0);
   return ret;
 }
+
+/* Host configuration which commonly ends up in (or affects) an initramfs
+ * rebuilt with /etc bound in; see rpmostree_run_dracut().  This can't be
+ * exhaustive, since dracut modules may read anything; it's what we consider
+ * when deciding whether a cached initramfs is still valid, which is why the
+ * cache is opt-in via RPMOSTREE_INITRAMFS_CACHE=1.
+ */
+static const char *const initramfs_etc_inputs[] = {
+  "dracut.conf", "dracut.conf.d",
+  "crypttab", "fstab",
+  "vconsole.conf", "locale.conf",
+  "modprobe.d", "modules-load.d",
+  "lvm/lvm.conf", "mdadm.conf", "multipath.conf", "multipath",
+  "udev/rules.d",
+};
+
+static gboolean
+checksum_path_recurse (GChecksum    *checksum,
+                       int           dfd,
+                       const char   *path,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  /* Include the name (and NUL) so that moving content around changes the hash */
+  g_checksum_update (checksum, (guint8*)path, strlen (path) + 1);
+
+  struct stat stbuf;
+  if (fstatat (dfd, path, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+    {
+      if (errno != ENOENT)
+        return glnx_throw_errno_prefix (error, "fstatat(%s)", path);
+      g_checksum_update (checksum, (guint8*)"-", 1);
+      return TRUE;
+    }
+
+  if (S_ISREG (stbuf.st_mode))
+    {
+      if (!_rpmostree_util_update_checksum_from_file (checksum, dfd, path,
+                                                      cancellable, error))
+        return glnx_prefix_error (error, "Reading %s", path);
+    }
+  else if (S_ISLNK (stbuf.st_mode))
+    {
+      g_autofree char *target = glnx_readlinkat_malloc (dfd, path, cancellable, error);
+      if (!target)
+        return FALSE;
+      g_checksum_update (checksum, (guint8*)target, strlen (target));
+    }
+  else if (S_ISDIR (stbuf.st_mode))
+    {
+      g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+      if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &dfd_iter, error))
+        return FALSE;
+
+      g_autoptr(GPtrArray) children = g_ptr_array_new_with_free_func (g_free);
+      while (TRUE)
+        {
+          struct dirent *dent = NULL;
+          if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+            return FALSE;
+          if (!dent)
+            break;
+          g_ptr_array_add (children, g_strconcat (path, "/", dent->d_name, NULL));
+        }
+
+      /* Directory order isn't stable */
+      g_ptr_array_sort (children, rpmostree_ptrarray_sort_compare_strings);
+      for (guint i = 0; i < children->len; i++)
+        {
+          if (!checksum_path_recurse (checksum, dfd, children->pdata[i],
+                                      cancellable, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Compute a key for the initramfs which rpmostree_run_dracut() would generate
+ * when rebuilding from @base_initramfs_path in @rootfs_dfd with @argv, given
+ * the current host /etc.  The base initramfs covers the kernel, modules and
+ * dracut of the base tree (we build it with --reproducible); @extra_state
+ * should describe anything else in the rootfs that may differ, e.g. layered
+ * packages.  Also included are any files in /etc named on the command line,
+ * as with `rpm-ostree initramfs --arg=-I --arg=/etc/foo`.
+ */
+char *
+rpmostree_initramfs_cache_key (int                 rootfs_dfd,
+                               const char         *kver,
+                               const char         *base_initramfs_path,
+                               const char *const  *argv,
+                               const char         *extra_state,
+                               GCancellable       *cancellable,
+                               GError            **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  g_checksum_update (checksum, (guint8*)kver, strlen (kver) + 1);
+  if (!_rpmostree_util_update_checksum_from_file (checksum, rootfs_dfd, base_initramfs_path,
+                                                  cancellable, error))
+    return glnx_prefix_error_null (error, "Reading %s", base_initramfs_path);
+
+  for (const char *const *iter = argv; iter && *iter; iter++)
+    g_checksum_update (checksum, (guint8*)*iter, strlen (*iter) + 1);
+  /* Separate args from state */
+  g_checksum_update (checksum, (guint8*)"", 1);
+  if (extra_state)
+    g_checksum_update (checksum, (guint8*)extra_state, strlen (extra_state) + 1);
+
+  glnx_fd_close int etc_dfd = -1;
+  if (!glnx_opendirat (AT_FDCWD, "/etc", TRUE, &etc_dfd, error))
+    return NULL;
+  for (guint i = 0; i < G_N_ELEMENTS (initramfs_etc_inputs); i++)
+    {
+      if (!checksum_path_recurse (checksum, etc_dfd, initramfs_etc_inputs[i],
+                                  cancellable, error))
+        return NULL;
+    }
+  for (const char *const *iter = argv; iter && *iter; iter++)
+    {
+      if (!g_str_has_prefix (*iter, "/etc/"))
+        continue;
+      if (!checksum_path_recurse (checksum, etc_dfd, *iter + strlen ("/etc/"),
+                                  cancellable, error))
+        return NULL;
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+#define RPMOSTREE_INITRAMFS_CACHE_REF_PREFIX "rpmostree/initramfs"
+
+/* If we previously stored an initramfs under @key, copy it into a new tmpfile
+ * in @rootfs_dfd, ready for rpmostree_finalize_kernel().  Sets @out_found to
+ * %FALSE if there's no such entry.
+ */
+gboolean
+rpmostree_initramfs_cache_lookup (OstreeRepo   *repo,
+                                  const char   *key,
+                                  int           rootfs_dfd,
+                                  gboolean     *out_found,
+                                  GLnxTmpfile  *out_initramfs_tmpf,
+                                  GCancellable *cancellable,
+                                  GError      **error)
+{
+  *out_found = FALSE;
+
+  g_autofree char *ref = g_strconcat (RPMOSTREE_INITRAMFS_CACHE_REF_PREFIX "/", key, NULL);
+  g_autofree char *rev = NULL;
+  if (!ostree_repo_resolve_rev (repo, ref, TRUE, &rev, error))
+    return FALSE;
+  if (!rev)
+    return TRUE;
+
+  g_autoptr(GFile) root = NULL;
+  if (!ostree_repo_read_commit (repo, rev, &root, NULL, cancellable, error))
+    return FALSE;
+  g_autoptr(GFile) img = g_file_get_child (root, "initramfs.img");
+  g_autoptr(GInputStream) in = (GInputStream*)g_file_read (img, cancellable, error);
+  if (!in)
+    return FALSE;
+
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  if (!glnx_open_tmpfile_linkable_at (rootfs_dfd, ".", O_RDWR | O_CLOEXEC,
+                                      &tmpf, error))
+    return FALSE;
+  g_autoptr(GOutputStream) out = g_unix_output_stream_new (tmpf.fd, FALSE);
+  if (g_output_stream_splice (out, in, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
+                              cancellable, error) < 0)
+    return FALSE;
+
+  *out_found = TRUE;
+  *out_initramfs_tmpf = tmpf; tmpf.initialized = FALSE; /* Transfer */
+  return TRUE;
+}
+
+static gboolean
+write_initramfs_commit (OstreeRepo   *repo,
+                        int           initramfs_fd,
+                        char        **out_commit,
+                        GCancellable *cancellable,
+                        GError      **error)
+{
+  struct stat stbuf;
+  if (fstat (initramfs_fd, &stbuf) < 0)
+    return glnx_throw_errno_prefix (error, "fstat");
+  /* dracut wrote through a dup of the fd, so rewind */
+  if (lseek (initramfs_fd, 0, SEEK_SET) < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+
+  g_autoptr(GFileInfo) finfo = g_file_info_new ();
+  g_file_info_set_file_type (finfo, G_FILE_TYPE_REGULAR);
+  g_file_info_set_size (finfo, stbuf.st_size);
+  g_file_info_set_attribute_uint32 (finfo, "unix::uid", 0);
+  g_file_info_set_attribute_uint32 (finfo, "unix::gid", 0);
+  g_file_info_set_attribute_uint32 (finfo, "unix::mode", S_IFREG | 0644);
+
+  g_autoptr(GInputStream) file_in = g_unix_input_stream_new (initramfs_fd, FALSE);
+  g_autoptr(GInputStream) content_in = NULL;
+  guint64 content_len;
+  if (!ostree_raw_file_to_content_stream (file_in, finfo, NULL, &content_in,
+                                          &content_len, cancellable, error))
+    return FALSE;
+  g_autofree guchar *csum_raw = NULL;
+  if (!ostree_repo_write_content (repo, NULL, content_in, content_len, &csum_raw,
+                                  cancellable, error))
+    return FALSE;
+
+  g_autoptr(GFileInfo) dir_info = g_file_info_new ();
+  g_file_info_set_file_type (dir_info, G_FILE_TYPE_DIRECTORY);
+  g_file_info_set_attribute_uint32 (dir_info, "unix::uid", 0);
+  g_file_info_set_attribute_uint32 (dir_info, "unix::gid", 0);
+  g_file_info_set_attribute_uint32 (dir_info, "unix::mode", S_IFDIR | 0755);
+  g_autoptr(GVariant) dirmeta = ostree_create_directory_metadata (dir_info, NULL);
+  g_autofree guchar *dirmeta_csum_raw = NULL;
+  if (!ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL, dirmeta,
+                                   &dirmeta_csum_raw, cancellable, error))
+    return FALSE;
+
+  g_autofree char *csum = ostree_checksum_from_bytes (csum_raw);
+  g_autofree char *dirmeta_csum = ostree_checksum_from_bytes (dirmeta_csum_raw);
+  glnx_unref_object OstreeMutableTree *mtree = ostree_mutable_tree_new ();
+  ostree_mutable_tree_set_metadata_checksum (mtree, dirmeta_csum);
+  if (!ostree_mutable_tree_replace_file (mtree, "initramfs.img", csum, error))
+    return FALSE;
+
+  g_autoptr(GFile) root = NULL;
+  if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
+    return FALSE;
+  return ostree_repo_write_commit (repo, NULL, "", "", NULL, OSTREE_REPO_FILE (root),
+                                   out_commit, cancellable, error);
+}
+
+/* Store the initramfs in @initramfs_fd under @key, replacing any previous
+ * entries; the cache only exists to skip regeneration on the next deployment,
+ * and the objects of older entries get pruned along with the repo.
+ */
+gboolean
+rpmostree_initramfs_cache_store (OstreeRepo   *repo,
+                                 const char   *key,
+                                 int           initramfs_fd,
+                                 GCancellable *cancellable,
+                                 GError      **error)
+{
+  g_autoptr(GHashTable) refs = NULL;
+  if (!ostree_repo_list_refs_ext (repo, RPMOSTREE_INITRAMFS_CACHE_REF_PREFIX, &refs,
+                                  OSTREE_REPO_LIST_REFS_EXT_NONE,
+                                  cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
+    return FALSE;
+
+  g_autofree char *commit = NULL;
+  if (!write_initramfs_commit (repo, initramfs_fd, &commit, cancellable, error))
+    {
+      (void) ostree_repo_abort_transaction (repo, cancellable, NULL);
+      return FALSE;
+    }
+
+  GLNX_HASH_TABLE_FOREACH (refs, const char*, ref)
+    ostree_repo_transaction_set_refspec (repo, ref, NULL);
+  g_autofree char *ref = g_strconcat (RPMOSTREE_INITRAMFS_CACHE_REF_PREFIX "/", key, NULL);
+  ostree_repo_transaction_set_ref (repo, NULL, ref, commit);
+
+  if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
+    {
+      (void) ostree_repo_abort_transaction (repo, cancellable, NULL);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Minimal writer for the "newc" cpio format, which is what the kernel's
+ * initramfs unpacker understands.
+ */
+typedef struct {
+  GOutputStream *out;
+  guint64 offset;
+  guint32 next_ino;
+  GHashTable *seen_paths;
+} CpioWriter;
+
+static gboolean
+cpio_write (CpioWriter   *cpio,
+            const void   *buf,
+            gsize         len,
+            GCancellable *cancellable,
+            GError      **error)
+{
+  if (!g_output_stream_write_all (cpio->out, buf, len, NULL, cancellable, error))
+    return FALSE;
+  cpio->offset += len;
+  return TRUE;
+}
+
+static gboolean
+cpio_pad (CpioWriter   *cpio,
+          GCancellable *cancellable,
+          GError      **error)
+{
+  static const char zeroes[4] = { 0, };
+  gsize padlen = (4 - (cpio->offset % 4)) % 4;
+  return cpio_write (cpio, zeroes, padlen, cancellable, error);
+}
+
+static gboolean
+cpio_write_header (CpioWriter   *cpio,
+                   const char   *name,
+                   guint32       mode,
+                   guint32       uid,
+                   guint32       gid,
+                   guint32       nlink,
+                   guint32       size,
+                   GCancellable *cancellable,
+                   GError      **error)
+{
+  /* Use a zero mtime so the overlay only changes if the content does */
+  g_autofree char *hdr =
+    g_strdup_printf ("070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+                     cpio->next_ino++, mode, uid, gid, nlink, 0, size,
+                     0, 0, 0, 0, (guint32)strlen (name) + 1, 0);
+  if (!cpio_write (cpio, hdr, strlen (hdr), cancellable, error))
+    return FALSE;
+  if (!cpio_write (cpio, name, strlen (name) + 1, cancellable, error))
+    return FALSE;
+  return cpio_pad (cpio, cancellable, error);
+}
+
+static gboolean
+cpio_write_path (CpioWriter   *cpio,
+                 const char   *path,
+                 GCancellable *cancellable,
+                 GError      **error)
+{
+  /* Archive names are relative; also skip anything we've done already */
+  const char *name = path + strspn (path, "/");
+  if (g_hash_table_contains (cpio->seen_paths, name))
+    return TRUE;
+
+  /* The unpacker doesn't create leading directories */
+  { g_autofree char *parent = g_path_get_dirname (path);
+    if (strcmp (parent, "/") != 0 &&
+        !cpio_write_path (cpio, parent, cancellable, error))
+      return FALSE;
+  }
+
+  struct stat stbuf;
+  if (fstatat (AT_FDCWD, path, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+    return glnx_throw_errno_prefix (error, "fstatat(%s)", path);
+
+  g_hash_table_add (cpio->seen_paths, g_strdup (name));
+
+  if (S_ISREG (stbuf.st_mode))
+    {
+      glnx_fd_close int fd = openat (AT_FDCWD, path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+      if (fd < 0)
+        return glnx_throw_errno_prefix (error, "openat(%s)", path);
+      if (!cpio_write_header (cpio, name, stbuf.st_mode, stbuf.st_uid, stbuf.st_gid,
+                              1, stbuf.st_size, cancellable, error))
+        return FALSE;
+      g_autoptr(GInputStream) in = g_unix_input_stream_new (fd, FALSE);
+      gssize n = g_output_stream_splice (cpio->out, in, 0, cancellable, error);
+      if (n < 0)
+        return FALSE;
+      if (n != stbuf.st_size)
+        return glnx_throw (error, "%s changed size while reading", path);
+      cpio->offset += n;
+      return cpio_pad (cpio, cancellable, error);
+    }
+  else if (S_ISLNK (stbuf.st_mode))
+    {
+      g_autofree char *target = glnx_readlinkat_malloc (AT_FDCWD, path, cancellable, error);
+      if (!target)
+        return FALSE;
+      if (!cpio_write_header (cpio, name, stbuf.st_mode, stbuf.st_uid, stbuf.st_gid,
+                              1, strlen (target), cancellable, error))
+        return FALSE;
+      if (!cpio_write (cpio, target, strlen (target), cancellable, error))
+        return FALSE;
+      return cpio_pad (cpio, cancellable, error);
+    }
+  else if (S_ISDIR (stbuf.st_mode))
+    {
+      return cpio_write_header (cpio, name, stbuf.st_mode, stbuf.st_uid, stbuf.st_gid,
+                                2, 0, cancellable, error);
+    }
+  else
+    return glnx_throw (error, "Unsupported file type for initramfs overlay: %s", path);
+}
+
+/* Whether @path names something below /etc, without any empty, "." or ".."
+ * components which could take it elsewhere.
+ */
+gboolean
+rpmostree_initramfs_etc_path_is_valid (const char *path)
+{
+  if (!g_str_has_prefix (path, "/etc/"))
+    return FALSE;
+
+  g_auto(GStrv) components = g_strsplit (path + strlen ("/etc/"), "/", -1);
+  for (char **iter = components; *iter; iter++)
+    {
+      const char *component = *iter;
+      if (!*component || g_str_equal (component, ".") || g_str_equal (component, ".."))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+/* Rather than regenerating the initramfs via dracut just to pick up host
+ * configuration, take the base initramfs at @base_initramfs_path as is and
+ * append a gzip compressed cpio archive containing the given host @etc_files
+ * (absolute paths in /etc); the kernel unpacks concatenated archives in order,
+ * so these override the base.  Directories are included non-recursively.  Like
+ * rpmostree_run_dracut(), the base initramfs is removed, and the result is a
+ * tmpfile ready for rpmostree_finalize_kernel().
+ */
+gboolean
+rpmostree_initramfs_overlay_etc (int                rootfs_dfd,
+                                 const char        *base_initramfs_path,
+                                 const char *const *etc_files,
+                                 GLnxTmpfile       *out_initramfs_tmpf,
+                                 GCancellable      *cancellable,
+                                 GError           **error)
+{
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  if (!glnx_open_tmpfile_linkable_at (rootfs_dfd, ".", O_RDWR | O_CLOEXEC,
+                                      &tmpf, error))
+    return FALSE;
+
+  /* First, a copy of the base */
+  glnx_fd_close int base_fd = openat (rootfs_dfd, base_initramfs_path, O_RDONLY | O_CLOEXEC);
+  if (base_fd < 0)
+    return glnx_throw_errno_prefix (error, "openat(%s)", base_initramfs_path);
+  g_autoptr(GOutputStream) out = g_unix_output_stream_new (tmpf.fd, FALSE);
+  { g_autoptr(GInputStream) in = g_unix_input_stream_new (base_fd, FALSE);
+    /* No padding after it; the kernel doesn't need the next archive to be
+     * aligned, and it would break tools reading the concatenated streams */
+    if (g_output_stream_splice (out, in, 0, cancellable, error) < 0)
+      return FALSE;
+  }
+
+  /* Then the overlay */
+  g_autoptr(GZlibCompressor) compressor =
+    g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+  g_autoptr(GOutputStream) zout =
+    g_converter_output_stream_new (out, G_CONVERTER (compressor));
+  g_autoptr(GHashTable) seen_paths =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  CpioWriter cpio = { zout, 0, 1, seen_paths };
+
+  for (const char *const *iter = etc_files; iter && *iter; iter++)
+    {
+      const char *path = *iter;
+      if (!rpmostree_initramfs_etc_path_is_valid (path))
+        return glnx_throw (error, "Invalid initramfs overlay path: %s", path);
+      if (!cpio_write_path (&cpio, path, cancellable, error))
+        return glnx_prefix_error (error, "Adding %s to initramfs overlay", path);
+    }
+
+  if (!cpio_write_header (&cpio, "TRAILER!!!", 0, 0, 0, 1, 0, cancellable, error))
+    return FALSE;
+  if (!g_output_stream_close (zout, cancellable, error))
+    return FALSE;
+
+  (void) unlinkat (rootfs_dfd, base_initramfs_path, 0);
+
+  *out_initramfs_tmpf = tmpf; tmpf.initialized = FALSE; /* Transfer */
+  return TRUE;
+}
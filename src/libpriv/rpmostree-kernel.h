@@ -44,3 +44,39 @@ rpmostree_run_dracut (int     rootfs_dfd,
                       GLnxTmpfile *out_initramfs_tmpf,
                       GCancellable  *cancellable,
                       GError **error);
+
+char *
+rpmostree_initramfs_cache_key (int                 rootfs_dfd,
+                               const char         *kver,
+                               const char         *base_initramfs_path,
+                               const char *const  *argv,
+                               const char         *extra_state,
+                               GCancellable       *cancellable,
+                               GError            **error);
+
+gboolean
+rpmostree_initramfs_cache_lookup (OstreeRepo   *repo,
+                                  const char   *key,
+                                  int           rootfs_dfd,
+                                  gboolean     *out_found,
+                                  GLnxTmpfile  *out_initramfs_tmpf,
+                                  GCancellable *cancellable,
+                                  GError      **error);
+
+gboolean
+rpmostree_initramfs_cache_store (OstreeRepo   *repo,
+                                 const char   *key,
+                                 int           initramfs_fd,
+                                 GCancellable *cancellable,
+                                 GError      **error);
+
+gboolean
+rpmostree_initramfs_etc_path_is_valid (const char *path);
+
+gboolean
+rpmostree_initramfs_overlay_etc (int                rootfs_dfd,
+                                 const char        *base_initramfs_path,
+                                 const char *const *etc_files,
+                                 GLnxTmpfile       *out_initramfs_tmpf,
+                                 GCancellable      *cancellable,
+                                 GError           **error);
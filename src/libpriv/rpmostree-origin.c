@@ -36,6 +36,7 @@ struct RpmOstreeOrigin {
   char *cached_override_commit;
   char *cached_unconfigured_state;
   char **cached_initramfs_args;
+  char **cached_initramfs_etc;
   GHashTable *cached_packages;                  /* set of reldeps */
   GHashTable *cached_local_packages;            /* NEVRA --> header sha256 */
   /* GHashTable *cached_overrides_replace;         XXX: NOT IMPLEMENTED YET */
@@ -136,6 +137,8 @@ rpmostree_origin_parse_keyfile (GKeyFile         *origin,
 
   ret->cached_initramfs_args =
     g_key_file_get_string_list (ret->kf, "rpmostree", "initramfs-args", NULL, NULL);
+  ret->cached_initramfs_etc =
+    g_key_file_get_string_list (ret->kf, "rpmostree", "initramfs-etc", NULL, NULL);
 
   return g_steal_pointer (&ret);
 }
@@ -194,6 +197,13 @@ rpmostree_origin_get_initramfs_args (RpmOstreeOrigin *origin)
   return (const char * const*)origin->cached_initramfs_args;
 }
 
+/* Host /etc files to append to the base initramfs, instead of regenerating it */
+const char *const*
+rpmostree_origin_get_initramfs_etc (RpmOstreeOrigin *origin)
+{
+  return (const char * const*)origin->cached_initramfs_etc;
+}
+
 const char*
 rpmostree_origin_get_unconfigured_state (RpmOstreeOrigin *origin)
 {
@@ -258,6 +268,7 @@ rpmostree_origin_unref (RpmOstreeOrigin *origin)
   g_free (origin->cached_refspec);
   g_free (origin->cached_unconfigured_state);
   g_strfreev (origin->cached_initramfs_args);
+  g_strfreev (origin->cached_initramfs_etc);
   g_clear_pointer (&origin->cached_packages, g_hash_table_unref);
   g_clear_pointer (&origin->cached_local_packages, g_hash_table_unref);
   g_clear_pointer (&origin->cached_overrides_local_replace, g_hash_table_unref);
@@ -268,13 +279,16 @@ rpmostree_origin_unref (RpmOstreeOrigin *origin)
 void
 rpmostree_origin_set_regenerate_initramfs (RpmOstreeOrigin *origin,
                                            gboolean regenerate,
-                                           char **args)
+                                           char **args,
+                                           char **etc_files)
 {
   const char *section = "rpmostree";
   const char *regeneratek = "regenerate-initramfs";
   const char *argsk = "initramfs-args";
+  const char *etck = "initramfs-etc";
 
   g_strfreev (origin->cached_initramfs_args);
+  g_strfreev (origin->cached_initramfs_etc);
 
   if (regenerate)
     {
@@ -287,16 +301,28 @@ rpmostree_origin_set_regenerate_initramfs (RpmOstreeOrigin *origin,
         }
       else
         g_key_file_remove_key (origin->kf, section, argsk, NULL);
+      if (etc_files && *etc_files)
+        {
+          g_key_file_set_string_list (origin->kf, section, etck,
+                                      (const char *const*)etc_files,
+                                      g_strv_length (etc_files));
+        }
+      else
+        g_key_file_remove_key (origin->kf, section, etck, NULL);
     }
   else
     {
       g_key_file_remove_key (origin->kf, section, regeneratek, NULL);
       g_key_file_remove_key (origin->kf, section, argsk, NULL);
+      g_key_file_remove_key (origin->kf, section, etck, NULL);
     }
 
   origin->cached_initramfs_args =
     g_key_file_get_string_list (origin->kf, "rpmostree", "initramfs-args",
                                 NULL, NULL);
+  origin->cached_initramfs_etc =
+    g_key_file_get_string_list (origin->kf, "rpmostree", "initramfs-etc",
+                                NULL, NULL);
 }
 
 void
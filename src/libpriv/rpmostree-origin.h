@@ -75,6 +75,9 @@ rpmostree_origin_get_regenerate_initramfs (RpmOstreeOrigin *origin);
 const char *const*
 rpmostree_origin_get_initramfs_args (RpmOstreeOrigin *origin);
 
+const char *const*
+rpmostree_origin_get_initramfs_etc (RpmOstreeOrigin *origin);
+
 const char *
 rpmostree_origin_get_unconfigured_state (RpmOstreeOrigin *origin);
 
@@ -97,7 +100,8 @@ rpmostree_origin_dup_keyfile (RpmOstreeOrigin *origin);
 void
 rpmostree_origin_set_regenerate_initramfs (RpmOstreeOrigin *origin,
                                            gboolean regenerate,
-                                           char **args);
+                                           char **args,
+                                           char **etc_files);
 
 void
 rpmostree_origin_set_override_commit (RpmOstreeOrigin *origin,
@@ -36,6 +36,8 @@
 #include <stdlib.h>
 #include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
+#include <rpm/rpmts.h>
+#include <rpm/rpmfi.h>
 
 #include "rpmostree-postprocess.h"
 #include "rpmostree-kernel.h"
@@ -928,18 +930,31 @@ handle_remove_files_from_package (int               rootfs_fd,
   if (npackages == 0)
     return glnx_throw (error, "Unable to find package '%s' specified in remove-from-packages", pkgname);
 
+  /* Compile the patterns once rather than per package */
+  g_autoptr(GPtrArray) regexes = g_ptr_array_new_with_free_func ((GDestroyNotify)g_regex_unref);
+  for (guint i = 1; i < len; i++)
+    {
+      const char *remove_regex_pattern = json_array_get_string_element (removespec, i);
+
+      GRegex *regex = g_regex_new (remove_regex_pattern, G_REGEX_JAVASCRIPT_COMPAT, 0, error);
+      if (!regex)
+        return FALSE;
+      g_ptr_array_add (regexes, regex);
+    }
+
+  /* Package file lists include both directories and their contents; once
+   * we've deleted a path recursively, there's no need to touch its children.
+   */
+  g_autoptr(RpmOstreePathSet) deleted = rpmostree_path_set_new ();
+
   for (guint j = 0; j < npackages; j++)
     {
       DnfPackage *pkg = pkglist->pdata[j];
       g_auto(GStrv) pkg_files = dnf_package_get_files (pkg);
 
-      for (guint i = 1; i < len; i++)
+      for (guint i = 0; i < regexes->len; i++)
         {
-          const char *remove_regex_pattern = json_array_get_string_element (removespec, i);
-
-          GRegex *regex = g_regex_new (remove_regex_pattern, G_REGEX_JAVASCRIPT_COMPAT, 0, error);
-          if (!regex)
-            return FALSE;
+          GRegex *regex = regexes->pdata[i];
 
           for (char **strviter = pkg_files; strviter && strviter[0]; strviter++)
             {
@@ -950,9 +965,14 @@ handle_remove_files_from_package (int               rootfs_fd,
                   if (file[0] == '/')
                     file++;
 
+                  if (rpmostree_path_set_contains (deleted, file) ||
+                      rpmostree_path_set_has_parent (deleted, file))
+                    continue;
+
                   g_print ("Deleting: %s\n", file);
                   if (!glnx_shutil_rm_rf_at (rootfs_fd, file, cancellable, error))
                     return FALSE;
+                  rpmostree_path_set_add (deleted, file);
                 }
             }
         }
@@ -1568,26 +1588,536 @@ rpmostree_prepare_rootfs_for_commit (int            workdir_dfd,
 
 struct CommitThreadData {
   volatile gint done;
-  off_t n_bytes;
-  off_t n_processed;
+  guint64 n_bytes; /* estimated; 0 if unknown */
+  volatile gssize n_processed;
   volatile gint percent;
   OstreeRepo *repo;
   int rootfs_fd;
   OstreeMutableTree *mtree;
   OstreeSePolicy *sepolicy;
   OstreeRepoCommitModifier *commit_modifier;
+  OstreeRepoDevInoCache *devino_cache;
+  GHashTable *subtree_paths;
+  GHashTable *rpm_files; /* relpath -> RpmFileState, read-only */
+  GHashTable *prev_cache; /* relpath -> CommitCacheEntry, read-only */
   gboolean success;
+  volatile gint xattrs_failed;
+  GError *xattrs_error; /* First error from read_xattrs_cb(); see commit_error lock */
   GCancellable *cancellable;
   GError **error;
 };
 
+G_LOCK_DEFINE_STATIC (commit_error);
+
+/* On-disk cache of the content checksums from the last commit, so that
+ * unchanged files can skip both reading xattrs and checksumming.  It lives in
+ * the compose cachedir and is keyed by path.  Compose recreates the rootfs
+ * every time, so nothing about the inode is stable; instead, we only cache
+ * regular files which are still exactly as rpm installed them (same size and
+ * mtime as in the rpmdb), and reuse an entry if the rpm digest and file
+ * capabilities, mode and ownership are the same as last time, as is the policy
+ * used to label it.  Note this means a script changing only e.g. a
+ * user.pax.flags xattr while keeping the mtime isn't picked up.
+ */
+#define RPMOSTREE_COMMIT_CACHE_NAME "rpmostree-commit-cache"
+/* Bump this if anything that goes into content checksums changes, e.g.
+ * the xattrs accepted by read_xattrs_cb() */
+#define RPMOSTREE_COMMIT_CACHE_VERSION 2
+#define RPMOSTREE_COMMIT_CACHE_VARIANT_FORMAT "(usa(ssuuus))"
+
+/* A regular file as rpm installed it */
+typedef struct {
+  char *state; /* digest and file caps; "" if packages disagree */
+  guint64 size;
+  guint64 mtime;
+} RpmFileState;
+
+static void
+rpm_file_state_free (RpmFileState *state)
+{
+  g_free (state->state);
+  g_free (state);
+}
+
+typedef struct {
+  char *rpm_state;
+  guint32 mode;
+  guint32 uid;
+  guint32 gid;
+  char checksum[OSTREE_SHA256_STRING_LEN+1];
+} CommitCacheEntry;
+
+static void
+commit_cache_entry_free (CommitCacheEntry *entry)
+{
+  g_free (entry->rpm_state);
+  g_free (entry);
+}
+
+static CommitCacheEntry *
+commit_cache_entry_new (const char        *rpm_state,
+                        const struct stat *stbuf)
+{
+  CommitCacheEntry *entry = g_new0 (CommitCacheEntry, 1);
+  entry->rpm_state = g_strdup (rpm_state);
+  entry->mode = stbuf->st_mode;
+  entry->uid = stbuf->st_uid;
+  entry->gid = stbuf->st_gid;
+  return entry;
+}
+
+static gboolean
+commit_cache_entry_matches (const CommitCacheEntry *a,
+                            const CommitCacheEntry *b)
+{
+  return g_str_equal (a->rpm_state, b->rpm_state) && a->mode == b->mode &&
+    a->uid == b->uid && a->gid == b->gid;
+}
+
+/* Where a file installed by rpm at @path ends up in the rootfs we commit */
+static char *
+rpm_path_to_relpath (const char *path)
+{
+  path += strspn (path, "/");
+  if (g_str_has_prefix (path, "etc/"))
+    return g_strconcat ("usr/", path, NULL);
+  return g_strdup (path);
+}
+
+static gboolean
+copy_rpmdb (int           rootfs_fd,
+            int           tmpdir_dfd,
+            GCancellable *cancellable,
+            GError      **error)
+{
+  if (!glnx_shutil_mkdir_p_at (tmpdir_dfd, "usr/share/rpm", 0755, cancellable, error) ||
+      !glnx_shutil_mkdir_p_at (tmpdir_dfd, "var/lib", 0755, cancellable, error))
+    return FALSE;
+  /* Same layout as rpmostree_checkout_only_rpmdb_tempdir(), whatever _dbpath is */
+  if (symlinkat ("../../usr/share/rpm", tmpdir_dfd, "var/lib/rpm") < 0)
+    return glnx_throw_errno_prefix (error, "symlinkat");
+
+  glnx_fd_close int dbdir_dfd = -1;
+  if (!glnx_opendirat (tmpdir_dfd, "usr/share/rpm", TRUE, &dbdir_dfd, error))
+    return FALSE;
+
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (rootfs_fd, "usr/share/rpm", TRUE, &dfd_iter, error))
+    return FALSE;
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+      if (!dent)
+        break;
+      if (dent->d_type != DT_REG)
+        continue;
+      if (!glnx_file_copy_at (dfd_iter.fd, dent->d_name, NULL, dbdir_dfd, dent->d_name,
+                              GLNX_FILE_COPY_NOXATTRS, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static GHashTable *
+read_rpm_file_states (const char *root,
+                      GError    **error)
+{
+  g_autoptr(GHashTable) states =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                           (GDestroyNotify)rpm_file_state_free);
+
+  rpmts ts = rpmtsCreate ();
+  rpmtsSetVSFlags (ts, _RPMVSF_NODIGESTS | _RPMVSF_NOSIGNATURES);
+  if (rpmtsSetRootDir (ts, root) != 0)
+    {
+      rpmtsFree (ts);
+      return glnx_null_throw (error, "Failed to set rpm root to %s", root);
+    }
+
+  rpmdbMatchIterator mi = rpmtsInitIterator (ts, RPMDBI_PACKAGES, NULL, 0);
+  Header hdr;
+  while (mi && (hdr = rpmdbNextIterator (mi)) != NULL)
+    {
+      rpmfi fi = rpmfiNew (ts, hdr, RPMTAG_BASENAMES, RPMFI_FLAGS_QUERY);
+      rpmfiInit (fi, 0);
+      while (rpmfiNext (fi) >= 0)
+        {
+          if (!S_ISREG (rpmfiFMode (fi)) || (rpmfiFFlags (fi) & RPMFILE_GHOST))
+            continue;
+
+          char *digest = rpmfiFDigestHex (fi, NULL);
+          g_autofree char *state = NULL;
+          if (digest && *digest)
+            state = g_strconcat (digest, " ", rpmfiFCaps (fi) ?: "", NULL);
+          else
+            state = g_strdup ("");
+          free (digest);
+
+          g_autofree char *relpath = rpm_path_to_relpath (rpmfiFN (fi));
+          RpmFileState *prev = g_hash_table_lookup (states, relpath);
+          if (prev)
+            {
+              /* e.g. multilib; fine as long as they agree */
+              if (!g_str_equal (prev->state, state) || prev->size != rpmfiFSize (fi) ||
+                  prev->mtime != rpmfiFMtime (fi))
+                prev->state[0] = '\0';
+              continue;
+            }
+
+          RpmFileState *file_state = g_new0 (RpmFileState, 1);
+          file_state->state = g_steal_pointer (&state);
+          file_state->size = rpmfiFSize (fi);
+          file_state->mtime = rpmfiFMtime (fi);
+          g_hash_table_insert (states, g_steal_pointer (&relpath), file_state);
+        }
+      rpmfiFree (fi);
+    }
+  if (mi)
+    rpmdbFreeIterator (mi);
+  rpmtsFree (ts);
+
+  return g_steal_pointer (&states);
+}
+
+/* Look up what rpm installed in @rootfs_fd, for the commit cache; returns
+ * %NULL (and no error) if there's no rpmdb.  We read a copy of the rpmdb so
+ * as not to leave e.g. lock files behind in the tree we're committing.
+ */
+static GHashTable *
+load_rpm_file_states (int           rootfs_fd,
+                      GCancellable *cancellable,
+                      GError      **error)
+{
+  struct stat stbuf;
+  if (fstatat (rootfs_fd, "usr/share/rpm", &stbuf, 0) < 0)
+    {
+      if (errno == ENOENT)
+        return NULL;
+      return glnx_null_throw_errno_prefix (error, "fstatat(usr/share/rpm)");
+    }
+
+  g_autofree char *tmpdir = NULL;
+  glnx_fd_close int tmpdir_dfd = -1;
+  if (!rpmostree_mkdtemp ("/var/tmp/rpmostree-rpmdb-XXXXXX", &tmpdir, &tmpdir_dfd, error))
+    return NULL;
+
+  g_autoptr(GHashTable) states = NULL;
+  if (copy_rpmdb (rootfs_fd, tmpdir_dfd, cancellable, error))
+    states = read_rpm_file_states (tmpdir, error);
+  (void) glnx_shutil_rm_rf_at (AT_FDCWD, tmpdir, NULL, NULL);
+  return g_steal_pointer (&states);
+}
+
+static const char *
+sepolicy_csum_or_empty (OstreeSePolicy *sepolicy)
+{
+  return sepolicy ? ostree_sepolicy_get_csum (sepolicy) : "";
+}
+
+/* Returns %NULL (and no error) if there's no usable cache */
+static GHashTable *
+load_commit_cache (int              cachedir_dfd,
+                   OstreeSePolicy  *sepolicy,
+                   GError         **error)
+{
+  glnx_fd_close int fd = openat (cachedir_dfd, RPMOSTREE_COMMIT_CACHE_NAME,
+                                 O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      if (errno == ENOENT)
+        return NULL;
+      return glnx_null_throw_errno_prefix (error, "openat(%s)", RPMOSTREE_COMMIT_CACHE_NAME);
+    }
+
+  g_autoptr(GMappedFile) mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (!mfile)
+    return NULL;
+  g_autoptr(GBytes) bytes = g_mapped_file_get_bytes (mfile);
+  g_autoptr(GVariant) cache_v =
+    g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (RPMOSTREE_COMMIT_CACHE_VARIANT_FORMAT),
+                                                  bytes, FALSE));
+
+  /* Check the version before looking at the rest, the format may differ */
+  guint32 version = 0;
+  if (g_variant_n_children (cache_v) > 0)
+    {
+      g_autoptr(GVariant) version_v = g_variant_get_child_value (cache_v, 0);
+      version = g_variant_get_uint32 (version_v);
+    }
+  if (version != RPMOSTREE_COMMIT_CACHE_VERSION)
+    return NULL;
+
+  const char *policy_csum;
+  g_autoptr(GVariant) entries_v = NULL;
+  g_variant_get (cache_v, "(u&s@a(ssuuus))", &version, &policy_csum, &entries_v);
+  if (!g_str_equal (policy_csum, sepolicy_csum_or_empty (sepolicy)))
+    return NULL;
+
+  g_autoptr(GHashTable) cache =
+    g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                           (GDestroyNotify)commit_cache_entry_free);
+  const guint n = g_variant_n_children (entries_v);
+  for (guint i = 0; i < n; i++)
+    {
+      const char *path;
+      const char *rpm_state;
+      const char *checksum;
+      CommitCacheEntry *entry = g_new0 (CommitCacheEntry, 1);
+      g_variant_get_child (entries_v, i, "(&s&suuu&s)", &path, &rpm_state,
+                           &entry->mode, &entry->uid, &entry->gid, &checksum);
+      entry->rpm_state = g_strdup (rpm_state);
+      if (!ostree_validate_checksum_string (checksum, NULL))
+        {
+          commit_cache_entry_free (entry);
+          continue;
+        }
+      memcpy (entry->checksum, checksum, sizeof (entry->checksum));
+      g_hash_table_insert (cache, g_strdup (path), entry);
+    }
+
+  return g_steal_pointer (&cache);
+}
+
+static gboolean
+save_commit_cache (int              cachedir_dfd,
+                   OstreeSePolicy  *sepolicy,
+                   GHashTable      *entries,
+                   GCancellable    *cancellable,
+                   GError         **error)
+{
+  g_auto(GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssuuus)"));
+  GLNX_HASH_TABLE_FOREACH_KV (entries, const char*, path, CommitCacheEntry*, entry)
+    {
+      if (entry->checksum[0] == '\0')
+        continue;
+      g_variant_builder_add (&builder, "(ssuuus)", path, entry->rpm_state,
+                             entry->mode, entry->uid, entry->gid,
+                             entry->checksum);
+    }
+
+  g_autoptr(GVariant) cache_v =
+    g_variant_ref_sink (g_variant_new ("(us@a(ssuuus))", RPMOSTREE_COMMIT_CACHE_VERSION,
+                                       sepolicy_csum_or_empty (sepolicy),
+                                       g_variant_builder_end (&builder)));
+  return glnx_file_replace_contents_at (cachedir_dfd, RPMOSTREE_COMMIT_CACHE_NAME,
+                                        g_variant_get_data (cache_v),
+                                        g_variant_get_size (cache_v),
+                                        GLNX_FILE_REPLACE_NODATASYNC,
+                                        cancellable, error);
+}
+
+/* State for one walk over the rootfs: either the main one, or a directory
+ * committed on its own by a worker thread and then grafted into the main
+ * mtree. */
+typedef struct {
+  struct CommitThreadData *tdata;
+  char *prefix; /* relative to the rootfs; %NULL for the main walk */
+  GHashTable *cache_seen; /* relpath -> CommitCacheEntry; %NULL if not caching */
+  GHashTable *cache_hits; /* relpath -> checksum, skipped in the walk */
+  char *contents_checksum;
+  char *metadata_checksum;
+  GError *error;
+} CommitWalk;
+
+static CommitWalk *
+commit_walk_new (struct CommitThreadData *tdata,
+                 const char              *prefix,
+                 gboolean                 use_cache)
+{
+  CommitWalk *walk = g_new0 (CommitWalk, 1);
+  walk->tdata = tdata;
+  walk->prefix = g_strdup (prefix);
+  if (use_cache)
+    {
+      walk->cache_seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify)commit_cache_entry_free);
+      walk->cache_hits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    }
+  return walk;
+}
+
+static void
+commit_walk_free (CommitWalk *walk)
+{
+  g_free (walk->prefix);
+  g_clear_pointer (&walk->cache_seen, g_hash_table_unref);
+  g_clear_pointer (&walk->cache_hits, g_hash_table_unref);
+  g_free (walk->contents_checksum);
+  g_free (walk->metadata_checksum);
+  g_clear_error (&walk->error);
+  g_free (walk);
+}
+
+/* Convert a path as seen by the commit modifier into one relative to the rootfs */
+static char *
+commit_walk_relpath (CommitWalk *walk,
+                     const char *path)
+{
+  if (path[0] == '/')
+    path++;
+  if (!walk->prefix)
+    return g_strdup (path);
+  if (!*path)
+    return g_strdup (walk->prefix);
+  return g_build_filename (walk->prefix, path, NULL);
+}
+
+/* And the reverse, for finding things in the walk's own mtree */
+static const char *
+commit_walk_subpath (CommitWalk *walk,
+                     const char *relpath)
+{
+  if (!walk->prefix)
+    return relpath;
+  g_assert (g_str_has_prefix (relpath, walk->prefix));
+  relpath += strlen (walk->prefix);
+  if (*relpath == '/')
+    relpath++;
+  return relpath;
+}
+
+static OstreeRepoCommitFilterResult
+commit_filter_cb (OstreeRepo         *repo,
+                  const char         *path,
+                  GFileInfo          *file_info,
+                  gpointer            user_data)
+{
+  CommitWalk *walk = user_data;
+  struct CommitThreadData *tdata = walk->tdata;
+
+  /* Wind down all the walks once one of them failed in read_xattrs_cb() */
+  if (g_atomic_int_get (&tdata->xattrs_failed))
+    return OSTREE_REPO_COMMIT_FILTER_SKIP;
+
+  g_autofree char *relpath = commit_walk_relpath (walk, path);
+
+  /* Skip the directories being committed by workers in the main walk */
+  if (!walk->prefix && tdata->subtree_paths &&
+      g_hash_table_contains (tdata->subtree_paths, relpath))
+    return OSTREE_REPO_COMMIT_FILTER_SKIP;
+
+  if (!walk->cache_seen || g_file_info_get_file_type (file_info) != G_FILE_TYPE_REGULAR)
+    return OSTREE_REPO_COMMIT_FILTER_ALLOW;
+
+  RpmFileState *rpm_file = g_hash_table_lookup (tdata->rpm_files, relpath);
+  if (!rpm_file || !*rpm_file->state)
+    return OSTREE_REPO_COMMIT_FILTER_ALLOW;
+
+  struct stat stbuf;
+  if (fstatat (tdata->rootfs_fd, relpath, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+    return OSTREE_REPO_COMMIT_FILTER_ALLOW; /* Let the commit deal with it */
+
+  /* Changed since rpm installed it, e.g. by a script or postprocessing */
+  if ((guint64)stbuf.st_size != rpm_file->size ||
+      (guint64)stbuf.st_mtim.tv_sec != rpm_file->mtime)
+    return OSTREE_REPO_COMMIT_FILTER_ALLOW;
+
+  CommitCacheEntry *entry = commit_cache_entry_new (rpm_file->state, &stbuf);
+
+  CommitCacheEntry *prev = tdata->prev_cache ?
+    g_hash_table_lookup (tdata->prev_cache, relpath) : NULL;
+  gboolean have_object = FALSE;
+  if (prev && commit_cache_entry_matches (prev, entry) &&
+      ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, prev->checksum,
+                              &have_object, NULL, NULL) && have_object)
+    {
+      memcpy (entry->checksum, prev->checksum, sizeof (entry->checksum));
+      g_hash_table_insert (walk->cache_hits, g_strdup (relpath), g_strdup (prev->checksum));
+      g_hash_table_insert (walk->cache_seen, g_steal_pointer (&relpath), entry);
+      g_atomic_pointer_add (&tdata->n_processed, (gssize) stbuf.st_size);
+      return OSTREE_REPO_COMMIT_FILTER_SKIP;
+    }
+
+  g_hash_table_insert (walk->cache_seen, g_steal_pointer (&relpath), entry);
+  return OSTREE_REPO_COMMIT_FILTER_ALLOW;
+}
+
+/* Add the files we skipped because they were cached back into @mtree, and
+ * record the checksums of everything else for the next run.
+ */
+static gboolean
+commit_walk_finish_cache (CommitWalk        *walk,
+                          OstreeMutableTree *mtree,
+                          GError           **error)
+{
+  if (!walk->cache_seen)
+    return TRUE;
+
+  GLNX_HASH_TABLE_FOREACH_KV (walk->cache_hits, const char*, relpath, const char*, checksum)
+    {
+      g_auto(GStrv) components = g_strsplit (commit_walk_subpath (walk, relpath), "/", -1);
+      const guint n_components = g_strv_length (components);
+      g_assert_cmpuint (n_components, >, 0);
+      g_autoptr(OstreeMutableTree) dir = g_object_ref (mtree);
+      for (guint i = 0; i < n_components - 1; i++)
+        {
+          g_autoptr(OstreeMutableTree) subdir = NULL;
+          if (!ostree_mutable_tree_ensure_dir (dir, components[i], &subdir, error))
+            return FALSE;
+          g_clear_object (&dir);
+          dir = g_steal_pointer (&subdir);
+        }
+      if (!ostree_mutable_tree_replace_file (dir, components[n_components-1],
+                                             checksum, error))
+        return FALSE;
+    }
+
+  GLNX_HASH_TABLE_FOREACH_KV (walk->cache_seen, const char*, relpath, CommitCacheEntry*, entry)
+    {
+      if (entry->checksum[0] != '\0')
+        continue;
+
+      g_auto(GStrv) components = g_strsplit (commit_walk_subpath (walk, relpath), "/", -1);
+      OstreeMutableTree *dir = mtree;
+      for (char **iter = components; dir && *iter; iter++)
+        {
+          if (*(iter+1) == NULL)
+            {
+              const char *checksum =
+                g_hash_table_lookup (ostree_mutable_tree_get_files (dir), *iter);
+              if (checksum)
+                memcpy (entry->checksum, checksum, sizeof (entry->checksum));
+            }
+          else
+            dir = g_hash_table_lookup (ostree_mutable_tree_get_subdirs (dir), *iter);
+        }
+    }
+
+  return TRUE;
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(CommitWalk, commit_walk_free)
+
+static OstreeRepoCommitModifier *
+commit_walk_new_modifier (CommitWalk                     *walk,
+                          OstreeRepoCommitModifierFlags   flags)
+{
+  struct CommitThreadData *tdata = walk->tdata;
+  const gboolean need_filter = walk->cache_seen != NULL ||
+    (!walk->prefix && tdata->subtree_paths != NULL);
+
+  OstreeRepoCommitModifier *modifier =
+    ostree_repo_commit_modifier_new (flags, need_filter ? commit_filter_cb : NULL,
+                                     walk, NULL);
+  ostree_repo_commit_modifier_set_xattr_callback (modifier, read_xattrs_cb,
+                                                  NULL, walk);
+  if (tdata->devino_cache)
+    ostree_repo_commit_modifier_set_devino_cache (modifier, tdata->devino_cache);
+  return modifier;
+}
+
 static GVariant *
 read_xattrs_cb (OstreeRepo     *repo,
                 const char     *relpath,
                 GFileInfo      *file_info,
                 gpointer        user_data)
 {
-  struct CommitThreadData *tdata = user_data;
+  CommitWalk *walk = user_data;
+  struct CommitThreadData *tdata = walk->tdata;
   int rootfs_fd = tdata->rootfs_fd;
   /* If you have a use case for something else, file an issue */
   static const char *accepted_xattrs[] =
@@ -1597,13 +2127,15 @@ read_xattrs_cb (OstreeRepo     *repo,
   guint i;
   g_autoptr(GVariant) existing_xattrs = NULL;
   g_autoptr(GVariantIter) viter = NULL;
+  g_autofree char *walk_relpath = NULL;
   GError *local_error = NULL;
   GError **error = &local_error;
   GVariant *key, *value;
   GVariantBuilder builder;
 
-  if (relpath[0] == '/')
-    relpath++;
+  /* Paths are relative to where the walk started */
+  walk_relpath = commit_walk_relpath (walk, relpath);
+  relpath = walk_relpath;
 
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ayay)"));
 
@@ -1621,8 +2153,12 @@ read_xattrs_cb (OstreeRepo     *repo,
 
   if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_DIRECTORY)
     {
-      tdata->n_processed += g_file_info_get_size (file_info);
-      g_atomic_int_set (&tdata->percent, (gint)((100.0*tdata->n_processed)/tdata->n_bytes));
+      const gssize size = g_file_info_get_size (file_info);
+      const gssize n_processed = g_atomic_pointer_add (&tdata->n_processed, size) + size;
+      /* Postprocessing means the estimate may be off; don't claim we're done early */
+      if (tdata->n_bytes > 0)
+        g_atomic_int_set (&tdata->percent,
+                          (gint) MIN (99, (100.0*n_processed)/tdata->n_bytes));
     }
 
   viter = g_variant_iter_new (existing_xattrs);
@@ -1638,87 +2174,203 @@ read_xattrs_cb (OstreeRepo     *repo,
         }
     }
 
+  /* We label here rather than via the commit modifier, the same way ostree
+   * would: it would label subtree paths relative to the subtree, and the
+   * walks run in parallel on a shared policy, so lookups need the lock.
+   */
+  if (tdata->sepolicy)
+    {
+      g_autofree char *abspath = g_strconcat ("/", relpath, NULL);
+      g_autofree char *label = NULL;
+      if (!rpmostree_sepolicy_get_label_locked (tdata->sepolicy, abspath,
+                                                g_file_info_get_attribute_uint32 (file_info, "unix::mode"),
+                                                &label, NULL, error))
+        goto out;
+      if (!label)
+        {
+          glnx_throw (error, "Failed to look up SELinux label");
+          goto out;
+        }
+      g_variant_builder_add (&builder, "(@ay@ay)",
+                             g_variant_new_bytestring ("security.selinux"),
+                             g_variant_new_bytestring (label));
+    }
+
  out:
   if (local_error)
     {
       g_variant_builder_clear (&builder);
-      /* Unfortunately we have no way to throw from this callback */
-      g_printerr ("Failed to read xattrs of '%s': %s\n",
-                  relpath, local_error->message);
-      exit (1);
+      /* We have no way to throw from this callback; keep the first error
+       * for rpmostree_commit() to return, and have commit_filter_cb() skip
+       * everything else.
+       */
+      g_prefix_error (&local_error, "Reading xattrs of '%s': ", relpath);
+      G_LOCK (commit_error);
+      if (!tdata->xattrs_error)
+        tdata->xattrs_error = g_steal_pointer (&local_error);
+      G_UNLOCK (commit_error);
+      g_clear_error (&local_error);
+      g_atomic_int_set (&tdata->xattrs_failed, 1);
+      return g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE ("(ayay)"), NULL, 0));
     }
   return g_variant_ref_sink (g_variant_builder_end (&builder));
 }
 
+static gpointer
+write_dfd_thread (gpointer datap)
+{
+  CommitWalk *walk = datap;
+  struct CommitThreadData *data = walk->tdata;
+
+  if (!ostree_repo_write_dfd_to_mtree (data->repo, data->rootfs_fd, ".",
+                                       data->mtree,
+                                       data->commit_modifier,
+                                       data->cancellable, data->error))
+    goto out;
+
+  if (!commit_walk_finish_cache (walk, data->mtree, data->error))
+    goto out;
+
+  data->success = TRUE;
+ out:
+  g_atomic_int_inc (&data->done);
+  g_main_context_wakeup (NULL);
+  return NULL;
+}
+
+static void
+write_subtree_in_thread (gpointer data,
+                         gpointer user_data)
+{
+  CommitWalk *walk = data;
+  struct CommitThreadData *tdata = walk->tdata;
+  g_autoptr(OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+  g_autoptr(GFile) root = NULL;
+
+  /* No sepolicy here; see read_xattrs_cb() */
+  g_autoptr(OstreeRepoCommitModifier) modifier =
+    commit_walk_new_modifier (walk, OSTREE_REPO_COMMIT_MODIFIER_FLAGS_NONE);
+
+  if (!ostree_repo_write_dfd_to_mtree (tdata->repo, tdata->rootfs_fd, walk->prefix,
+                                       mtree, modifier, tdata->cancellable,
+                                       &walk->error))
+    goto out;
+  if (!commit_walk_finish_cache (walk, mtree, &walk->error))
+    goto out;
+  if (!ostree_repo_write_mtree (tdata->repo, mtree, &root, tdata->cancellable,
+                                &walk->error))
+    goto out;
+
+  walk->contents_checksum =
+    g_strdup (ostree_repo_file_tree_get_contents_checksum ((OstreeRepoFile*)root));
+  walk->metadata_checksum =
+    g_strdup (ostree_repo_file_tree_get_metadata_checksum ((OstreeRepoFile*)root));
+
+ out:
+  if (walk->error)
+    g_prefix_error (&walk->error, "Writing %s: ", walk->prefix);
+  g_atomic_int_inc (&tdata->done);
+  g_main_context_wakeup (NULL);
+}
+
+/* Pick the directories to commit in parallel.  Nearly all of the content
+ * lives under /usr, so we take each usr/X/Y directory; everything else
+ * (including usr/ and usr/X themselves) is done by the main walk.
+ */
 static gboolean
-count_filesizes (int dfd,
-                 const char *path,
-                 off_t *out_n_bytes,
-                 GCancellable *cancellable,
-                 GError **error)
+gather_commit_subtrees (int            rootfs_fd,
+                        GPtrArray     *out_subtrees,
+                        GCancellable  *cancellable,
+                        GError       **error)
 {
-  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
-  
-  if (!glnx_dirfd_iterator_init_at (dfd, path, TRUE, &dfd_iter, error))
+  g_auto(GLnxDirFdIterator) usr_iter = { 0, };
+  struct stat stbuf;
+
+  if (fstatat (rootfs_fd, "usr", &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+    {
+      if (errno == ENOENT)
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "fstatat(usr)");
+    }
+  if (!S_ISDIR (stbuf.st_mode))
+    return TRUE;
+
+  if (!glnx_dirfd_iterator_init_at (rootfs_fd, "usr", TRUE, &usr_iter, error))
     return FALSE;
-  
+
   while (TRUE)
     {
       struct dirent *dent = NULL;
-
-      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&usr_iter, &dent, cancellable, error))
         return FALSE;
       if (!dent)
         break;
+      if (dent->d_type != DT_DIR)
+        continue;
 
-      if (dent->d_type == DT_DIR)
+      g_auto(GLnxDirFdIterator) iter = { 0, };
+      if (!glnx_dirfd_iterator_init_at (usr_iter.fd, dent->d_name, TRUE, &iter, error))
+        return FALSE;
+
+      while (TRUE)
         {
-          if (!count_filesizes (dfd_iter.fd, dent->d_name, out_n_bytes,
-                                cancellable, error))
+          struct dirent *subdent = NULL;
+          if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &subdent, cancellable, error))
             return FALSE;
-        }
-      else
-        {
-          struct stat stbuf;
-
-          if (fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
-            {
-              glnx_set_prefix_error_from_errno (error, "%s", "fstatat");
-              return FALSE;
-            }
+          if (!subdent)
+            break;
+          if (subdent->d_type != DT_DIR)
+            continue;
 
-          (*out_n_bytes) += stbuf.st_size;
+          g_ptr_array_add (out_subtrees,
+                           g_strconcat ("usr/", dent->d_name, "/", subdent->d_name, NULL));
         }
     }
 
   return TRUE;
 }
 
-static gpointer
-write_dfd_thread (gpointer datap)
+/* Graft a subtree written by a worker into the main mtree */
+static gboolean
+graft_subtree (OstreeMutableTree *root,
+               CommitWalk        *subtree,
+               GError           **error)
 {
-  struct CommitThreadData *data = datap;
+  g_auto(GStrv) components = g_strsplit (subtree->prefix, "/", -1);
+  g_autoptr(OstreeMutableTree) dir = g_object_ref (root);
 
-  if (!ostree_repo_write_dfd_to_mtree (data->repo, data->rootfs_fd, ".",
-                                       data->mtree,
-                                       data->commit_modifier,
-                                       data->cancellable, data->error))
-    goto out;
+  for (char **iter = components; iter && *iter; iter++)
+    {
+      g_autoptr(OstreeMutableTree) subdir = NULL;
+      if (!ostree_mutable_tree_ensure_dir (dir, *iter, &subdir, error))
+        return FALSE;
+      g_clear_object (&dir);
+      dir = g_steal_pointer (&subdir);
+    }
 
-  data->success = TRUE;
- out:
-  g_atomic_int_inc (&data->done);
-  g_main_context_wakeup (NULL);
-  return NULL;
+  ostree_mutable_tree_set_contents_checksum (dir, subtree->contents_checksum);
+  ostree_mutable_tree_set_metadata_checksum (dir, subtree->metadata_checksum);
+  return TRUE;
 }
 
 static gboolean
 on_progress_timeout (gpointer datap)
 {
   struct CommitThreadData *data = datap;
-  const gint percent = g_atomic_int_get (&data->percent);
 
-  glnx_console_progress_text_percent ("Committing:", percent);
+  if (data->n_bytes > 0)
+    {
+      const gint percent = g_atomic_int_get (&data->percent);
+      glnx_console_progress_text_percent ("Committing:", percent);
+    }
+  else
+    {
+      /* No estimate; just show how far along we are */
+      g_autofree char *sizestr =
+        g_format_size ((gsize) g_atomic_pointer_get (&data->n_processed));
+      g_autofree char *text = g_strdup_printf ("Committing: %s", sizestr);
+      glnx_console_text (text);
+    }
 
   return TRUE;
 }
@@ -1732,6 +2384,9 @@ rpmostree_commit (int            rootfs_fd,
                   const char    *gpg_keyid,
                   gboolean       enable_selinux,
                   OstreeRepoDevInoCache *devino_cache,
+                  int            cachedir_dfd,
+                  guint          n_jobs,
+                  guint64        size_estimate,
                   char         **out_new_revision,
                   GCancellable  *cancellable,
                   GError       **error)
@@ -1748,60 +2403,137 @@ rpmostree_commit (int            rootfs_fd,
     return FALSE;
 
   g_autoptr(OstreeMutableTree) mtree = ostree_mutable_tree_new ();
-  /* We may make this configurable if someone complains about including some
-   * unlabeled content, but I think the fix for that is to ensure that policy is
-   * labeling it.
-   */
-  OstreeRepoCommitModifierFlags modifier_flags = OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED;
-  /* If changing this, also look at changing rpmostree-unpacker.c */
-  g_autoptr(OstreeRepoCommitModifier) commit_modifier =
-    ostree_repo_commit_modifier_new (modifier_flags, NULL, NULL, NULL);
   struct CommitThreadData tdata = { 0, };
-  ostree_repo_commit_modifier_set_xattr_callback (commit_modifier,
-                                                  read_xattrs_cb, NULL,
-                                                  &tdata);
 
-  if (sepolicy && ostree_sepolicy_get_name (sepolicy) != NULL)
-    ostree_repo_commit_modifier_set_sepolicy (commit_modifier, sepolicy);
-  else if (enable_selinux)
-    return glnx_throw (error, "SELinux enabled, but no policy found");
+  /* Large directories are committed by a pool of workers, and the main walk
+   * skips them; they're grafted into the mtree at the end.
+   */
+  if (n_jobs == 0)
+    n_jobs = g_get_num_processors ();
+  g_autoptr(GPtrArray) subtree_paths = g_ptr_array_new_with_free_func (g_free);
+  if (n_jobs > 1)
+    {
+      if (!gather_commit_subtrees (rootfs_fd, subtree_paths, cancellable, error))
+        return FALSE;
+    }
+  g_autoptr(GHashTable) subtree_set = g_hash_table_new (g_str_hash, g_str_equal);
+  for (guint i = 0; i < subtree_paths->len; i++)
+    g_hash_table_add (subtree_set, subtree_paths->pdata[i]);
 
-  if (devino_cache)
-    ostree_repo_commit_modifier_set_devino_cache (commit_modifier, devino_cache);
+  if (sepolicy && ostree_sepolicy_get_name (sepolicy) == NULL)
+    {
+      if (enable_selinux)
+        return glnx_throw (error, "SELinux enabled, but no policy found");
+      g_clear_object (&sepolicy);
+    }
 
-  off_t n_bytes = 0;
-  if (!count_filesizes (rootfs_fd, ".", &n_bytes, cancellable, error))
-    return FALSE;
+  g_autoptr(GHashTable) rpm_files = NULL;
+  g_autoptr(GHashTable) prev_cache = NULL;
+  if (cachedir_dfd >= 0)
+    {
+      GError *local_error = NULL;
+      rpm_files = load_rpm_file_states (rootfs_fd, cancellable, &local_error);
+      if (local_error)
+        {
+          g_propagate_error (error, local_error);
+          return glnx_prefix_error (error, "Reading rpmdb for commit cache");
+        }
+    }
+  if (rpm_files)
+    {
+      GError *local_error = NULL;
+      prev_cache = load_commit_cache (cachedir_dfd, sepolicy, &local_error);
+      if (local_error)
+        {
+          g_propagate_error (error, local_error);
+          return glnx_prefix_error (error, "Loading commit cache");
+        }
+    }
 
-  tdata.n_bytes = n_bytes;
+  tdata.n_bytes = size_estimate;
   tdata.repo = repo;
   tdata.rootfs_fd = rootfs_fd;
   tdata.mtree = mtree;
   tdata.sepolicy = sepolicy;
-  tdata.commit_modifier = commit_modifier;
+  tdata.devino_cache = devino_cache;
+  tdata.subtree_paths = subtree_paths->len > 0 ? subtree_set : NULL;
+  tdata.rpm_files = rpm_files;
+  tdata.prev_cache = prev_cache;
+  tdata.cancellable = cancellable;
   tdata.error = error;
 
+  /* Nothing to key the cache on without an rpmdb */
+  const gboolean use_cache = rpm_files != NULL;
+  g_autoptr(CommitWalk) main_walk = commit_walk_new (&tdata, NULL, use_cache);
+
+  /* We may make this configurable if someone complains about including some
+   * unlabeled content, but I think the fix for that is to ensure that policy is
+   * labeling it.
+   */
+  OstreeRepoCommitModifierFlags modifier_flags = OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED;
+  /* If changing this, also look at changing rpmostree-unpacker.c */
+  g_autoptr(OstreeRepoCommitModifier) commit_modifier =
+    commit_walk_new_modifier (main_walk, modifier_flags);
+  tdata.commit_modifier = commit_modifier;
+
+  g_autoptr(GPtrArray) subtrees =
+    g_ptr_array_new_with_free_func ((GDestroyNotify)commit_walk_free);
+  for (guint i = 0; i < subtree_paths->len; i++)
+    g_ptr_array_add (subtrees, commit_walk_new (&tdata, subtree_paths->pdata[i], use_cache));
+
   g_autoptr(GThread) commit_thread = NULL;
   g_auto(GLnxConsoleRef) console = { 0, };
   g_autoptr(GSource) progress_src = NULL;
 
   glnx_console_lock (&console);
 
-  commit_thread = g_thread_new ("commit", write_dfd_thread, &tdata);
+  commit_thread = g_thread_new ("commit", write_dfd_thread, main_walk);
+
+  GThreadPool *subtree_pool = NULL;
+  if (subtrees->len > 0)
+    {
+      subtree_pool = g_thread_pool_new (write_subtree_in_thread, NULL,
+                                        n_jobs, FALSE, NULL);
+      for (guint i = 0; i < subtrees->len; i++)
+        g_thread_pool_push (subtree_pool, subtrees->pdata[i], NULL);
+    }
 
   progress_src = g_timeout_source_new_seconds (console.is_tty ? 1 : 5);
   g_source_set_callback (progress_src, on_progress_timeout, &tdata, NULL);
   g_source_attach (progress_src, NULL);
 
-  while (g_atomic_int_get (&tdata.done) == 0)
+  /* The main walk, plus one for each subtree */
+  while (g_atomic_int_get (&tdata.done) < (gint)(subtrees->len + 1))
     g_main_context_iteration (NULL, TRUE);
 
   glnx_console_progress_text_percent ("Committing:", 100.0);
   glnx_console_unlock (&console);
 
   g_thread_join (g_steal_pointer (&commit_thread));
+  if (subtree_pool)
+    g_thread_pool_free (subtree_pool, FALSE, TRUE);
   if (!tdata.success)
-    return glnx_prefix_error (error, "While writing rootfs to mtree");
+    {
+      g_clear_error (&tdata.xattrs_error);
+      return glnx_prefix_error (error, "While writing rootfs to mtree");
+    }
+  if (tdata.xattrs_error)
+    {
+      g_propagate_error (error, g_steal_pointer (&tdata.xattrs_error));
+      return glnx_prefix_error (error, "While writing rootfs to mtree");
+    }
+
+  for (guint i = 0; i < subtrees->len; i++)
+    {
+      CommitWalk *subtree = subtrees->pdata[i];
+      if (subtree->error)
+        {
+          g_propagate_error (error, g_steal_pointer (&subtree->error));
+          return glnx_prefix_error (error, "While writing rootfs to mtree");
+        }
+      if (!graft_subtree (mtree, subtree, error))
+        return FALSE;
+    }
 
   g_autoptr(GFile) root_tree = NULL;
   if (!ostree_repo_write_mtree (repo, mtree, &root_tree, cancellable, error))
@@ -1839,6 +2571,28 @@ rpmostree_commit (int            rootfs_fd,
   if (!ostree_repo_commit_transaction (repo, &stats, cancellable, error))
     return glnx_prefix_error (error, "Commit");
 
+  if (use_cache)
+    {
+      GHashTable *seen = main_walk->cache_seen;
+      guint n_hits = g_hash_table_size (main_walk->cache_hits);
+      for (guint i = 0; i < subtrees->len; i++)
+        {
+          CommitWalk *subtree = subtrees->pdata[i];
+          GHashTableIter it;
+          gpointer path, entry;
+          g_hash_table_iter_init (&it, subtree->cache_seen);
+          while (g_hash_table_iter_next (&it, &path, &entry))
+            {
+              g_hash_table_iter_steal (&it);
+              g_hash_table_replace (seen, path, entry);
+            }
+          n_hits += g_hash_table_size (subtree->cache_hits);
+        }
+      if (!save_commit_cache (cachedir_dfd, sepolicy, seen, cancellable, error))
+        return glnx_prefix_error (error, "Saving commit cache");
+      g_print ("Commit cache hits: %u/%u\n", n_hits, g_hash_table_size (seen));
+    }
+
   g_print ("Metadata Total: %u\n", stats.metadata_objects_total);
   g_print ("Metadata Written: %u\n", stats.metadata_objects_written);
   g_print ("Content Total: %u\n", stats.content_objects_total);
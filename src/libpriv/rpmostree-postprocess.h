@@ -75,6 +75,9 @@ rpmostree_commit (int            rootfs_dfd,
                   const char    *gpg_keyid,
                   gboolean       enable_selinux,
                   OstreeRepoDevInoCache *devino_cache,
+                  int            cachedir_dfd, /* for the commit cache; -1 for none */
+                  guint          n_jobs,
+                  guint64        size_estimate, /* used for progress; 0 if unknown */
                   char         **out_new_revision,
                   GCancellable  *cancellable,
                   GError       **error);
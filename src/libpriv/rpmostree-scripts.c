@@ -24,10 +24,17 @@
 #include "rpmostree-output.h"
 #include "rpmostree-bwrap.h"
 #include <err.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <systemd/sd-journal.h>
 #include "libglnx.h"
 
 #include "rpmostree-scripts.h"
 
+#define RPMOSTREE_MESSAGE_SCRIPT_STATS SD_ID128_MAKE(2c,4f,3b,d1,5e,8a,4c,07,9b,61,d2,a4,7f,13,c8,e0)
+
 /* This bit is currently private in librpm */
 enum rpmscriptFlags_e {
   RPMSCRIPT_FLAG_NONE		= 0,
@@ -129,16 +136,436 @@ rpmostree_script_txn_validate (DnfPackage    *package,
   return TRUE;
 }
 
-/* Lowest level script handler in this file; create a bwrap instance and run it
- * synchronously.
+/* We need to make the mount point in the case where we're doing
+ * package layering, since the host `/var` tree is empty.  We
+ * *could* point at the real `/var`...but that seems
+ * unnecessary/dangerous to me.  Daemons that need to perform data
+ * migrations should do them as part of their systemd units and not
+ * in %post.
+ *
+ * Another alternative would be to make a tmpfs with the compat
+ * symlinks.
+ */
+static gboolean
+ensure_var_tmp (int        rootfs_fd,
+                gboolean  *out_created,
+                GError   **error)
+{
+  *out_created = FALSE;
+  if (mkdirat (rootfs_fd, "var/tmp", 0755) < 0)
+    {
+      if (errno != EEXIST)
+        return glnx_throw_errno_prefix (error, "mkdirat(var/tmp)");
+    }
+  else
+    *out_created = TRUE;
+  return TRUE;
+}
+
+/* How scripts are kept from modifying files hardlinked into the repo;
+ * rofiles-fuse by default, or RPMOSTREE_SCRIPT_SANDBOX=overlay to use a
+ * kernel overlay instead, which is faster for scripts that read a lot but
+ * needs privileges.
+ */
+static RpmOstreeBwrapMutability
+script_bwrap_mutability (void)
+{
+  const char *sandbox = g_getenv ("RPMOSTREE_SCRIPT_SANDBOX");
+  if (g_strcmp0 (sandbox, "overlay") == 0)
+    return RPMOSTREE_BWRAP_MUTATE_OVERLAY;
+  return RPMOSTREE_BWRAP_MUTATE_ROFILES;
+}
+
+static RpmOstreeBwrap *
+script_bwrap_new (int      rootfs_fd,
+                  GError **error)
+{
+  /* ⚠⚠⚠ If you change this, also update scripts/bwrap-script-shell.sh ⚠⚠⚠ */
+
+  /* We just did a ro bind mount over /var above. However we want a writable
+   * var/tmp, so we need to tmpfs mount on top of it. See also
+   * https://github.com/projectatomic/bubblewrap/issues/182
+   */
+  g_autoptr(RpmOstreeBwrap) bwrap =
+    rpmostree_bwrap_new (rootfs_fd, script_bwrap_mutability (), error,
+                         /* Scripts can see a /var with compat links like alternatives */
+                         "--ro-bind", "./var", "/var",
+                         "--tmpfs", "/var/tmp",
+                         NULL);
+  if (!bwrap)
+    return NULL;
+
+  /* Allow RPM scripts to change the /etc defaults; note we use bind
+   * to ensure symlinks work, see https://github.com/projectatomic/rpm-ostree/pull/640 */
+  const char *etc = glnx_strjoina (rpmostree_bwrap_get_usr_path (bwrap), "/etc");
+  rpmostree_bwrap_append_bwrap_argv (bwrap, "--bind", etc, "/etc", NULL);
+
+  return g_steal_pointer (&bwrap);
+}
+
+/* A script session is a single long-lived container (one rofiles-fuse mount,
+ * one bwrap) in which we run every script of a transaction, rather than
+ * paying the setup cost for each one.  Inside, a shell loop reads requests
+ * from stdin, three lines each (interpreter, script path, argument), and
+ * writes each script's exit status back on fd 3, followed by the output of
+ * `times` so we can account CPU time.  Both ends are the same socket.
+ * Scripts get /dev/null as stdin so they can't eat the queue.
+ */
+static const char script_session_runner[] =
+  "while IFS= read -r interp && IFS= read -r script && IFS= read -r arg; do\n"
+  "  rc=0\n"
+  "  \"$interp\" \"$script\" \"$arg\" </dev/null 3>&- || rc=$?\n"
+  "  echo \"$rc\" >&3\n"
+  "  times >&3\n"
+  "done\n";
+
+struct RpmOstreeScriptSession {
+  int rootfs_fd;
+  gboolean created_var_tmp;
+  RpmOstreeBwrap *bwrap;
+  GPid pid;
+  pid_t runner_pid; /* The shell inside bwrap; 0 if not found yet */
+  int sock_fd;
+  guint64 children_cpu_usec; /* As of the last script */
+};
+
+/* How often to sample the memory use of a script running in a session */
+#define SCRIPT_SESSION_SAMPLE_MSEC 100
+
+void
+rpmostree_script_stats_free (RpmOstreeScriptStats *stats)
+{
+  g_free (stats->pkgname);
+  g_free (stats);
+}
+
+static guint64
+timeval_to_usec (const struct timeval *tv)
+{
+  return (guint64)tv->tv_sec * G_USEC_PER_SEC + tv->tv_usec;
+}
+
+static void
+script_session_child_setup (gpointer data)
+{
+  int fd = GPOINTER_TO_INT (data);
+
+  /* Our end of the socket is both the request queue and the status fd */
+  if (dup2 (fd, 0) < 0 || dup2 (0, 3) < 0)
+    err (1, "dup2");
+}
+
+/* The runner is itself a shell script, so we need one in the target.  Also,
+ * with an overlay, changes are only merged back once the container exits;
+ * but we modify files between scripts (e.g. applying rpmfi overrides), so
+ * use a container per script there.
+ */
+gboolean
+rpmostree_script_session_supported (int rootfs_fd)
+{
+  if (script_bwrap_mutability () == RPMOSTREE_BWRAP_MUTATE_OVERLAY)
+    return FALSE;
+  return faccessat (rootfs_fd, "usr/bin/sh", X_OK, 0) == 0;
+}
+
+RpmOstreeScriptSession *
+rpmostree_script_session_new (int      rootfs_fd,
+                              GError **error)
+{
+  g_autoptr(RpmOstreeScriptSession) session = g_new0 (RpmOstreeScriptSession, 1);
+  session->rootfs_fd = rootfs_fd;
+  session->sock_fd = -1;
+
+  int sockets[2];
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0)
+    return glnx_null_throw_errno_prefix (error, "socketpair");
+  session->sock_fd = sockets[0];
+  glnx_fd_close int child_fd = sockets[1];
+
+  if (!ensure_var_tmp (rootfs_fd, &session->created_var_tmp, error))
+    return NULL;
+
+  session->bwrap = script_bwrap_new (rootfs_fd, error);
+  if (!session->bwrap)
+    return NULL;
+
+  rpmostree_bwrap_append_child_argv (session->bwrap, "/bin/sh", "-c",
+                                     script_session_runner, NULL);
+  rpmostree_bwrap_set_child_setup (session->bwrap, script_session_child_setup,
+                                   GINT_TO_POINTER (child_fd));
+  if (!rpmostree_bwrap_spawn (session->bwrap, &session->pid, error))
+    {
+      g_prefix_error (error, "Starting script session: ");
+      return NULL;
+    }
+
+  return g_steal_pointer (&session);
+}
+
+static gboolean
+script_session_wait (RpmOstreeScriptSession *session,
+                     int                    *out_estatus,
+                     GError                **error)
+{
+  g_assert_cmpint (session->pid, >, 0);
+  pid_t r = TEMP_FAILURE_RETRY (waitpid (session->pid, out_estatus, 0));
+  session->pid = 0;
+  if (r < 0)
+    return glnx_throw_errno_prefix (error, "waitpid");
+  return TRUE;
+}
+
+/* Tell the runner there's nothing left to do and wait for it to exit */
+gboolean
+rpmostree_script_session_finish (RpmOstreeScriptSession *session,
+                                 GError                **error)
+{
+  if (shutdown (session->sock_fd, SHUT_WR) < 0)
+    return glnx_throw_errno_prefix (error, "shutdown");
+
+  int estatus;
+  if (!script_session_wait (session, &estatus, error))
+    return FALSE;
+  if (!g_spawn_check_exit_status (estatus, error))
+    return glnx_prefix_error (error, "Script session");
+  if (!rpmostree_bwrap_finish (session->bwrap, NULL, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+void
+rpmostree_script_session_free (RpmOstreeScriptSession *session)
+{
+  if (!session)
+    return;
+
+  /* Closing the queue makes the runner exit once it's done with the
+   * current script, if any. */
+  if (session->sock_fd >= 0)
+    (void) close (session->sock_fd);
+  if (session->pid > 0)
+    {
+      int estatus;
+      (void) script_session_wait (session, &estatus, NULL);
+    }
+  /* This unmounts rofiles, so only after the container is gone */
+  g_clear_pointer (&session->bwrap, rpmostree_bwrap_unref);
+  if (session->created_var_tmp)
+    (void) unlinkat (session->rootfs_fd, "var/tmp", AT_REMOVEDIR);
+  g_free (session);
+}
+
+static gboolean
+script_session_read_line (RpmOstreeScriptSession *session,
+                          char                   *buf,
+                          size_t                  bufsize,
+                          GError                **error)
+{
+  size_t len = 0;
+  while (TRUE)
+    {
+      if (len == bufsize - 1)
+        return glnx_throw (error, "Invalid status from script session");
+      ssize_t n = TEMP_FAILURE_RETRY (read (session->sock_fd, buf + len, 1));
+      if (n < 0)
+        return glnx_throw_errno_prefix (error, "Reading script status");
+      if (n == 0)
+        return glnx_throw (error, "Script session exited unexpectedly");
+      if (buf[len] == '\n')
+        break;
+      len++;
+    }
+  buf[len] = '\0';
+  return TRUE;
+}
+
+/* Parse a line of `times` output, e.g. "0m0.003s 0m0.001s" (bash) or
+ * "0m0.003000s 0m0.001000s" (dash), into the sum of user and system time.
+ */
+static gboolean
+parse_times_line (const char *line,
+                  guint64    *out_usec)
+{
+  guint umin, smin;
+  double usec, ssec;
+  if (sscanf (line, "%um%lfs %um%lfs", &umin, &usec, &smin, &ssec) != 4)
+    return FALSE;
+  *out_usec = (guint64)((umin * 60 + usec + smin * 60 + ssec) * G_USEC_PER_SEC);
+  return TRUE;
+}
+
+static char *
+proc_read_file (pid_t       pid,
+                const char *name)
+{
+  g_autofree char *path = g_strdup_printf ("/proc/%d/%s", (int)pid, name);
+  return glnx_file_get_contents_utf8_at (AT_FDCWD, path, NULL, NULL, NULL);
+}
+
+/* Append the children of @pid (from all its threads) to @pids; processes may
+ * exit at any time, so errors just mean fewer results.
+ */
+static void
+proc_append_children (pid_t   pid,
+                      GArray *pids)
+{
+  g_autofree char *taskdir = g_strdup_printf ("/proc/%d/task", (int)pid);
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, taskdir, FALSE, &dfd_iter, NULL))
+    return;
+
+  while (TRUE)
+    {
+      struct dirent *dent = NULL;
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, NULL, NULL) || !dent)
+        break;
+      g_autofree char *path = g_strconcat (dent->d_name, "/children", NULL);
+      g_autofree char *contents =
+        glnx_file_get_contents_utf8_at (dfd_iter.fd, path, NULL, NULL, NULL);
+      if (!contents)
+        continue;
+      g_auto(GStrv) children = g_strsplit (g_strstrip (contents), " ", -1);
+      for (char **iter = children; iter && *iter; iter++)
+        {
+          pid_t child = (pid_t) g_ascii_strtoull (*iter, NULL, 10);
+          if (child > 0)
+            g_array_append_val (pids, child);
+        }
+    }
+}
+
+/* Find the runner shell, i.e. the first process under the bwrap we spawned
+ * which isn't bwrap itself (with --unshare-pid, there's one more bwrap as
+ * pid 1 of the namespace).
+ */
+static pid_t
+script_session_find_runner (RpmOstreeScriptSession *session)
+{
+  pid_t pid = session->pid;
+  while (TRUE)
+    {
+      g_autofree char *comm = proc_read_file (pid, "comm");
+      if (!comm)
+        return 0;
+      if (!g_str_equal (g_strchomp (comm), "bwrap"))
+        return pid;
+
+      g_autoptr(GArray) children = g_array_new (FALSE, FALSE, sizeof (pid_t));
+      proc_append_children (pid, children);
+      if (children->len != 1)
+        return 0;
+      pid = g_array_index (children, pid_t, 0);
+    }
+}
+
+/* Return the highest VmHWM in kB of any process the runner is currently
+ * running, i.e. of the current script and its children; 0 if none.
+ */
+static guint64
+script_session_sample_maxrss (RpmOstreeScriptSession *session)
+{
+  if (session->runner_pid == 0)
+    session->runner_pid = script_session_find_runner (session);
+  if (session->runner_pid == 0)
+    return 0;
+
+  guint64 maxrss_kb = 0;
+  g_autoptr(GArray) pids = g_array_new (FALSE, FALSE, sizeof (pid_t));
+  proc_append_children (session->runner_pid, pids);
+  /* Note this grows as we go, covering the whole tree */
+  for (guint i = 0; i < pids->len; i++)
+    {
+      const pid_t pid = g_array_index (pids, pid_t, i);
+      g_autofree char *status = proc_read_file (pid, "status");
+      const char *hwm = status ? strstr (status, "\nVmHWM:") : NULL;
+      if (hwm)
+        maxrss_kb = MAX (maxrss_kb, g_ascii_strtoull (hwm + strlen ("\nVmHWM:"), NULL, 10));
+      proc_append_children (pid, pids);
+    }
+
+  return maxrss_kb;
+}
+
+static gboolean
+run_script_in_session (RpmOstreeScriptSession *session,
+                       const char             *interp,
+                       const char             *script_path,
+                       const char             *script_arg,
+                       RpmOstreeScriptStats   *stats,
+                       GError                **error)
+{
+  g_autofree char *request = g_strdup_printf ("%s\n%s\n%s\n", interp, script_path, script_arg);
+  const char *p = request;
+  size_t remaining = strlen (request);
+  while (remaining > 0)
+    {
+      /* MSG_NOSIGNAL so that a dead runner is an error rather than SIGPIPE */
+      ssize_t n = TEMP_FAILURE_RETRY (send (session->sock_fd, p, remaining, MSG_NOSIGNAL));
+      if (n < 0)
+        return glnx_throw_errno_prefix (error, "Sending script to session");
+      p += n;
+      remaining -= n;
+    }
+
+  /* The script isn't our child, so there's no rusage for it; instead sample
+   * the peak RSS of its processes until it's done.  Anything shorter-lived
+   * than the interval is missed, which is fine for finding the scripts that
+   * need a lot of memory.
+   */
+  while (TRUE)
+    {
+      struct pollfd pfd = { .fd = session->sock_fd, .events = POLLIN };
+      int r = TEMP_FAILURE_RETRY (poll (&pfd, 1, SCRIPT_SESSION_SAMPLE_MSEC));
+      if (r < 0)
+        return glnx_throw_errno_prefix (error, "poll");
+      if (r > 0)
+        break;
+      stats->maxrss_kb = MAX (stats->maxrss_kb, script_session_sample_maxrss (session));
+    }
+
+  char status[16];
+  if (!script_session_read_line (session, status, sizeof (status), error))
+    return FALSE;
+
+  char *endp = NULL;
+  guint64 rc = g_ascii_strtoull (status, &endp, 10);
+  if (endp == status || *endp != '\0')
+    return glnx_throw (error, "Invalid status from script session: %s", status);
+  if (rc != 0)
+    return glnx_throw (error, "Executing %s: Child process exited with code %u",
+                       interp, (guint)rc);
+
+  /* The first line of `times` is the shell itself, the second its children,
+   * cumulative; so the delta is what this script used.
+   */
+  char times[64];
+  if (!script_session_read_line (session, times, sizeof (times), error) ||
+      !script_session_read_line (session, times, sizeof (times), error))
+    return FALSE;
+  guint64 children_cpu_usec;
+  if (parse_times_line (times, &children_cpu_usec))
+    {
+      if (children_cpu_usec > session->children_cpu_usec)
+        stats->cpu_usec = children_cpu_usec - session->children_cpu_usec;
+      session->children_cpu_usec = children_cpu_usec;
+    }
+
+  return TRUE;
+}
+
+/* Lowest level script handler in this file; run the script synchronously,
+ * either in @session if provided, or in a new bwrap instance.
  */
 static gboolean
 run_script_in_bwrap_container (int rootfs_fd,
+                               RpmOstreeScriptSession *session,
                                const char *name,
                                const char *scriptdesc,
                                const char *interp,
                                const char *script,
                                const char *script_arg,
+                               RpmOstreeScriptStats *stats,
                                GCancellable  *cancellable,
                                GError       **error)
 {
@@ -162,54 +589,56 @@ run_script_in_bwrap_container (int rootfs_fd,
       goto out;
     }
 
-  /* We need to make the mount point in the case where we're doing
-   * package layering, since the host `/var` tree is empty.  We
-   * *could* point at the real `/var`...but that seems
-   * unnecessary/dangerous to me.  Daemons that need to perform data
-   * migrations should do them as part of their systemd units and not
-   * in %post.
-   *
-   * Another alternative would be to make a tmpfs with the compat
-   * symlinks.
-   */
-  if (mkdirat (rootfs_fd, "var/tmp", 0755) < 0)
+  if (session)
     {
-      if (errno == EEXIST)
-        ;
-      else
-        {
-          glnx_set_error_from_errno (error);
-          goto out;
-        }
+      const gint64 start_time = g_get_monotonic_time ();
+      if (!run_script_in_session (session, interp, postscript_path_container,
+                                  script_arg, stats, error))
+        goto out;
+      stats->wall_usec = g_get_monotonic_time () - start_time;
     }
   else
-    created_var_tmp = TRUE;
+    {
+      if (!ensure_var_tmp (rootfs_fd, &created_var_tmp, error))
+        goto out;
 
-  /* ⚠⚠⚠ If you change this, also update scripts/bwrap-script-shell.sh ⚠⚠⚠ */
+      bwrap = script_bwrap_new (rootfs_fd, error);
+      if (!bwrap)
+        goto out;
 
-  /* We just did a ro bind mount over /var above. However we want a writable
-   * var/tmp, so we need to tmpfs mount on top of it. See also
-   * https://github.com/projectatomic/bubblewrap/issues/182
-   */
-  bwrap = rpmostree_bwrap_new (rootfs_fd, RPMOSTREE_BWRAP_MUTATE_ROFILES, error,
-                               /* Scripts can see a /var with compat links like alternatives */
-                               "--ro-bind", "./var", "/var",
-                               "--tmpfs", "/var/tmp",
-                               /* Allow RPM scripts to change the /etc defaults; note we use bind
-                                * to ensure symlinks work, see https://github.com/projectatomic/rpm-ostree/pull/640 */
-                               "--bind", "./usr/etc", "/etc",
-                               NULL);
-  if (!bwrap)
-    goto out;
+      rpmostree_bwrap_append_child_argv (bwrap,
+                                         interp,
+                                         postscript_path_container,
+                                         script_arg,
+                                         NULL);
+
+      /* Reap it ourselves so we get its resource usage; on Linux this
+       * covers the whole container, since bwrap reaps everything in it.
+       */
+      GPid pid;
+      const gint64 start_time = g_get_monotonic_time ();
+      if (!rpmostree_bwrap_spawn (bwrap, &pid, error))
+        goto out;
+      int estatus;
+      struct rusage ru;
+      if (TEMP_FAILURE_RETRY (wait4 (pid, &estatus, 0, &ru)) < 0)
+        {
+          glnx_throw_errno_prefix (error, "wait4");
+          goto out;
+        }
+      stats->wall_usec = g_get_monotonic_time () - start_time;
+      if (!g_spawn_check_exit_status (estatus, error))
+        {
+          g_prefix_error (error, "Executing bwrap(%s): ", interp);
+          goto out;
+        }
 
-  rpmostree_bwrap_append_child_argv (bwrap,
-                                     interp,
-                                     postscript_path_container,
-                                     script_arg,
-                                     NULL);
+      stats->cpu_usec = timeval_to_usec (&ru.ru_utime) + timeval_to_usec (&ru.ru_stime);
+      stats->maxrss_kb = ru.ru_maxrss;
 
-  if (!rpmostree_bwrap_run (bwrap, error))
-    goto out;
+      if (!rpmostree_bwrap_finish (bwrap, cancellable, error))
+        goto out;
+    }
 
   ret = TRUE;
  out:
@@ -219,6 +648,235 @@ run_script_in_bwrap_container (int rootfs_fd,
   return ret;
 }
 
+static void
+record_script_stats (RpmOstreeScriptStats *stats,
+                     const char           *pkgname,
+                     const char           *scriptdesc,
+                     GPtrArray            *all_stats)
+{
+  g_autoptr(RpmOstreeScriptStats) owned_stats = stats;
+  /* Leave the field out rather than logging 0 when we don't know, i.e. when
+   * a script in a session finished before we sampled it; as the last
+   * argument, NULL just ends the list early. */
+  g_autofree char *maxrss_field = NULL;
+  if (stats->maxrss_kb > 0)
+    maxrss_field = g_strdup_printf ("SCRIPT_MAXRSS_KB=%" G_GUINT64_FORMAT, stats->maxrss_kb);
+
+  sd_journal_send ("MESSAGE_ID=" SD_ID128_FORMAT_STR,
+                   SD_ID128_FORMAT_VAL(RPMOSTREE_MESSAGE_SCRIPT_STATS),
+                   "MESSAGE=Ran %s for %s in %.1fs", scriptdesc, pkgname,
+                   stats->wall_usec / (double) G_USEC_PER_SEC,
+                   "SCRIPT_PKG=%s", pkgname,
+                   "SCRIPT_TYPE=%s", scriptdesc,
+                   "SCRIPT_WALL_USEC=%" G_GUINT64_FORMAT, stats->wall_usec,
+                   "SCRIPT_CPU_USEC=%" G_GUINT64_FORMAT, stats->cpu_usec,
+                   maxrss_field,
+                   NULL);
+
+  if (all_stats)
+    {
+      stats->pkgname = g_strdup (pkgname);
+      stats->scriptdesc = scriptdesc;
+      g_ptr_array_add (all_stats, g_steal_pointer (&owned_stats));
+    }
+}
+
+void
+rpmostree_deferred_trigger_free (RpmOstreeDeferredTrigger *trigger)
+{
+  if (!trigger)
+    return;
+  g_free (trigger->command);
+  g_free (trigger);
+}
+
+static RpmOstreeDeferredTrigger *
+find_deferred_trigger (GPtrArray  *triggers,
+                       const char *command)
+{
+  for (guint i = 0; i < triggers->len; i++)
+    {
+      RpmOstreeDeferredTrigger *trigger = triggers->pdata[i];
+      if (g_str_equal (trigger->command, command))
+        return trigger;
+    }
+  return NULL;
+}
+
+/* Suffixes that don't change what a trigger command does.  Order matters: we
+ * need to try e.g. "2>/dev/null" before ">/dev/null".
+ */
+static const char *const trigger_line_noise[] = {
+  "&>/dev/null", "&> /dev/null",
+  ">/dev/null 2>&1", "> /dev/null 2>&1",
+  "2>/dev/null", "2> /dev/null",
+  ">/dev/null", "> /dev/null",
+};
+static const char *const trigger_line_may_fail[] = { "|| :", "|| true" };
+
+/* Strip comments, output redirections and error suppression from a script
+ * line, and squash whitespace, so it can be looked up in the trigger table.
+ */
+static char *
+normalize_trigger_line (const char *line,
+                        gboolean   *out_may_fail)
+{
+  g_autofree char *buf = g_strdup (line);
+  gboolean may_fail = FALSE;
+  gboolean changed = TRUE;
+
+  /* A # starting a word starts a comment; anything quoted won't be in the
+   * table anyway */
+  for (char *p = buf; *p; p++)
+    {
+      if (*p == '#' && (p == buf || *(p-1) == ' ' || *(p-1) == '\t'))
+        {
+          *p = '\0';
+          break;
+        }
+    }
+  g_strstrip (buf);
+
+  while (changed)
+    {
+      changed = FALSE;
+      for (guint i = 0; i < G_N_ELEMENTS (trigger_line_may_fail) && !changed; i++)
+        {
+          if (g_str_has_suffix (buf, trigger_line_may_fail[i]))
+            {
+              buf[strlen (buf) - strlen (trigger_line_may_fail[i])] = '\0';
+              may_fail = changed = TRUE;
+            }
+        }
+      for (guint i = 0; i < G_N_ELEMENTS (trigger_line_noise) && !changed; i++)
+        {
+          if (g_str_has_suffix (buf, trigger_line_noise[i]))
+            {
+              buf[strlen (buf) - strlen (trigger_line_noise[i])] = '\0';
+              changed = TRUE;
+            }
+        }
+      g_strchomp (buf);
+    }
+
+  g_auto(GStrv) words = g_strsplit_set (buf, " \t", -1);
+  g_autoptr(GString) normalized = g_string_new ("");
+  for (char **it = words; it && *it; it++)
+    {
+      if (!**it)
+        continue;
+      if (normalized->len > 0)
+        g_string_append_c (normalized, ' ');
+      g_string_append (normalized, *it);
+    }
+
+  *out_may_fail = may_fail;
+  return g_string_free (g_steal_pointer (&normalized), FALSE);
+}
+
+/* If the script line @line only runs a command from the trigger table, return
+ * what to run once at the end instead, and whether the line ignores errors
+ * from it in @out_may_fail; otherwise %NULL.
+ */
+const char *
+rpmostree_script_trigger_for_line (const char *line,
+                                   gboolean   *out_may_fail)
+{
+  g_autofree char *normalized = normalize_trigger_line (line, out_may_fail);
+  const struct RpmOstreeScriptTriggerCommand *entry =
+    rpmostree_script_trigger_gperf_lookup (normalized, strlen (normalized));
+  return entry ? entry->command : NULL;
+}
+
+static gboolean
+add_trigger_line (GPtrArray  *triggers,
+                  const char *line)
+{
+  gboolean may_fail;
+  const char *command = rpmostree_script_trigger_for_line (line, &may_fail);
+  if (!command)
+    return FALSE;
+
+  RpmOstreeDeferredTrigger *trigger = find_deferred_trigger (triggers, command);
+  if (trigger)
+    {
+      /* It's only OK to fail if everyone said so */
+      trigger->may_fail = trigger->may_fail && may_fail;
+      return TRUE;
+    }
+
+  trigger = g_new0 (RpmOstreeDeferredTrigger, 1);
+  trigger->command = g_strdup (command);
+  trigger->may_fail = may_fail;
+  g_ptr_array_add (triggers, trigger);
+  return TRUE;
+}
+
+/* Many %post scripts consist only of a command which regenerates some global
+ * cache, like ldconfig or glib-compile-schemas.  Running those once per
+ * package is wasted work; rpm itself moved to file triggers for the same
+ * reason.  If a script is entirely made of commands from the trigger table
+ * (or directly runs one, as with `%post -p /sbin/ldconfig`), add them to
+ * @deferred and return %TRUE; they get run once, after all other scripts, by
+ * rpmostree_script_run_deferred_triggers().
+ */
+static gboolean
+defer_trigger_script (const KnownRpmScriptKind *rpmscript,
+                      Header                    hdr,
+                      GPtrArray                *deferred)
+{
+  struct rpmtd_s td;
+  g_autofree char **args = NULL;
+  if (headerGet (hdr, rpmscript->progtag, &td, (HEADERGET_ALLOC|HEADERGET_ARGV)))
+    args = td.data;
+  const char *script = headerGetString (hdr, rpmscript->tag);
+
+  g_autoptr(GPtrArray) found =
+    g_ptr_array_new_with_free_func ((GDestroyNotify)rpmostree_deferred_trigger_free);
+  if (!script)
+    {
+      if (!(args && args[0]))
+        return FALSE;
+      g_autofree char *cmdline = g_strjoinv (" ", args);
+      if (!add_trigger_line (found, cmdline))
+        return FALSE;
+    }
+  else
+    {
+      const char *interp = (args && args[0]) ? args[0] : "/bin/sh";
+      if (!(g_str_equal (interp, "/bin/sh") || g_str_equal (interp, "/usr/bin/sh") ||
+            g_str_equal (interp, "/bin/bash") || g_str_equal (interp, "/usr/bin/bash")))
+        return FALSE;
+      /* Don't try to be clever about macros */
+      if (headerGetNumber (hdr, rpmscript->flagtag) & RPMSCRIPT_FLAG_EXPAND)
+        return FALSE;
+
+      g_auto(GStrv) lines = g_strsplit (script, "\n", -1);
+      for (char **it = lines; *it; it++)
+        {
+          const char *line = g_strstrip (*it);
+          if (!*line || *line == '#')
+            continue;
+          if (!add_trigger_line (found, line))
+            return FALSE;
+        }
+      if (found->len == 0)
+        return FALSE;
+    }
+
+  for (guint i = 0; i < found->len; i++)
+    {
+      RpmOstreeDeferredTrigger *trigger = found->pdata[i];
+      RpmOstreeDeferredTrigger *existing = find_deferred_trigger (deferred, trigger->command);
+      if (existing)
+        existing->may_fail = existing->may_fail && trigger->may_fail;
+      else
+        g_ptr_array_add (deferred, g_steal_pointer (&found->pdata[i]));
+    }
+
+  return TRUE;
+}
+
 /* Medium level script entrypoint; we already validated it exists and isn't
  * ignored. Here we mostly compute arguments/input, then proceed into the lower
  * level bwrap execution.
@@ -228,6 +886,8 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript,
                      DnfPackage    *pkg,
                      Header         hdr,
                      int            rootfs_fd,
+                     RpmOstreeScriptSession *session,
+                     GPtrArray     *all_stats,
                      GCancellable  *cancellable,
                      GError       **error)
 {
@@ -275,10 +935,14 @@ impl_run_rpm_script (const KnownRpmScriptKind *rpmscript,
       break;
     }
 
-  if (!run_script_in_bwrap_container (rootfs_fd, dnf_package_get_name (pkg),
+  const char *pkgname = dnf_package_get_name (pkg);
+  g_autoptr(RpmOstreeScriptStats) stats = g_new0 (RpmOstreeScriptStats, 1);
+  if (!run_script_in_bwrap_container (rootfs_fd, session, pkgname,
                                       rpmscript->desc, interp, script, script_arg,
-                                      cancellable, error))
-    return glnx_prefix_error (error, "Running %s for %s", rpmscript->desc, dnf_package_get_name (pkg));
+                                      stats, cancellable, error))
+    return glnx_prefix_error (error, "Running %s for %s", rpmscript->desc, pkgname);
+
+  record_script_stats (g_steal_pointer (&stats), pkgname, rpmscript->desc, all_stats);
   return TRUE;
 }
 
@@ -290,6 +954,9 @@ run_script (const KnownRpmScriptKind *rpmscript,
             DnfPackage               *pkg,
             Header                    hdr,
             int                       rootfs_fd,
+            RpmOstreeScriptSession   *session,
+            GPtrArray                *all_stats,
+            GPtrArray                *deferred_triggers,
             GCancellable             *cancellable,
             GError                  **error)
 {
@@ -299,10 +966,6 @@ run_script (const KnownRpmScriptKind *rpmscript,
   if (!(headerIsEntry (hdr, tagval) || headerIsEntry (hdr, progtagval)))
     return TRUE;
 
-  const char *script = headerGetString (hdr, tagval);
-  if (!script)
-    return TRUE;
-
   const char *desc = rpmscript->desc;
   RpmOstreeScriptAction action = lookup_script_action (pkg, desc);
   switch (action)
@@ -313,7 +976,14 @@ run_script (const KnownRpmScriptKind *rpmscript,
       break; /* Continue below */
     }
 
-  return impl_run_rpm_script (rpmscript, pkg, hdr, rootfs_fd,
+  if (deferred_triggers && defer_trigger_script (rpmscript, hdr, deferred_triggers))
+    return TRUE;
+
+  const char *script = headerGetString (hdr, tagval);
+  if (!script)
+    return TRUE;
+
+  return impl_run_rpm_script (rpmscript, pkg, hdr, rootfs_fd, session, all_stats,
                               cancellable, error);
 }
 
@@ -321,13 +991,16 @@ gboolean
 rpmostree_posttrans_run_sync (DnfPackage    *pkg,
                               Header         hdr,
                               int            rootfs_fd,
+                              RpmOstreeScriptSession *session,
+                              GPtrArray     *all_stats,
+                              GPtrArray     *deferred_triggers,
                               GCancellable  *cancellable,
                               GError       **error)
 {
   for (guint i = 0; i < G_N_ELEMENTS (posttrans_scripts); i++)
     {
-      if (!run_script (&posttrans_scripts[i], pkg, hdr, rootfs_fd,
-                       cancellable, error))
+      if (!run_script (&posttrans_scripts[i], pkg, hdr, rootfs_fd, session,
+                       all_stats, deferred_triggers, cancellable, error))
         return FALSE;
     }
 
@@ -338,15 +1011,45 @@ gboolean
 rpmostree_pre_run_sync (DnfPackage    *pkg,
                         Header         hdr,
                         int            rootfs_fd,
+                        RpmOstreeScriptSession *session,
+                        GPtrArray     *all_stats,
                         GCancellable  *cancellable,
                         GError       **error)
 {
   for (guint i = 0; i < G_N_ELEMENTS (pre_scripts); i++)
     {
-      if (!run_script (&pre_scripts[i], pkg, hdr, rootfs_fd,
-                       cancellable, error))
+      if (!run_script (&pre_scripts[i], pkg, hdr, rootfs_fd, session,
+                       all_stats, NULL, cancellable, error))
         return FALSE;
     }
 
   return TRUE;
 }
+
+/* Run the commands collected by rpmostree_posttrans_run_sync(), once each */
+gboolean
+rpmostree_script_run_deferred_triggers (GPtrArray              *deferred_triggers,
+                                        int                     rootfs_fd,
+                                        RpmOstreeScriptSession *session,
+                                        GPtrArray              *all_stats,
+                                        GCancellable           *cancellable,
+                                        GError                **error)
+{
+  for (guint i = 0; i < deferred_triggers->len; i++)
+    {
+      RpmOstreeDeferredTrigger *trigger = deferred_triggers->pdata[i];
+      g_autofree char *script =
+        g_strconcat (trigger->command, trigger->may_fail ? " || :" : "", "\n", NULL);
+
+      g_autoptr(RpmOstreeScriptStats) stats = g_new0 (RpmOstreeScriptStats, 1);
+      if (!run_script_in_bwrap_container (rootfs_fd, session, "rpmostree-trigger",
+                                          "%posttrans", "/bin/sh", script, "1",
+                                          stats, cancellable, error))
+        return glnx_prefix_error (error, "Running deferred %s", trigger->command);
+
+      record_script_stats (g_steal_pointer (&stats), trigger->command,
+                           "%posttrans (deferred)", all_stats);
+    }
+
+  return TRUE;
+}
@@ -45,6 +45,58 @@ struct RpmOstreePackageScriptHandler {
 
 const struct RpmOstreePackageScriptHandler* rpmostree_script_gperf_lookup(const char *key, GPERF_LEN_TYPE length);
 
+struct RpmOstreeScriptTriggerCommand {
+  const char *command_line;
+  const char *command;
+};
+
+const struct RpmOstreeScriptTriggerCommand* rpmostree_script_trigger_gperf_lookup(const char *key, GPERF_LEN_TYPE length);
+
+/* A command from the trigger table to run once after all other scripts */
+typedef struct {
+  char *command;
+  gboolean may_fail; /* All scripts which wanted it ignored errors */
+} RpmOstreeDeferredTrigger;
+
+void
+rpmostree_deferred_trigger_free (RpmOstreeDeferredTrigger *trigger);
+
+const char *
+rpmostree_script_trigger_for_line (const char *line,
+                                   gboolean   *out_may_fail);
+
+typedef struct RpmOstreeScriptSession RpmOstreeScriptSession;
+
+/* Resource usage of a single script run */
+typedef struct {
+  char *pkgname;
+  const char *scriptdesc; /* e.g. "%post" */
+  guint64 wall_usec;
+  guint64 cpu_usec;
+  guint64 maxrss_kb; /* 0 if unknown */
+} RpmOstreeScriptStats;
+
+void
+rpmostree_script_stats_free (RpmOstreeScriptStats *stats);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RpmOstreeScriptStats, rpmostree_script_stats_free)
+
+gboolean
+rpmostree_script_session_supported (int rootfs_fd);
+
+RpmOstreeScriptSession *
+rpmostree_script_session_new (int      rootfs_fd,
+                              GError **error);
+
+gboolean
+rpmostree_script_session_finish (RpmOstreeScriptSession *session,
+                                 GError                **error);
+
+void
+rpmostree_script_session_free (RpmOstreeScriptSession *session);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RpmOstreeScriptSession, rpmostree_script_session_free)
+
 gboolean
 rpmostree_script_txn_validate (DnfPackage    *package,
                                Header         hdr,
@@ -55,12 +107,25 @@ gboolean
 rpmostree_posttrans_run_sync (DnfPackage    *pkg,
                               Header         hdr,
                               int            rootfs_fd,
+                              RpmOstreeScriptSession *session,
+                              GPtrArray     *all_stats,
+                              GPtrArray     *deferred_triggers,
                               GCancellable  *cancellable,
                               GError       **error);
 
+gboolean
+rpmostree_script_run_deferred_triggers (GPtrArray              *deferred_triggers,
+                                        int                     rootfs_fd,
+                                        RpmOstreeScriptSession *session,
+                                        GPtrArray              *all_stats,
+                                        GCancellable           *cancellable,
+                                        GError                **error);
+
 gboolean
 rpmostree_pre_run_sync (DnfPackage    *pkg,
                         Header         hdr,
                         int            rootfs_fd,
+                        RpmOstreeScriptSession *session,
+                        GPtrArray     *all_stats,
                         GCancellable  *cancellable,
                         GError       **error);
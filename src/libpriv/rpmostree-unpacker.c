@@ -62,6 +62,8 @@ struct RpmOstreeUnpacker
   RpmOstreeUnpackerFlags flags;
   DnfPackage *pkg;
   char *hdr_sha256;
+  char *repodata_chksum_repr;
+  char *repo_id;
 
   char *ostree_branch;
 };
@@ -94,6 +96,9 @@ rpmostree_unpacker_finalize (GObject *object)
   g_hash_table_unref (self->rpmfi_overrides);
 
   g_free (self->hdr_sha256);
+  g_free (self->repodata_chksum_repr);
+  g_free (self->repo_id);
+  g_clear_object (&self->pkg);
 
   G_OBJECT_CLASS (rpmostree_unpacker_parent_class)->finalize (object);
 }
@@ -291,6 +296,13 @@ rpmostree_unpacker_new_fd (int fd,
   rpmfi fi = NULL;
   struct archive *archive;
   gsize cpio_offset;
+  g_autofree char *chksum_repr = NULL;
+
+  /* Look these up now rather than at commit time; libsolv isn't safe to
+   * query from the import worker threads. */
+  if (pkg && !rpmostree_get_repodata_chksum_repr (pkg, &chksum_repr, error))
+    return NULL;
+  DnfRepo *repo = pkg ? dnf_package_get_repo (pkg) : NULL;
 
   archive = rpm2cpio (fd, error);
   if (archive == NULL)
@@ -307,6 +319,8 @@ rpmostree_unpacker_new_fd (int fd,
   ret->hdr = g_steal_pointer (&hdr);
   ret->cpio_offset = cpio_offset;
   ret->pkg = pkg ? g_object_ref (pkg) : NULL;
+  ret->repodata_chksum_repr = g_steal_pointer (&chksum_repr);
+  ret->repo_id = repo ? g_strdup (dnf_repo_get_id (repo)) : NULL;
 
   build_rpmfi_overrides (ret);
 
@@ -414,7 +428,7 @@ get_lead_sig_header_as_bytes (RpmOstreeUnpacker *self,
 }
 
 static GVariant *
-repo_metadata_to_variant (DnfRepo *repo)
+repo_metadata_to_variant (const char *repo_id)
 {
   g_auto(GVariantBuilder) builder;
   g_variant_builder_init (&builder, (GVariantType*)"a{sv}");
@@ -423,7 +437,7 @@ repo_metadata_to_variant (DnfRepo *repo)
    * enough to provide useful semantics.
    */
   g_variant_builder_add (&builder, "{sv}",
-                         "id", g_variant_new_string (dnf_repo_get_id (repo)));
+                         "id", g_variant_new_string (repo_id));
 
   return g_variant_builder_end (&builder);
 }
@@ -485,6 +499,30 @@ build_metadata_variant (RpmOstreeUnpacker *self,
                            g_variant_new_string
                              (ostree_sepolicy_get_csum (sepolicy)));
 
+  /* Record the (usually few) files that need their ownership fixed up at
+   * assembly time, so that we don't have to scan the whole rpmfi there; see
+   * apply_rpmfi_overrides() in rpmostree-core.c. */
+  {
+    g_auto(GVariantBuilder) overrides_builder;
+    g_variant_builder_init (&overrides_builder, (GVariantType*)"a(ssssuu)");
+    rpmfiInit (self->fi, 0);
+    while (rpmfiNext (self->fi) >= 0)
+      {
+        const char *user = rpmfiFUser (self->fi) ?: "root";
+        const char *group = rpmfiFGroup (self->fi) ?: "root";
+        if (g_str_equal (user, "root") && g_str_equal (group, "root"))
+          continue;
+
+        g_variant_builder_add (&overrides_builder, "(ssssuu)",
+                               rpmfiFN (self->fi), user, group,
+                               rpmfiFCaps (self->fi) ?: "",
+                               (guint32) rpmfiFMode (self->fi),
+                               (guint32) rpmfiFFlags (self->fi));
+      }
+    g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.rpmfi_overrides",
+                           g_variant_builder_end (&overrides_builder));
+  }
+
   /* let's be nice to our future selves just in case */
   g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.unpack_version",
                          g_variant_new_uint32 (1));
@@ -493,26 +531,21 @@ build_metadata_variant (RpmOstreeUnpacker *self,
    * compatible increments.
    */
   g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.unpack_minor_version",
-                         g_variant_new_uint32 (4));
+                         g_variant_new_uint32 (5));
 
   if (self->pkg)
     {
-      DnfRepo *repo = dnf_package_get_repo (self->pkg);
-      if (repo)
+      if (self->repo_id)
         {
           g_variant_builder_add (&metadata_builder, "{sv}", "rpmostree.repo",
-                                 repo_metadata_to_variant (repo));
+                                 repo_metadata_to_variant (self->repo_id));
         }
 
       /* include a checksum of the RPM as a whole; the actual algo used depends
        * on how the repodata was created, so just keep a repr */
-      g_autofree char* chksum_repr = NULL;
-      if (!rpmostree_get_repodata_chksum_repr (self->pkg, &chksum_repr, error))
-        return FALSE;
-
       g_variant_builder_add (&metadata_builder, "{sv}",
                              "rpmostree.repodata_checksum",
-                             g_variant_new_string (chksum_repr));
+                             g_variant_new_string (self->repodata_chksum_repr));
     }
 
   *out_variant = g_variant_builder_end (&metadata_builder);
@@ -522,6 +555,7 @@ build_metadata_variant (RpmOstreeUnpacker *self,
 typedef struct
 {
   RpmOstreeUnpacker  *self;
+  OstreeSePolicy  *sepolicy;
   GError  **error;
 } cb_data;
 
@@ -666,21 +700,59 @@ unprivileged_filter_cb (OstreeRepo         *repo,
   return OSTREE_REPO_COMMIT_FILTER_ALLOW;
 }
 
+/* We do the SELinux labeling here rather than giving the modifier our
+ * sepolicy, since unpackers are imported from several threads at once and
+ * lookups on a shared policy need to go through the lock.
+ */
 static GVariant*
 xattr_cb (OstreeRepo  *repo,
           const char  *path,
           GFileInfo   *file_info,
           gpointer     user_data)
 {
-  RpmOstreeUnpacker *self = user_data;
+  RpmOstreeUnpacker *self = ((cb_data*)user_data)->self;
+  OstreeSePolicy *sepolicy = ((cb_data*)user_data)->sepolicy;
+  GError **error = ((cb_data*)user_data)->error;
   const char *fcaps = NULL;
+  g_autofree char *label = NULL;
 
   get_rpmfi_override (self, path, NULL, NULL, &fcaps);
 
-  if (fcaps != NULL && fcaps[0] != '\0')
-    return rpmostree_fcap_to_xattr_variant (fcaps);
+  if (sepolicy && (!error || *error == NULL))
+    {
+      const guint32 mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
+      if (!rpmostree_sepolicy_get_label_locked (sepolicy, path, mode, &label,
+                                                NULL, error))
+        return NULL;
+      if (!label)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Failed to look up SELinux label for '%s'", path);
+          return NULL;
+        }
+    }
+
+  const gboolean have_fcaps = fcaps != NULL && fcaps[0] != '\0';
+  if (!have_fcaps && !label)
+    return NULL;
 
-  return NULL;
+  g_auto(GVariantBuilder) builder;
+  g_variant_builder_init (&builder, (GVariantType*)"a(ayay)");
+  if (have_fcaps)
+    {
+      g_autoptr(GVariant) fcaps_xattrs = rpmostree_fcap_to_xattr_variant (fcaps);
+      const guint n = g_variant_n_children (fcaps_xattrs);
+      for (guint i = 0; i < n; i++)
+        {
+          g_autoptr(GVariant) xattr = g_variant_get_child_value (fcaps_xattrs, i);
+          g_variant_builder_add_value (&builder, xattr);
+        }
+    }
+  if (label)
+    g_variant_builder_add (&builder, "(@ay@ay)",
+                           g_variant_new_bytestring ("security.selinux"),
+                           g_variant_new_bytestring (label));
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
 }
 
 static gboolean
@@ -702,7 +774,7 @@ import_rpm_to_repo (RpmOstreeUnpacker *self,
   guint64 buildtime = 0;
 
   GError *cb_error = NULL;
-  cb_data fdata = { self, &cb_error };
+  cb_data fdata = { self, sepolicy, &cb_error };
   OstreeRepoCommitFilter filter;
 
   if ((self->flags & RPMOSTREE_UNPACKER_FLAGS_UNPRIVILEGED) > 0)
@@ -714,8 +786,7 @@ import_rpm_to_repo (RpmOstreeUnpacker *self,
   modifier_flags |= OSTREE_REPO_COMMIT_MODIFIER_FLAGS_ERROR_ON_UNLABELED;
   modifier = ostree_repo_commit_modifier_new (modifier_flags, filter, &fdata, NULL);
   ostree_repo_commit_modifier_set_xattr_callback (modifier, xattr_cb,
-                                                  NULL, self);
-  ostree_repo_commit_modifier_set_sepolicy (modifier, sepolicy);
+                                                  NULL, &fdata);
 
   opts.ignore_unsupported_content = TRUE;
   opts.autocreate_parents = TRUE;
@@ -800,6 +871,25 @@ out:
   return ret;
 }
 
+/*
+ * rpmostree_unpacker_import_to_repo:
+ *
+ * Like rpmostree_unpacker_unpack_to_ostree(), but @repo must already be in a
+ * transaction, and the cache branch is not set; use
+ * rpmostree_unpacker_get_ostree_branch() for that.  Distinct unpackers may be
+ * imported into the same transaction concurrently from different threads.
+ */
+gboolean
+rpmostree_unpacker_import_to_repo (RpmOstreeUnpacker *self,
+                                   OstreeRepo        *repo,
+                                   OstreeSePolicy    *sepolicy,
+                                   char             **out_csum,
+                                   GCancellable      *cancellable,
+                                   GError           **error)
+{
+  return import_rpm_to_repo (self, repo, sepolicy, out_csum, cancellable, error);
+}
+
 gboolean
 rpmostree_unpacker_unpack_to_ostree (RpmOstreeUnpacker *self,
                                      OstreeRepo        *repo,
@@ -77,6 +77,14 @@ rpmostree_unpacker_unpack_to_ostree (RpmOstreeUnpacker *unpacker,
                                      GCancellable      *cancellable,
                                      GError           **error);
 
+gboolean
+rpmostree_unpacker_import_to_repo (RpmOstreeUnpacker *unpacker,
+                                   OstreeRepo        *repo,
+                                   OstreeSePolicy    *sepolicy,
+                                   char             **out_commit,
+                                   GCancellable      *cancellable,
+                                   GError           **error);
+
 char *
 rpmostree_unpacker_get_nevra (RpmOstreeUnpacker *self);
 
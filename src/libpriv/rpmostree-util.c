@@ -285,12 +285,17 @@ rpmostree_str_replace (const char  *buf,
   return g_regex_replace_literal (regex, buf, -1, 0, new, 0, error);
 }
 
+/* Gather the checksums of all content objects reachable from @iter into
+ * @out_files; @seen_dirs holds the dirtrees we've already walked so that
+ * directories shared between commits are only loaded once.
+ */
 static gboolean
-pull_content_only_recurse (OstreeRepo  *dest,
-                           OstreeRepo  *src,
-                           OstreeRepoCommitTraverseIter *iter,
-                           GCancellable *cancellable,
-                           GError      **error)
+collect_content_recurse (OstreeRepo  *src,
+                         OstreeRepoCommitTraverseIter *iter,
+                         GHashTable  *seen_dirs,
+                         GHashTable  *out_files,
+                         GCancellable *cancellable,
+                         GError      **error)
 {
   gboolean done = FALSE;
 
@@ -312,10 +317,8 @@ pull_content_only_recurse (OstreeRepo  *dest,
             char *checksum;
 
             ostree_repo_commit_traverse_iter_get_file (iter, &name, &checksum);
-
-            if (!ostree_repo_import_object_from (dest, src, OSTREE_OBJECT_TYPE_FILE,
-                                                 checksum, cancellable, error))
-              return FALSE;
+            if (!g_hash_table_contains (out_files, checksum))
+              g_hash_table_add (out_files, g_strdup (checksum));
           }
           break;
         case OSTREE_REPO_COMMIT_ITER_RESULT_DIR:
@@ -329,6 +332,10 @@ pull_content_only_recurse (OstreeRepo  *dest,
 
             ostree_repo_commit_traverse_iter_get_dir (iter, &name, &content_checksum, &meta_checksum);
 
+            if (g_hash_table_contains (seen_dirs, content_checksum))
+              break;
+            g_hash_table_add (seen_dirs, g_strdup (content_checksum));
+
             if (!ostree_repo_load_variant (src, OSTREE_OBJECT_TYPE_DIR_TREE,
                                            content_checksum, &dirtree,
                                            error))
@@ -339,7 +346,8 @@ pull_content_only_recurse (OstreeRepo  *dest,
                                                                 error))
               return FALSE;
 
-            if (!pull_content_only_recurse (dest, src, &subiter, cancellable, error))
+            if (!collect_content_recurse (src, &subiter, seen_dirs, out_files,
+                                          cancellable, error))
               return FALSE;
           }
           break;
@@ -349,34 +357,149 @@ pull_content_only_recurse (OstreeRepo  *dest,
   return TRUE;
 }
 
-/* Migrate only the content (.file) objects from src+src_commit into dest.
- * Used for package layering.
+typedef struct {
+  OstreeRepo *dest;
+  OstreeRepo *src;
+  GPtrArray *checksums;
+  volatile gint next;
+  GCancellable *cancellable;
+  GMutex lock;
+  GError *error;
+} PullContentData;
+
+static gpointer
+pull_content_thread (gpointer user_data)
+{
+  PullContentData *data = user_data;
+  g_autoptr(GError) local_error = NULL;
+
+  while (TRUE)
+    {
+      const gint i = g_atomic_int_add (&data->next, 1);
+      if (i >= (gint)data->checksums->len)
+        break;
+
+      if (!ostree_repo_import_object_from (data->dest, data->src, OSTREE_OBJECT_TYPE_FILE,
+                                           data->checksums->pdata[i],
+                                           data->cancellable, &local_error))
+        break;
+
+      /* Stop early if another worker failed */
+      g_mutex_lock (&data->lock);
+      const gboolean failed = data->error != NULL;
+      g_mutex_unlock (&data->lock);
+      if (failed)
+        break;
+    }
+
+  if (local_error)
+    {
+      /* Make sure the others stop too */
+      g_atomic_int_set (&data->next, (gint)data->checksums->len);
+      g_mutex_lock (&data->lock);
+      if (!data->error)
+        data->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&data->lock);
+    }
+
+  return NULL;
+}
+
+/* Migrate only the content (.file) objects from all of @src_commits in src
+ * into dest.  Objects are deduplicated across commits, the ones dest already
+ * has are skipped, and the rest are imported (usually hardlinked) using up to
+ * @n_jobs threads; 0 means the number of processors.
  */
 gboolean
-rpmostree_pull_content_only (OstreeRepo  *dest,
-                             OstreeRepo  *src,
-                             const char  *src_commit,
-                             GCancellable *cancellable,
-                             GError      **error)
+rpmostree_pull_content_only_batch (OstreeRepo  *dest,
+                                   OstreeRepo  *src,
+                                   GPtrArray   *src_commits,
+                                   guint        n_jobs,
+                                   GCancellable *cancellable,
+                                   GError      **error)
 {
-  g_autoptr(GVariant) commitdata = NULL;
-  ostree_cleanup_repo_commit_traverse_iter
-    OstreeRepoCommitTraverseIter iter = { 0, };
+  g_autoptr(GHashTable) seen_dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GHashTable) files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
-  if (!ostree_repo_load_commit (src, src_commit, &commitdata, NULL, error))
-    return FALSE;
+  for (guint i = 0; i < src_commits->len; i++)
+    {
+      const char *src_commit = src_commits->pdata[i];
+      g_autoptr(GVariant) commitdata = NULL;
+      ostree_cleanup_repo_commit_traverse_iter
+        OstreeRepoCommitTraverseIter iter = { 0, };
 
-  if (!ostree_repo_commit_traverse_iter_init_commit (&iter, src, commitdata,
-                                                     OSTREE_REPO_COMMIT_TRAVERSE_FLAG_NONE,
-                                                     error))
-    return FALSE;
+      if (!ostree_repo_load_commit (src, src_commit, &commitdata, NULL, error))
+        return FALSE;
 
-  if (!pull_content_only_recurse (dest, src, &iter, cancellable, error))
-    return FALSE;
+      if (!ostree_repo_commit_traverse_iter_init_commit (&iter, src, commitdata,
+                                                         OSTREE_REPO_COMMIT_TRAVERSE_FLAG_NONE,
+                                                         error))
+        return FALSE;
+
+      if (!collect_content_recurse (src, &iter, seen_dirs, files, cancellable, error))
+        return FALSE;
+    }
+
+  g_autoptr(GPtrArray) missing = g_ptr_array_new ();
+  GLNX_HASH_TABLE_FOREACH (files, const char*, checksum)
+    {
+      gboolean have_object;
+      if (!ostree_repo_has_object (dest, OSTREE_OBJECT_TYPE_FILE, checksum,
+                                   &have_object, cancellable, error))
+        return FALSE;
+      if (!have_object)
+        g_ptr_array_add (missing, (char*)checksum);
+    }
+
+  if (missing->len == 0)
+    return TRUE;
+
+  if (n_jobs == 0)
+    n_jobs = g_get_num_processors ();
+  n_jobs = MIN (n_jobs, missing->len);
+
+  PullContentData data = { dest, src, missing, 0, cancellable, };
+  g_mutex_init (&data.lock);
+
+  g_autoptr(GPtrArray) threads = g_ptr_array_new ();
+  for (guint i = 1; i < n_jobs; i++)
+    g_ptr_array_add (threads, g_thread_new ("pull-content", pull_content_thread, &data));
+  /* The calling thread does its share too */
+  (void) pull_content_thread (&data);
+  for (guint i = 0; i < threads->len; i++)
+    g_thread_join (threads->pdata[i]);
+
+  g_mutex_clear (&data.lock);
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      return FALSE;
+    }
 
   return TRUE;
 }
 
+G_LOCK_DEFINE_STATIC (sepolicy);
+
+/* Like ostree_sepolicy_get_label(), but safe to call from multiple threads
+ * on the same @sepolicy; libselinux doesn't promise lookups on one handle
+ * are.  Everything that labels from worker threads must go through this.
+ */
+gboolean
+rpmostree_sepolicy_get_label_locked (OstreeSePolicy *sepolicy,
+                                     const char     *path,
+                                     guint32         mode,
+                                     char          **out_label,
+                                     GCancellable   *cancellable,
+                                     GError        **error)
+{
+  G_LOCK (sepolicy);
+  gboolean ret = ostree_sepolicy_get_label (sepolicy, path, mode, out_label,
+                                            cancellable, error);
+  G_UNLOCK (sepolicy);
+  return ret;
+}
+
 G_LOCK_DEFINE_STATIC (pathname_cache);
 
 /**
@@ -413,16 +536,111 @@ rpmostree_file_get_path_cached (GFile *file)
   return path;
 }
 
+/* A set of paths, used to answer "is this path underneath anything we've
+ * already seen?" in time proportional to the length of the queried path
+ * rather than to the number of entries.  This is the case when walking
+ * recursive listings (rpmfi, ostree diffs) that include both a directory
+ * and all of its children.
+ *
+ * Each entry is stored normalized (no leading, trailing or duplicate
+ * slashes); a lookup walks up the path components of the query and probes
+ * the table at each level.
+ */
+struct RpmOstreePathSet {
+  GHashTable *paths;
+};
+
+static char *
+path_set_normalize (const char *path)
+{
+  GString *buf = g_string_sized_new (strlen (path));
+  const char *p = path;
+
+  while (*p)
+    {
+      p += strspn (p, "/");
+      if (!*p)
+        break;
+      const size_t n = strcspn (p, "/");
+      if (buf->len > 0)
+        g_string_append_c (buf, '/');
+      g_string_append_len (buf, p, n);
+      p += n;
+    }
+
+  return g_string_free (buf, FALSE);
+}
+
+RpmOstreePathSet *
+rpmostree_path_set_new (void)
+{
+  RpmOstreePathSet *set = g_new0 (RpmOstreePathSet, 1);
+  set->paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  return set;
+}
+
+void
+rpmostree_path_set_free (RpmOstreePathSet *set)
+{
+  if (!set)
+    return;
+  g_hash_table_unref (set->paths);
+  g_free (set);
+}
+
+guint
+rpmostree_path_set_size (RpmOstreePathSet *set)
+{
+  return g_hash_table_size (set->paths);
+}
+
+/* Add @path to @set; leading and trailing slashes are ignored, so "/usr/lib/"
+ * and "usr/lib" are the same entry. */
+void
+rpmostree_path_set_add (RpmOstreePathSet *set,
+                        const char       *path)
+{
+  char *normalized = path_set_normalize (path);
+  if (!*normalized)
+    {
+      g_free (normalized);
+      return;
+    }
+  g_hash_table_add (set->paths, normalized);
+}
+
+/* Returns %TRUE if @path itself is in @set */
+gboolean
+rpmostree_path_set_contains (RpmOstreePathSet *set,
+                             const char       *path)
+{
+  if (g_hash_table_size (set->paths) == 0)
+    return FALSE;
+  g_autofree char *normalized = path_set_normalize (path);
+  return g_hash_table_contains (set->paths, normalized);
+}
+
+/* Returns %TRUE if a strict parent directory of @path is in @set; e.g. with
+ * "usr/lib" in the set, "usr/lib/foo" matches, but "usr/lib" and
+ * "usr/libexec/foo" don't.
+ */
 gboolean
-rpmostree_str_has_prefix_in_ptrarray (const char *str,
-                                      GPtrArray  *prefixes)
+rpmostree_path_set_has_parent (RpmOstreePathSet *set,
+                               const char       *path)
 {
-  for (guint j = 0; j < prefixes->len; j++)
+  if (g_hash_table_size (set->paths) == 0)
+    return FALSE;
+
+  g_autofree char *buf = path_set_normalize (path);
+  for (char *slash = strchr (buf, '/'); slash; slash = strchr (slash + 1, '/'))
     {
-      const char *prefix = prefixes->pdata[j];
-      if (g_str_has_prefix (str, prefix))
+      *slash = '\0';
+      const gboolean found = g_hash_table_contains (set->paths, buf);
+      *slash = '/';
+      if (found)
         return TRUE;
     }
+
   return FALSE;
 }
 
@@ -73,11 +73,20 @@ rpmostree_str_replace (const char  *buf,
 
 
 gboolean
-rpmostree_pull_content_only (OstreeRepo  *dest,
-                             OstreeRepo  *src,
-                             const char  *src_commit,
-                             GCancellable *cancellable,
-                             GError      **error);
+rpmostree_pull_content_only_batch (OstreeRepo  *dest,
+                                   OstreeRepo  *src,
+                                   GPtrArray   *src_commits,
+                                   guint        n_jobs,
+                                   GCancellable *cancellable,
+                                   GError      **error);
+gboolean
+rpmostree_sepolicy_get_label_locked (OstreeSePolicy *sepolicy,
+                                     const char     *path,
+                                     guint32         mode,
+                                     char          **out_label,
+                                     GCancellable   *cancellable,
+                                     GError        **error);
+
 const char *
 rpmostree_file_get_path_cached (GFile *file);
 
@@ -94,9 +103,30 @@ void rpmostree_diff_print (OstreeRepo *repo,
                            GPtrArray *modified_old,
                            GPtrArray *modified_new);
 
+typedef struct RpmOstreePathSet RpmOstreePathSet;
+
+RpmOstreePathSet *
+rpmostree_path_set_new (void);
+
+void
+rpmostree_path_set_free (RpmOstreePathSet *set);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RpmOstreePathSet, rpmostree_path_set_free)
+
+guint
+rpmostree_path_set_size (RpmOstreePathSet *set);
+
+void
+rpmostree_path_set_add (RpmOstreePathSet *set,
+                        const char       *path);
+
+gboolean
+rpmostree_path_set_contains (RpmOstreePathSet *set,
+                             const char       *path);
+
 gboolean
-rpmostree_str_has_prefix_in_ptrarray (const char *str,
-                                      GPtrArray  *prefixes);
+rpmostree_path_set_has_parent (RpmOstreePathSet *set,
+                               const char       *path);
 
 gboolean
 rpmostree_str_ptrarray_contains (GPtrArray  *strs,
@@ -3,11 +3,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <glib-unix.h>
 #include "libglnx.h"
 #include "rpmostree-util.h"
 #include "rpmostree-core.h"
+#include "rpmostree-scripts.h"
 #include "rpmostree-unpacker.h"
 #include "libtest.h"
 
@@ -112,6 +115,193 @@ test_cache_branch_to_nevra (void)
   test_one_cache_branch_to_nevra ("rpmostree/pkg/vim-filesystem/2_3A7.4.160-1.el7__3.1.x86__64", "vim-filesystem-2:7.4.160-1.el7_3.1.x86_64");
 }
 
+static void
+test_path_set (void)
+{
+  g_autoptr(RpmOstreePathSet) set = rpmostree_path_set_new ();
+
+  g_assert (!rpmostree_path_set_has_parent (set, "usr/lib/foo"));
+
+  rpmostree_path_set_add (set, "usr/lib/");
+  rpmostree_path_set_add (set, "/etc//pki");
+  rpmostree_path_set_add (set, "/");
+  g_assert_cmpuint (rpmostree_path_set_size (set), ==, 2);
+
+  g_assert (rpmostree_path_set_contains (set, "usr/lib"));
+  g_assert (rpmostree_path_set_contains (set, "/etc/pki/"));
+  g_assert (!rpmostree_path_set_contains (set, "usr"));
+
+  g_assert (rpmostree_path_set_has_parent (set, "usr/lib/foo"));
+  g_assert (rpmostree_path_set_has_parent (set, "/usr/lib/foo/bar"));
+  g_assert (rpmostree_path_set_has_parent (set, "etc/pki/tls/certs"));
+  g_assert (!rpmostree_path_set_has_parent (set, "usr/lib"));
+  g_assert (!rpmostree_path_set_has_parent (set, "usr/libexec/foo"));
+  g_assert (!rpmostree_path_set_has_parent (set, "usr/li"));
+  g_assert (!rpmostree_path_set_has_parent (set, "etc/pki2/foo"));
+}
+
+/* Run with -m perf; lookups against a large set shouldn't depend on its size */
+static void
+test_path_set_perf (void)
+{
+  if (!g_test_perf ())
+    return;
+
+  const guint n = 100000;
+  g_autoptr(RpmOstreePathSet) set = rpmostree_path_set_new ();
+  for (guint i = 0; i < n; i++)
+    {
+      g_autofree char *dir = g_strdup_printf ("usr/share/d%u", i);
+      rpmostree_path_set_add (set, dir);
+    }
+
+  g_test_timer_start ();
+  guint n_matched = 0;
+  for (guint i = 0; i < n; i++)
+    {
+      g_autofree char *path = g_strdup_printf ("usr/share/d%u/sub/file", i);
+      if (rpmostree_path_set_has_parent (set, path))
+        n_matched++;
+    }
+  g_test_minimized_result (g_test_timer_elapsed (), "%u lookups in a set of %u: %gs",
+                           n, n, g_test_timer_last ());
+  g_assert_cmpuint (n_matched, ==, n);
+}
+
+/* Lay out @n_files files over @n_pkgs packages, then remove them like
+ * delete_package_from_root() does, and return how long the removal took.
+ * Each package has a directory of its own plus files in a shared one, so we
+ * go through both the rm -rf and the "already deleted parent" paths.
+ */
+static double
+time_package_removal (guint n_pkgs,
+                      guint n_files)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *tmpdir = NULL;
+  glnx_fd_close int rootfs_dfd = -1;
+  g_assert (rpmostree_mkdtemp ("removal-XXXXXX", &tmpdir, &rootfs_dfd, &error));
+  g_assert_no_error (error);
+  g_assert (glnx_shutil_mkdir_p_at (rootfs_dfd, "usr/lib", 0755, NULL, &error));
+  g_assert_no_error (error);
+
+  const guint files_per_pkg = n_files / n_pkgs;
+  g_autoptr(GPtrArray) pkgs = g_ptr_array_new_with_free_func ((GDestroyNotify)g_ptr_array_unref);
+  for (guint p = 0; p < n_pkgs; p++)
+    {
+      GPtrArray *files = g_ptr_array_new_with_free_func (g_free);
+      g_autofree char *pkgdir = g_strdup_printf ("usr/share/pkg%u", p);
+      g_assert (glnx_shutil_mkdir_p_at (rootfs_dfd, pkgdir, 0755, NULL, &error));
+      g_assert_no_error (error);
+      /* Sorted like the rpmfi, so the directory comes first */
+      g_ptr_array_add (files, g_strconcat ("/", pkgdir, NULL));
+      for (guint i = 0; i < files_per_pkg; i++)
+        {
+          char *path = (i % 2) ? g_strdup_printf ("/%s/f%u", pkgdir, i)
+                               : g_strdup_printf ("/usr/lib/pkg%u-f%u", p, i);
+          glnx_fd_close int fd = openat (rootfs_dfd, path + 1,
+                                         O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+          g_assert_cmpint (fd, >=, 0);
+          g_ptr_array_add (files, path);
+        }
+      g_ptr_array_add (pkgs, files);
+    }
+
+  g_test_timer_start ();
+  for (guint p = 0; p < pkgs->len; p++)
+    {
+      GPtrArray *files = pkgs->pdata[p];
+      g_autoptr(RpmOstreePathSet) deleted_dirs = rpmostree_path_set_new ();
+      for (guint i = 0; i < files->len; i++)
+        {
+          const char *path = files->pdata[i];
+          const guint mode = i == 0 ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+          g_assert (rpmostree_delete_package_path (rootfs_dfd, deleted_dirs, path,
+                                                   mode, NULL, &error));
+          g_assert_no_error (error);
+        }
+    }
+  const double elapsed = g_test_timer_elapsed ();
+
+  struct stat stbuf;
+  g_assert_cmpint (fstatat (rootfs_dfd, "usr/lib/pkg0-f0", &stbuf, 0), <, 0);
+  g_assert_cmpint (fstatat (rootfs_dfd, "usr/share/pkg0", &stbuf, 0), <, 0);
+
+  g_assert (glnx_shutil_rm_rf_at (AT_FDCWD, tmpdir, NULL, &error));
+  g_assert_no_error (error);
+  return elapsed;
+}
+
+/* Run with -m perf; removing packages should scale linearly with the number
+ * of files in them.
+ */
+static void
+test_package_removal_perf (void)
+{
+  if (!g_test_perf ())
+    return;
+
+  const guint n_pkgs = 50;
+  const guint small = 25000;
+  const guint large = 100000;
+  const double small_elapsed = time_package_removal (n_pkgs, small);
+  const double large_elapsed = time_package_removal (n_pkgs, large);
+  g_test_minimized_result (large_elapsed, "Removing %u files in %u packages: %gs (%u files: %gs)",
+                           large, n_pkgs, large_elapsed, small, small_elapsed);
+  /* 4x the files; quadratic behaviour would be 16x */
+  g_assert_cmpfloat (large_elapsed / MAX (small_elapsed, 0.01), <, 8);
+}
+
+static void
+assert_trigger_line (const char *line,
+                     const char *expected_command,
+                     gboolean    expected_may_fail)
+{
+  gboolean may_fail = !expected_may_fail;
+  const char *command = rpmostree_script_trigger_for_line (line, &may_fail);
+  g_assert_cmpstr (command, ==, expected_command);
+  if (expected_command)
+    g_assert_cmpint (may_fail, ==, expected_may_fail);
+}
+
+static void
+test_script_trigger_lines (void)
+{
+  /* %post -p /sbin/ldconfig, where the program and args are joined */
+  assert_trigger_line ("/sbin/ldconfig", "ldconfig", FALSE);
+  assert_trigger_line ("/usr/sbin/ldconfig", "ldconfig", FALSE);
+  assert_trigger_line ("ldconfig", "ldconfig", FALSE);
+
+  /* Whitespace */
+  assert_trigger_line ("  /sbin/ldconfig\t", "ldconfig", FALSE);
+  assert_trigger_line ("/usr/bin/glib-compile-schemas \t /usr/share/glib-2.0/schemas",
+                       "glib-compile-schemas /usr/share/glib-2.0/schemas", FALSE);
+
+  /* Comments */
+  assert_trigger_line ("/sbin/ldconfig # refresh the cache", "ldconfig", FALSE);
+  assert_trigger_line ("/sbin/ldconfig\t#", "ldconfig", FALSE);
+  assert_trigger_line ("# /sbin/ldconfig", NULL, FALSE);
+
+  /* Redirections and error suppression */
+  assert_trigger_line ("/sbin/ldconfig >/dev/null 2>&1", "ldconfig", FALSE);
+  assert_trigger_line ("/usr/bin/fc-cache &> /dev/null || :", "fc-cache -s", TRUE);
+  assert_trigger_line ("update-desktop-database -q || true", "update-desktop-database", TRUE);
+  assert_trigger_line ("/usr/bin/update-mime-database /usr/share/mime 2> /dev/null || : # quiet",
+                       "update-mime-database /usr/share/mime", TRUE);
+
+  /* Anything else must be run as is */
+  assert_trigger_line ("", NULL, FALSE);
+  assert_trigger_line ("ldconfigx", NULL, FALSE);
+  assert_trigger_line ("/sbin/ldconfig -r /sysroot", NULL, FALSE);
+  assert_trigger_line ("/sbin/ldconfig; rm -f /etc/foo", NULL, FALSE);
+  assert_trigger_line ("/sbin/ldconfig && touch /etc/foo", NULL, FALSE);
+  assert_trigger_line ("/sbin/ldconfig || exit 1", NULL, FALSE);
+  assert_trigger_line ("/sbin/ldconfig > /tmp/log", NULL, FALSE);
+  assert_trigger_line ("echo /sbin/ldconfig", NULL, FALSE);
+  assert_trigger_line ("/sbin/ldconfig#", NULL, FALSE);
+  assert_trigger_line ("glib-compile-schemas /usr/local/share/glib-2.0/schemas", NULL, FALSE);
+}
+
 static void
 test_variant_to_nevra(void)
 {
@@ -145,8 +335,16 @@ test_variant_to_nevra(void)
   g_assert_no_error (error);
   g_assert (ret);
 
+  g_autoptr(RpmOstreePkgCacheIndex) index = rpmostree_pkgcache_index_new (repo, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (index);
+
+  g_assert_cmpstr (rpmostree_pkgcache_index_lookup_nevra (index, nevra), ==,
+                   "rpmostree/pkg/foo/1.0-1.x86__64");
+  g_assert (rpmostree_pkgcache_index_lookup_nevra (index, "bar-1.0-1.x86_64") == NULL);
+
   g_autoptr(GVariant) header = NULL;
-  ret = rpmostree_pkgcache_find_pkg_header (repo, nevra, NULL, &header, NULL, &error);
+  ret = rpmostree_pkgcache_find_pkg_header (index, nevra, NULL, &header, NULL, &error);
   g_assert_no_error (error);
   g_assert (ret);
 
@@ -156,7 +354,7 @@ test_variant_to_nevra(void)
   g_autofree char *trelease;
   g_autofree char *tarch;
 
-  ret = rpmostree_get_nevra_from_pkgcache (repo, nevra, &tname, &tepoch, &tversion,
+  ret = rpmostree_get_nevra_from_pkgcache (index, nevra, &tname, &tepoch, &tversion,
                                            &trelease, &tarch, NULL, &error);
   g_assert_no_error (error);
   g_assert (ret);
@@ -176,6 +374,10 @@ main (int   argc,
 
   g_test_add_func ("/utils/varsubst", test_varsubst_string);
   g_test_add_func ("/utils/cachebranch_to_nevra", test_cache_branch_to_nevra);
+  g_test_add_func ("/utils/path_set", test_path_set);
+  g_test_add_func ("/utils/path_set/perf", test_path_set_perf);
+  g_test_add_func ("/core/package_removal/perf", test_package_removal_perf);
+  g_test_add_func ("/scripts/trigger_lines", test_script_trigger_lines);
   g_test_add_func ("/unpacker/variant_to_nevra", test_variant_to_nevra);
 
   return g_test_run ();
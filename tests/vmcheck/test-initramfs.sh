@@ -114,3 +114,27 @@ vm_cmd lsinitrd $initramfs > lsinitrd.txt
 assert_not_file_has_content lsinitrd.txt /etc/rpmostree-initramfs-testing
 
 echo "ok initramfs args"
+
+if vm_rpmostree initramfs --enable --arg=-I --etc-overlay=/etc/foo 2>err.txt; then
+    assert_not_reached "Unexpectedly succeeded with --arg and --etc-overlay"
+fi
+assert_file_has_content err.txt "etc-overlay.*not with --arg"
+vm_cmd touch /etc/rpmostree-initramfs-overlay-testing
+vm_rpmostree initramfs --enable --etc-overlay=/etc/rpmostree-initramfs-overlay-testing
+vm_reboot
+vm_assert_status_jq \
+    '.deployments[0].booted' \
+    '.deployments[0]["regenerate-initramfs"]' \
+    '.deployments[0]["initramfs-args"]|not' \
+    '.deployments[0]["initramfs-etc"]|index("/etc/rpmostree-initramfs-overlay-testing") == 0'
+vm_rpmostree initramfs > initramfs.txt
+assert_file_has_content initramfs.txt "Initramfs /etc overlay: /etc/rpmostree-initramfs-overlay-testing"
+initramfs=$(vm_cmd grep ^initrd /boot/loader/entries/ostree-$osname-0.conf | sed -e 's,initrd ,/boot/,')
+test -n "${initramfs}"
+# The overlay is a separate archive appended to the base; zcat decompresses
+# concatenated gzip streams together
+vm_cmd "/usr/lib/dracut/skipcpio $initramfs | zcat | grep -a -q etc/rpmostree-initramfs-overlay-testing"
+vm_rpmostree initramfs --disable
+vm_assert_status_jq '.deployments[0]["initramfs-etc"]|not'
+
+echo "ok initramfs etc overlay"
@@ -132,3 +132,16 @@ fi
 vm_rpmostree upgrade | tee output.txt
 assert_file_has_content output.txt '^Importing:'
 echo "ok invalidate pkgcache from RPM chksum"
+
+# requesting pkgs already in the base shouldn't require a new deployment if
+# the pending one already has the same tree
+vm_rpmostree cleanup -p
+vm_rpmostree install bash
+vm_assert_status_jq '.deployments|length == 2' \
+  '.deployments[0]["requested-packages"]|index("bash") >= 0'
+vm_rpmostree install coreutils | tee output.txt
+assert_file_has_content output.txt 'Updating origin of pending deployment'
+vm_assert_status_jq '.deployments|length == 2' \
+  '.deployments[0]["requested-packages"]|length == 2'
+vm_rpmostree cleanup -p
+echo "ok origin-only change updates pending deployment"
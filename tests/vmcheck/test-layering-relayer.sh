@@ -99,10 +99,17 @@ vm_assert_status_jq ".deployments[0][\"base-checksum\"] == \"${commit}\"" \
                  '.deployments[0]["packages"]|index("foo") >= 0' \
                  '.deployments[0]["packages"]|index("bar")|not'
 vm_build_rpm bar
-vm_rpmostree install bar
+# same base, only adding a package --> should build on top of the current layer
+booted_csum=$(vm_get_booted_csum)
+vm_rpmostree install bar | tee output.txt
+assert_file_has_content output.txt "Checking out tree ${booted_csum:0:7}"
+assert_not_file_has_content output.txt "assembling from the base"
 vm_assert_status_jq ".deployments[0][\"base-checksum\"] == \"${commit}\"" \
                  '.deployments[0]["packages"]|index("foo") >= 0' \
                  '.deployments[0]["packages"]|index("bar") >= 0'
+new_csum=$(vm_get_deployment_info 0 checksum)
+vm_cmd ostree show --print-metadata-key=rpmostree.previous-layer ${new_csum} > previous.txt
+assert_file_has_content previous.txt ${booted_csum}
 commit=$(vm_cmd ostree commit -b vmcheck \
                 --tree=ref=vmcheck --add-metadata-string=version=my-commit2)
 vm_rpmostree rebase ${commit}